@@ -0,0 +1,719 @@
+// Scalpel Copyright (C) 2005-6 by Golden G. Richard III.
+// Written by Golden G. Richard III.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+
+// Multi-pattern search for Scalpel.  Rather than walking each buffer
+// once per header and once per footer, all needles in the
+// configuration file are compiled into a single Aho-Corasick
+// automaton, which examines every byte of a buffer exactly once.
+//
+// Aho-Corasick doesn't know about wildcards or case insensitivity, so
+// the automaton is built from the same "anchor" (a run of
+// non-wildcard characters, see findNeedleAnchor()) that the
+// Boyer-Moore search looks for in each needle.  Letters in anchors of
+// case-insensitive needles are folded into a single input class.
+// Every anchor hit is then verified against the complete needle with
+// memwildcardcmp(), using the needle's own case sensitivity, so the
+// set of matches is exactly the set the Boyer-Moore search finds.
+// Needles consisting entirely of wildcards have no anchor and match
+// at every position.
+//
+// Headers of rules that only match at aligned offsets (ALIGN= in the
+// configuration file, or -q) are left out of the automaton.  They are
+// tested directly at each aligned offset instead, by
+// searchBufferAligned(), which reads only one word per cluster.
+//
+// Wiped and unallocated areas of disk images are mostly long runs of
+// a single byte value, usually 0x00 or 0xFF.  searchBuffer() finds
+// such runs a sector at a time and searches only the data between
+// them, plus enough of each run for needles that cross its ends.  A
+// needle that matches inside a run, such as one made of zeros, matches
+// at every position in it, so those hits are added without a search.
+
+#include "scalpel.h"
+
+// anchors are truncated to this length--longer anchors don't reduce
+// the number of false candidates enough to justify the extra states
+#define AC_MAX_ANCHOR_LENGTH   16
+
+// with few needles, searching for each one separately with the
+// vectorized kernel in helpers.c is faster than the automaton.  The
+// break-even point is about this many needles per 64 positions the
+// kernel examines per step (measured: ~32 needles for AVX2, ~16 for
+// SSE2).  Without a vectorized kernel, only a lone needle is faster.
+#define PER_NEEDLE_SEARCH_LIMIT   32
+
+// the per-needle search runs every needle over one tile of the buffer
+// before moving on to the next, so each tile is read from memory once
+// and then stays in the L2 cache, instead of streaming the whole
+// buffer through the cache once per needle
+#define SEARCH_TILE_SIZE          (256 * KILOBYTE)
+
+// constant fill is detected in sectors of this size, aligned in the
+// image, and only runs at least this long are skipped (shorter ones
+// don't repay splitting the search)
+#define CONSTANT_FILL_SECTOR      512
+#define CONSTANT_FILL_MIN_RUN     (8 * CONSTANT_FILL_SECTOR)
+
+
+static void addPattern(struct SearchAutomaton *ac, int rule, int isfooter,
+		       char *needle, int len, int casesensitive,
+		       size_t anchor, size_t anchorlength,
+		       unsigned int alignment) {
+
+  struct SearchPattern *p = &(ac->patterns[ac->numpatterns++]);
+  unsigned char mask[sizeof(unsigned long long)];
+  unsigned char fold[sizeof(unsigned long long)];
+  unsigned char value[sizeof(unsigned long long)];
+  unsigned char ch;
+  int i;
+
+  p->rule = rule;
+  p->isfooter = isfooter;
+  p->needle = needle;
+  p->length = len;
+  p->casesensitive = casesensitive;
+  p->anchoroffset = anchor;
+  p->anchorlength = anchorlength;
+  if (p->anchorlength > AC_MAX_ANCHOR_LENGTH) {
+    p->anchorlength = AC_MAX_ANCHOR_LENGTH;
+  }
+
+  // the first 8 bytes of the needle, as a word that can be compared
+  // against a word of the buffer in one step.  Built bytewise, so it
+  // doesn't depend on byte order.
+  p->alignment = alignment > 1 ? alignment : 0;
+  for (i = 0; i < (int)sizeof(unsigned long long); i++) {
+    ch = i < len ? (unsigned char)needle[i] : 0;
+    mask[i] = (i < len && needle[i] != wildcard) ? 0xFF : 0x00;
+    fold[i] = (! casesensitive && isalpha(ch)) ? 0x20 : 0x00;
+    value[i] = (ch | fold[i]) & mask[i];
+  }
+  memcpy(&(p->prefixmask), mask, sizeof(unsigned long long));
+  memcpy(&(p->prefixfold), fold, sizeof(unsigned long long));
+  memcpy(&(p->prefixvalue), value, sizeof(unsigned long long));
+}
+
+
+// fold a needle character for case-insensitive needles, so that 'a'
+// and 'A' share an input class
+static unsigned char foldCharacter(struct SearchAutomaton *ac, unsigned char c) {
+  return ac->foldable[c] ? tolower(c) : c;
+}
+
+
+// build the search automaton for all header and footer needles in
+// state->SearchSpec.  Called once, after the configuration file has
+// been read, and again for each image file whose offsets were partly
+// read from a saved header/footer database (-H), leaving out the
+// rules that were.
+int buildSearchAutomaton(struct scalpelState *state) {
+
+  struct SearchAutomaton *ac;
+  struct SearchPattern *p;
+  int needlenum, i, k, c, s, t, maxstates, head, tail, nc;
+  int *trie, *fail, *queue, *own, *ownnext, *order, *newid;
+  int numoutputs, outputstorage;
+  int *outstart, *outcount, *outputs;
+  unsigned char ch;
+
+  ac = (struct SearchAutomaton *)malloc(sizeof(struct SearchAutomaton));
+  checkMemoryAllocation(state, ac, __LINE__, __FILE__, "search automaton");
+  memset(ac, 0, sizeof(struct SearchAutomaton));
+
+  ac->patterns = (struct SearchPattern *)
+    malloc(2 * (state->specLines + 1) * sizeof(struct SearchPattern));
+  checkMemoryAllocation(state, ac->patterns, __LINE__, __FILE__, "search patterns");
+
+  // with -r, an unaligned header can hide an overlapping aligned one,
+  // so aligned headers are searched for everywhere and the unaligned
+  // ones are discarded when carving
+  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
+    struct SearchSpecLine *currentneedle = &(state->SearchSpec[needlenum]);
+    if (currentneedle->fromdatabase) {
+      continue;
+    }
+    addPattern(ac, needlenum, FALSE, currentneedle->begin,
+	       currentneedle->beginlength, currentneedle->casesensitive,
+	       currentneedle->begin_anchor, currentneedle->begin_anchorlength,
+	       state->noSearchOverlap ? 0 : currentneedle->alignment);
+    if (currentneedle->endlength) {
+      addPattern(ac, needlenum, TRUE, currentneedle->end,
+		 currentneedle->endlength, currentneedle->casesensitive,
+		 currentneedle->end_anchor, currentneedle->end_anchorlength, 0);
+    }
+  }
+
+  // letters appearing in anchors of case-insensitive needles are
+  // folded; everything else is matched exactly
+  for (k = 0; k < ac->numpatterns; k++) {
+    p = &(ac->patterns[k]);
+    if (! p->casesensitive && ! p->alignment) {
+      for (i = p->anchoroffset; i < p->anchoroffset + p->anchorlength; i++) {
+	ch = (unsigned char)p->needle[i];
+	if (isalpha(ch)) {
+	  ac->foldable[tolower(ch)] = 1;
+	  ac->foldable[toupper(ch)] = 1;
+	}
+      }
+    }
+  }
+
+  // input classes: class 0 is every byte that doesn't appear in any
+  // anchor, which always returns the automaton to the root
+  ac->numclasses = 1;
+  for (k = 0; k < ac->numpatterns; k++) {
+    p = &(ac->patterns[k]);
+    if (p->alignment) {
+      continue;
+    }
+    for (i = p->anchoroffset; i < p->anchoroffset + p->anchorlength; i++) {
+      ch = foldCharacter(ac, (unsigned char)p->needle[i]);
+      if (ac->classmap[ch] == 0) {
+	ac->classmap[ch] = ac->numclasses++;
+	if (ac->foldable[ch]) {
+	  ac->classmap[toupper(ch)] = ac->classmap[ch];
+	}
+      }
+    }
+  }
+  nc = ac->numclasses;
+
+  // build trie of anchors
+  maxstates = 1;
+  for (k = 0; k < ac->numpatterns; k++) {
+    maxstates += ac->patterns[k].anchorlength;
+  }
+
+  trie = (int *)malloc(maxstates * nc * sizeof(int));
+  checkMemoryAllocation(state, trie, __LINE__, __FILE__, "search automaton");
+  fail = (int *)malloc(maxstates * sizeof(int));
+  checkMemoryAllocation(state, fail, __LINE__, __FILE__, "search automaton");
+  queue = (int *)malloc(maxstates * sizeof(int));
+  checkMemoryAllocation(state, queue, __LINE__, __FILE__, "search automaton");
+  own = (int *)malloc(maxstates * sizeof(int));
+  checkMemoryAllocation(state, own, __LINE__, __FILE__, "search automaton");
+  ownnext = (int *)malloc((ac->numpatterns + 1) * sizeof(int));
+  checkMemoryAllocation(state, ownnext, __LINE__, __FILE__, "search automaton");
+  ac->wildpatterns = (int *)malloc((ac->numpatterns + 1) * sizeof(int));
+  checkMemoryAllocation(state, ac->wildpatterns, __LINE__, __FILE__, "search automaton");
+  ac->alignedpatterns = (int *)malloc((ac->numpatterns + 1) * sizeof(int));
+  checkMemoryAllocation(state, ac->alignedpatterns, __LINE__, __FILE__, "search automaton");
+
+  for (i = 0; i < maxstates * nc; i++) {
+    trie[i] = -1;
+  }
+  for (i = 0; i < maxstates; i++) {
+    own[i] = -1;
+    fail[i] = 0;
+  }
+
+  ac->numstates = 1;
+  for (k = 0; k < ac->numpatterns; k++) {
+    p = &(ac->patterns[k]);
+    if (p->alignment) {
+      ac->alignedpatterns[ac->numalignedpatterns++] = k;
+      continue;
+    }
+    if (p->length > ac->longestneedle) {
+      ac->longestneedle = p->length;
+    }
+    if (p->anchorlength == 0) {
+      // needle is nothing but wildcards
+      ac->wildpatterns[ac->numwildpatterns++] = k;
+      continue;
+    }
+    s = 0;
+    for (i = p->anchoroffset; i < p->anchoroffset + p->anchorlength; i++) {
+      c = ac->classmap[foldCharacter(ac, (unsigned char)p->needle[i])];
+      if (trie[s * nc + c] == -1) {
+	trie[s * nc + c] = ac->numstates++;
+      }
+      s = trie[s * nc + c];
+    }
+    // several needles may share an anchor
+    ownnext[k] = own[s];
+    own[s] = k;
+  }
+
+  // breadth-first construction of failure links, turning the trie
+  // into a complete DFA.  Output lists are inherited along failure
+  // links, and fail[t] is always dequeued before t.
+  outputstorage = ac->numpatterns + 1;
+  outputs = (int *)malloc(outputstorage * sizeof(int));
+  checkMemoryAllocation(state, outputs, __LINE__, __FILE__, "search automaton");
+  outstart = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, outstart, __LINE__, __FILE__, "search automaton");
+  outcount = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, outcount, __LINE__, __FILE__, "search automaton");
+  numoutputs = 0;
+
+  head = tail = 0;
+  queue[tail++] = 0;
+  while (head < tail) {
+    s = queue[head++];
+
+    outstart[s] = numoutputs;
+    outcount[s] = 0;
+    for (k = own[s]; k != -1; k = ownnext[k]) {
+      if (numoutputs >= outputstorage) {
+	outputstorage *= 2;
+	outputs = (int *)realloc(outputs, outputstorage * sizeof(int));
+	checkMemoryAllocation(state, outputs, __LINE__, __FILE__, "search automaton");
+      }
+      outputs[numoutputs++] = k;
+      outcount[s]++;
+    }
+    if (s != 0) {
+      for (i = 0; i < outcount[fail[s]]; i++) {
+	if (numoutputs >= outputstorage) {
+	  outputstorage *= 2;
+	  outputs = (int *)realloc(outputs, outputstorage * sizeof(int));
+	  checkMemoryAllocation(state, outputs, __LINE__, __FILE__, "search automaton");
+	}
+	outputs[numoutputs++] = outputs[outstart[fail[s]] + i];
+	outcount[s]++;
+      }
+    }
+
+    for (c = 0; c < nc; c++) {
+      t = trie[s * nc + c];
+      if (t == -1) {
+	trie[s * nc + c] = (s == 0 ? 0 : trie[fail[s] * nc + c]);
+      }
+      else {
+	fail[t] = (s == 0 ? 0 : trie[fail[s] * nc + c]);
+	queue[tail++] = t;
+      }
+    }
+  }
+
+  // renumber states so that every state with output follows every
+  // state without, which lets the scan loop test for a match with a
+  // single comparison.  Transitions are stored premultiplied by the
+  // number of classes, so the next row is found without a multiply.
+  order = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, order, __LINE__, __FILE__, "search automaton");
+  newid = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, newid, __LINE__, __FILE__, "search automaton");
+
+  t = 0;
+  for (s = 0; s < ac->numstates; s++) {
+    if (outcount[s] == 0) {
+      newid[s] = t;
+      order[t++] = s;
+    }
+  }
+  ac->firstmatchrow = t * nc;
+  for (s = 0; s < ac->numstates; s++) {
+    if (outcount[s] != 0) {
+      newid[s] = t;
+      order[t++] = s;
+    }
+  }
+
+  ac->delta = (int *)malloc(ac->numstates * nc * sizeof(int));
+  checkMemoryAllocation(state, ac->delta, __LINE__, __FILE__, "search automaton");
+  ac->outstart = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, ac->outstart, __LINE__, __FILE__, "search automaton");
+  ac->outcount = (int *)malloc(ac->numstates * sizeof(int));
+  checkMemoryAllocation(state, ac->outcount, __LINE__, __FILE__, "search automaton");
+
+  for (t = 0; t < ac->numstates; t++) {
+    s = order[t];
+    for (c = 0; c < nc; c++) {
+      ac->delta[t * nc + c] = newid[trie[s * nc + c]] * nc;
+    }
+    ac->outstart[t] = outstart[s];
+    ac->outcount[t] = outcount[s];
+  }
+  ac->outputs = outputs;
+
+  free(trie);
+  free(fail);
+  free(queue);
+  free(own);
+  free(ownnext);
+  free(order);
+  free(newid);
+  free(outstart);
+  free(outcount);
+
+  k = ac->numpatterns - ac->numalignedpatterns;
+  ac->perneedle = (k <= 1 || k <= PER_NEEDLE_SEARCH_LIMIT * vectorSearchWidth() / 64);
+
+  if (state->modeVerbose) {
+    fprintf(stdout, "Search automaton built: %d needles, %d states, %d input classes.\n",
+	    k, ac->numstates, ac->numclasses);
+    if (ac->numalignedpatterns) {
+      fprintf(stdout, "Searching for %d headers at aligned offsets only.\n",
+	      ac->numalignedpatterns);
+    }
+    if (ac->perneedle) {
+      fprintf(stdout, "Searching for each needle separately.\n");
+    }
+  }
+
+  state->automaton = ac;
+  return SCALPEL_OK;
+}
+
+
+void destroySearchAutomaton(struct SearchAutomaton *ac) {
+
+  if (ac) {
+    free(ac->patterns);
+    free(ac->wildpatterns);
+    free(ac->alignedpatterns);
+    free(ac->delta);
+    free(ac->outstart);
+    free(ac->outcount);
+    free(ac->outputs);
+    free(ac);
+  }
+}
+
+
+// allocate one (empty) hit list for each needle in the automaton
+struct SearchHitList *allocateSearchHits(struct scalpelState *state,
+					 struct SearchAutomaton *ac) {
+
+  struct SearchHitList *hits;
+
+  hits = (struct SearchHitList *)calloc(ac->numpatterns + 1,
+					sizeof(struct SearchHitList));
+  checkMemoryAllocation(state, hits, __LINE__, __FILE__, "search hit lists");
+  return hits;
+}
+
+
+void destroySearchHits(struct SearchAutomaton *ac, struct SearchHitList *hits) {
+
+  int k;
+
+  if (hits) {
+    for (k = 0; k < ac->numpatterns; k++) {
+      free(hits[k].positions);
+    }
+    free(hits);
+  }
+}
+
+
+static void addHit(struct scalpelState *state, struct SearchHitList *list,
+		   unsigned int position) {
+
+  if (list->numhits >= list->storage) {
+    list->storage = (list->storage ? list->storage * 2 : 256);
+    list->positions = (unsigned int *)realloc(list->positions,
+					      list->storage * sizeof(unsigned int));
+    checkMemoryAllocation(state, list->positions, __LINE__, __FILE__, "search hit list");
+  }
+  list->positions[list->numhits++] = position;
+}
+
+
+// search 'buf' for every needle in the automaton.  The starting
+// position (relative to 'buf') of every match is appended to the hit
+// list for the matching needle, in ascending order.  Overlapping
+// matches are all reported; the caller applies "-r" semantics.
+void searchBufferAutomaton(struct scalpelState *state, struct SearchAutomaton *ac,
+			   char *buf, unsigned long long len,
+			   struct SearchHitList *hits) {
+
+  const unsigned char *ubuf = (const unsigned char *)buf;
+  const int *delta = ac->delta;
+  const unsigned char *classmap = ac->classmap;
+  const int firstmatchrow = ac->firstmatchrow;
+  const int nc = ac->numclasses;
+  unsigned long long pos, s, k;
+  long long start;
+  int row = 0, i, t;
+  struct SearchPattern *p;
+
+  for (pos = 0; pos < len; pos++) {
+    row = delta[row + classmap[ubuf[pos]]];
+    if (row >= firstmatchrow) {
+      t = row / nc;
+      for (i = 0; i < ac->outcount[t]; i++) {
+	k = ac->outputs[ac->outstart[t] + i];
+	p = &(ac->patterns[k]);
+	start = (long long)pos - p->anchorlength + 1 - p->anchoroffset;
+	if (start >= 0 && start + p->length <= len &&
+	    memwildcardcmp(p->needle, buf + start, p->length, p->casesensitive) == 0) {
+	  addHit(state, &hits[k], (unsigned int)start);
+	}
+      }
+    }
+  }
+
+  // needles with no anchor match everywhere they fit
+  for (i = 0; i < ac->numwildpatterns; i++) {
+    k = ac->wildpatterns[i];
+    p = &(ac->patterns[k]);
+    for (s = 0; s + p->length <= len; s++) {
+      addHit(state, &hits[k], (unsigned int)s);
+    }
+  }
+}
+
+
+// search 'buf' for each needle separately, with the single-needle
+// search in helpers.c, one SEARCH_TILE_SIZE tile at a time.  A tile is
+// extended by the needle length - 1, so that matches starting in the
+// tile are found, but matches starting in the next tile aren't.
+// Produces exactly the same hit lists as searchBufferAutomaton().
+void searchBufferPerNeedle(struct scalpelState *state,
+			   struct SearchAutomaton *ac,
+			   char *buf, unsigned long long len,
+			   struct SearchHitList *hits) {
+
+  struct SearchSpecLine *spec;
+  size_t *table, anchor, anchorlength;
+  char *needle, *foundat, *tileend;
+  unsigned long long tile, tilelength, overlap = 0;
+  int k, length;
+
+  for (k = 0; k < ac->numpatterns; k++) {
+    if (! ac->patterns[k].alignment && ac->patterns[k].length - 1 > overlap) {
+      overlap = ac->patterns[k].length - 1;
+    }
+  }
+
+  for (tile = 0; tile < len; tile += SEARCH_TILE_SIZE) {
+    tilelength = len - tile < SEARCH_TILE_SIZE ? len - tile : SEARCH_TILE_SIZE;
+
+    for (k = 0; k < ac->numpatterns; k++) {
+      if (ac->patterns[k].alignment) {
+	continue;
+      }
+      spec = &(state->SearchSpec[ac->patterns[k].rule]);
+      if (ac->patterns[k].isfooter) {
+	needle = spec->end;
+	length = spec->endlength;
+	table = spec->end_bm_table;
+	anchor = spec->end_anchor;
+	anchorlength = spec->end_anchorlength;
+      }
+      else {
+	needle = spec->begin;
+	length = spec->beginlength;
+	table = spec->begin_bm_table;
+	anchor = spec->begin_anchor;
+	anchorlength = spec->begin_anchorlength;
+      }
+      if (tilelength + length - 1 < len - tile) {
+	tileend = buf + tile + tilelength + length - 1;
+      }
+      else {
+	tileend = buf + len;
+      }
+
+      foundat = buf + tile;
+      while ((foundat = bm_needleinhaystack(needle, length, foundat,
+					    tileend - foundat, table,
+					    anchor, anchorlength,
+					    spec->casesensitive))) {
+	addHit(state, &hits[k], (unsigned int)(foundat - buf));
+	foundat++;
+      }
+    }
+  }
+}
+
+
+// test the aligned header needles only at image offsets that are
+// multiples of their alignment.  'offset' is the image position of
+// buf[0].  At each aligned offset, one word of the buffer is compared
+// against the start of the needle, with wildcards masked out and
+// letters of case-insensitive needles folded; only offsets that pass
+// are verified with memwildcardcmp().  With cluster-sized alignments,
+// this reads one cache line per cluster instead of the whole buffer.
+// Matches are the ones the automaton would find at aligned offsets.
+void searchBufferAligned(struct scalpelState *state,
+			 struct SearchAutomaton *ac,
+			 char *buf, unsigned long long len,
+			 unsigned long long offset,
+			 struct SearchHitList *hits) {
+
+  struct SearchPattern *p;
+  unsigned long long s, word;
+  int i, k;
+
+  for (i = 0; i < ac->numalignedpatterns; i++) {
+    k = ac->alignedpatterns[i];
+    p = &(ac->patterns[k]);
+
+    for (s = (p->alignment - offset % p->alignment) % p->alignment;
+	 s + p->length <= len; s += p->alignment) {
+      if (s + sizeof(word) <= len) {
+	memcpy(&word, buf + s, sizeof(word));
+	if (((word | p->prefixfold) & p->prefixmask) != p->prefixvalue) {
+	  continue;
+	}
+      }
+      if (memwildcardcmp(p->needle, buf + s, p->length, p->casesensitive) == 0) {
+	addHit(state, &hits[k], (unsigned int)s);
+      }
+    }
+  }
+}
+
+
+// does a match of 'length' bytes at 'position' lie entirely inside
+// the constant fill run [runstart, runend)?
+static int insideConstantFill(unsigned long long position, int length,
+			      unsigned long long runstart,
+			      unsigned long long runend) {
+  return position >= runstart && position + length <= runend;
+}
+
+
+// search chunk->buffer[from..to) for all needles but the aligned
+// headers, whichever way is faster.  Hits are relative to the start
+// of the buffer.  Hits inside the constant fill runs on either side
+// of the segment are dropped; addConstantFillHits() adds those.
+static void searchSegment(struct scalpelState *state, struct SearchAutomaton *ac,
+			  struct SearchChunk *chunk,
+			  unsigned long long from, unsigned long long to,
+			  unsigned long long prevstart, unsigned long long prevend,
+			  unsigned long long nextstart, unsigned long long nextend) {
+
+  struct SearchHitList *list;
+  unsigned long long i, j, position;
+  int k, length;
+
+  for (k = 0; k < ac->numpatterns; k++) {
+    chunk->hits[k].mark = chunk->hits[k].numhits;
+  }
+
+  if (ac->perneedle) {
+    searchBufferPerNeedle(state, ac, chunk->buffer + from, to - from,
+			  chunk->hits);
+  }
+  else {
+    searchBufferAutomaton(state, ac, chunk->buffer + from, to - from, chunk->hits);
+  }
+
+  for (k = 0; k < ac->numpatterns; k++) {
+    list = &(chunk->hits[k]);
+    length = ac->patterns[k].length;
+    for (i = j = list->mark; i < list->numhits; i++) {
+      position = list->positions[i] + from;
+      if (! insideConstantFill(position, length, prevstart, prevend) &&
+	  ! insideConstantFill(position, length, nextstart, nextend)) {
+	list->positions[j++] = (unsigned int)position;
+      }
+    }
+    list->numhits = j;
+  }
+}
+
+
+// add the hits of needles that match at every position of a run of
+// the byte 'fill', without searching the run
+static void addConstantFillHits(struct scalpelState *state,
+				struct SearchAutomaton *ac,
+				struct SearchChunk *chunk,
+				unsigned long long runstart,
+				unsigned long long runend, int fill) {
+
+  struct SearchPattern *p;
+  unsigned long long s;
+  int i, k;
+
+  for (k = 0; k < ac->numpatterns; k++) {
+    p = &(ac->patterns[k]);
+    if (p->alignment) {
+      continue;
+    }
+    for (i = 0; i < p->length; i++) {
+      if (! charactersMatch(p->needle[i], (char)fill, p->casesensitive)) {
+	break;
+      }
+    }
+    if (i < p->length) {
+      continue;
+    }
+    for (s = runstart; s + p->length <= runend; s++) {
+      addHit(state, &(chunk->hits[k]), (unsigned int)s);
+    }
+  }
+}
+
+
+// search a chunk of an image file for all needles, skipping runs of
+// constant fill.  Each run is at least as long as the longest needle,
+// so a needle can't cross a whole run, and hits are appended in
+// ascending order: the segment before a run, the run, the segment
+// after it.  Safe to call from several threads at once, for different
+// chunks.
+void searchBuffer(struct scalpelState *state, struct SearchAutomaton *ac,
+		  struct SearchChunk *chunk) {
+
+  unsigned long long minrun, s, from = 0, prevstart = 0, prevend = 0;
+  unsigned long long runstart, runend, to;
+  int k, fill;
+
+  for (k = 0; k < ac->numpatterns; k++) {
+    chunk->hits[k].numhits = 0;
+  }
+  chunk->skipped = 0;
+
+  if (ac->numalignedpatterns < ac->numpatterns) {
+    minrun = CONSTANT_FILL_MIN_RUN;
+    if ((unsigned long long)ac->longestneedle > minrun) {
+      minrun = ac->longestneedle;
+    }
+
+    s = (CONSTANT_FILL_SECTOR - chunk->offset % CONSTANT_FILL_SECTOR) %
+      CONSTANT_FILL_SECTOR;
+    while (s + CONSTANT_FILL_SECTOR <= chunk->length) {
+      if ((fill = constantFillByte(chunk->buffer + s, CONSTANT_FILL_SECTOR)) < 0) {
+	s += CONSTANT_FILL_SECTOR;
+	continue;
+      }
+      runstart = s;
+      for (s += CONSTANT_FILL_SECTOR;
+	   s + CONSTANT_FILL_SECTOR <= chunk->length &&
+	     constantFillByte(chunk->buffer + s, CONSTANT_FILL_SECTOR) == fill;
+	   s += CONSTANT_FILL_SECTOR) {
+      }
+      runend = s;
+      if (runend - runstart < minrun) {
+	continue;
+      }
+
+      // matches starting before the run may extend into it
+      to = runstart + ac->longestneedle - 1;
+      searchSegment(state, ac, chunk, from, to, prevstart, prevend,
+		    runstart, runend);
+      addConstantFillHits(state, ac, chunk, runstart, runend, fill);
+      chunk->skipped += runend - runstart;
+
+      from = runend - (ac->longestneedle - 1);
+      prevstart = runstart;
+      prevend = runend;
+    }
+    searchSegment(state, ac, chunk, from, chunk->length, prevstart, prevend, 0, 0);
+  }
+
+  if (ac->numalignedpatterns) {
+    searchBufferAligned(state, ac, chunk->buffer, chunk->length,
+			chunk->offset, chunk->hits);
+  }
+}
@@ -25,23 +25,80 @@
 
 #include "scalpel.h"
 
-/////////// GLOBALS ////////////
-static char readbuffer[SIZE_OF_BUFFER];     // read buffer--process image
-                                            // files in SIZE_OF_BUFFER-sized
-                                            // chunks
+#ifndef __WIN32
+#include <sys/mman.h>
+#endif
 
 // prototypes for private dig.c functions
-static int writeHeaderFooterDatabase(struct scalpelState *state);
+static int writeHeaderFooterDatabase(struct scalpelState *state,
+				     unsigned long long imagesize);
+static unsigned long long hashBytes(unsigned long long hash, const void *bytes,
+				    size_t length);
+static unsigned long long ruleHash(struct SearchSpecLine *rule);
+static unsigned long long configHash(struct scalpelState *state);
+static char *ruleSuffix(struct SearchSpecLine *rule);
+static int writeDatabaseOffsets(struct scalpelState *state, FILE *dbfile,
+				struct OffsetList *list, unsigned long long *buffer);
+static int writeBinaryHeaderFooterDatabase(struct scalpelState *state, char *fn,
+					   unsigned long long imagesize,
+					   unsigned long long *resume);
+static int readDatabaseOffsets(struct scalpelState *state, FILE *dbfile,
+			       struct OffsetList *list, unsigned long long position,
+			       unsigned long long count, unsigned long long *buffer,
+			       unsigned long long imagesize, char *name);
+static int loadHeaderFooterDatabase(struct scalpelState *state, char *fn,
+				    unsigned long long imagesize,
+				    unsigned long long *resume);
+static int readHeaderFooterDatabase(struct scalpelState *state,
+				    unsigned long long imagesize, int *unmatched);
+static void checkpointName(struct scalpelState *state, char *fn);
+static int writeCheckpoint(struct scalpelState *state,
+			   unsigned long long imagesize, unsigned long long resume);
+static int readCheckpoint(struct scalpelState *state,
+			  unsigned long long imagesize, unsigned long long *resume);
+static void checkPass1Signal(struct scalpelState *state,
+			     unsigned long long imagesize, unsigned long long resume);
 static int setupCoverageMaps(struct scalpelState *state, unsigned long long filesize);
 static int auditUpdateCoverageBlockmap(struct scalpelState *state, struct CarveInfo *carve);
-static int updateCoverageBlockmap(struct scalpelState *state, unsigned long long block);
+static int updateCoverageBlockmap(struct scalpelState *state, unsigned long long first,
+				  unsigned long long last);
+static void mapCoverageBlockmap(struct scalpelState *state);
+static void coverageMapName(struct scalpelState *state, char *fn);
+static int readCoverageHeader(FILE *f, struct CoverageMapHeader *header);
+static int readCoverageRuns(struct scalpelState *state, FILE *f,
+			    struct CoverageMapHeader *header);
+static void addCoverageRun(struct scalpelState *state, struct CoverageRun **runs,
+			   unsigned long long *numruns, unsigned long long *storage,
+			   unsigned long long start, unsigned long long length,
+			   unsigned long long count);
+static int compareCoverageEvents(const void *a, const void *b);
+static void mergeCoverageUpdates(struct scalpelState *state);
+static int writeCoverageRuns(char *fn, unsigned int blocksize,
+			     unsigned long long numblocks,
+			     struct CoverageRun *runs, unsigned long long numruns);
+static int saveCoverageBlockmap(struct scalpelState *state);
+static void markCovered(struct scalpelState *state, unsigned long long first,
+			unsigned long long count);
 static void generateFragments(struct scalpelState *state, Queue *fragments, struct CarveInfo *carve);
 static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state, unsigned long long position);
 static void destroyCoverageMaps(struct scalpelState *state);
-static int fseeko_use_coverage_map(struct scalpelState *state, FILE *fp, off64_t offset);
-static off64_t ftello_use_coverage_map(struct scalpelState *state, FILE *fp);
-static size_t fread_use_coverage_map(struct scalpelState *state, void *ptr, 
-				    size_t size, size_t nmemb, FILE *stream);
+static int countBits(unsigned long long word);
+static int lowestBit(unsigned long long word);
+static int blockCovered(struct scalpelState *state, unsigned long long block);
+static void buildCoverageIndex(struct scalpelState *state);
+static unsigned long long coveredBefore(struct scalpelState *state,
+					unsigned long long block);
+static unsigned long long uncoveredBlock(struct scalpelState *state,
+					 unsigned long long k);
+static unsigned long long nextBlock(struct scalpelState *state,
+				    unsigned long long block, int covered);
+static unsigned long long logicalPosition(struct scalpelState *state,
+					  unsigned long long position);
+static void buildCoverageExtents(struct scalpelState *state);
+static unsigned long long findExtent(struct scalpelState *state,
+				     unsigned long long position);
+static long long readExtents(FILE *stream, struct iovec *iov, int numiov,
+			     unsigned long long offset);
 static void printhex(char *s, int len);
 static void clean_up(struct scalpelState* state, int signum);
 static int displayPosition(int *units,
@@ -49,9 +106,38 @@ static int displayPosition(int *units,
 		    unsigned long long size, 
 		    char *fn);
 static void setupAuditFile(struct scalpelState* state);
-static int bm_digBuffer(struct scalpelState *state, FILE *infile, 
-		 unsigned long long lengthofbuf, 
-		 unsigned long long offset);
+static int bm_digBuffer(struct scalpelState *state,
+			struct SearchChunk *chunk);
+static int searchImageFile(struct scalpelState *state, FILE *infile,
+			   unsigned long long filesize, unsigned long long filebegin,
+			   unsigned long long resume, int longestneedle);
+static void searchChunk(struct scalpelState *state, struct SearchChunk *chunk,
+			int counter);
+static void *searchWorker(void *arg);
+static int startSearchPool(struct scalpelState *state, struct SearchPool *pool,
+			   struct SearchChunk *chunks, int numthreads);
+static void runSearchPool(struct SearchPool *pool, int numchunks);
+static void stopSearchPool(struct SearchPool *pool);
+static void destroySearchChunks(struct scalpelState *state,
+				struct SearchPool *pool,
+				struct SearchChunk *chunks, int numchunks);
+static struct CarveInfo *newCarve(struct scalpelState *state,
+				   struct CarveList *list);
+static void addCarve(struct scalpelState *state, struct CarveList *list,
+		     struct CarveInfo *carve);
+static char *carveFilename(struct scalpelState *state, struct CarveInfo *carve);
+static int compareCarveStarts(const void *a, const void *b);
+static int compareCarveWork(const void *a, const void *b);
+static void startCarveList(struct scalpelState *state, struct CarveList *list);
+static int carveListWanted(void *carvelist, unsigned long long bufferindex);
+static void planCarveWork(struct CarveList *list, unsigned long long bufferindex);
+static void destroyCarveList(struct CarveList *list);
+static void addPlannedCarve(struct CarvePlan *plan, unsigned long long start,
+			    unsigned long long stop, char chopped);
+static void planCarves(struct CarvePlan *plan);
+static void *planWorker(void *arg);
+static void planAllCarves(struct scalpelState *state, struct CarvePlan *plans,
+			  int numplans);
 //static void adjustForEmbedding(struct SearchSpecLine *currentneedle, 
 //			       unsigned long long headerindex, unsigned long long *prevstopindex);
 
@@ -223,102 +309,107 @@ static void setupAuditFile(struct scalpelState* state) {
 }
 
 
-// add entries to header/footer database during search of current
-// buffer.
+// record the positions of a needle's matches in the current buffer in
+// the header/footer database.  'hits' holds every match searchBuffer()
+// found, including overlapping ones.  Foremost 0.69 didn't
+// find overlapping headers/footers.  If you need that behavior,
+// specify "-r" on the command line, in which case matches that begin
+// inside the previously recorded match are dropped.  Scalpel's
+// default behavior is to find overlapping headers/footers.
 
-static int bm_digBuffer(struct scalpelState *state, FILE *infile, 
-		 unsigned long long lengthofbuf, 
-		 unsigned long long offset) {
-  
-  unsigned long long startLocation = 0;
-  int needlenum;
-  char *foundat;
-  struct SearchSpecLine *currentneedle;
-    
-  // for each file type, find all headers and some (or all) footers
-  for (needlenum = 0; 
-       state->SearchSpec[needlenum].suffix != NULL; 
-       needlenum++) {
-    
-    currentneedle = &(state->SearchSpec[needlenum]);
-    
-    // header search first
-    
-    foundat = readbuffer;
-    while (foundat) {
-      // signal check
-      if (signal_caught == SIGTERM || signal_caught == SIGINT){
-	clean_up(state,signal_caught);
+static void recordNeedleHits(struct scalpelState *state,
+			     struct SearchSpecLine *currentneedle,
+			     int isfooter,
+			     struct SearchHitList *hits,
+			     unsigned long long offset) {
+
+  unsigned long long h, nextallowed = 0, startLocation;
+  struct OffsetList *positions;
+  int needlelength;
+
+  if (isfooter) {
+    positions = &(currentneedle->offsets.footers);
+    needlelength = currentneedle->endlength;
+  }
+  else {
+    positions = &(currentneedle->offsets.headers);
+    needlelength = currentneedle->beginlength;
+  }
+
+  for (h = 0; h < hits->numhits; h++) {
+    if (state->noSearchOverlap) {
+      if (hits->positions[h] < nextallowed) {
+	continue;
       }
+      nextallowed = hits->positions[h] + needlelength;
+    }
 
-      foundat = bm_needleinhaystack(currentneedle->begin, 
-				    currentneedle->beginlength,
-				    foundat,
-				    (int)(lengthofbuf-(foundat-readbuffer)),
-				    currentneedle->begin_bm_table,
-				    currentneedle->casesensitive);
-
-      startLocation = offset + (foundat-readbuffer);	
-      if (foundat > 0) {
-	// GGRIII: found a header--record location in header offsets
-	// database...
-	
-	if (state->modeVerbose) {
+    startLocation = offset + hits->positions[h];
+
+    if (state->modeVerbose) {
 #ifdef __WIN32
-	  fprintf(stdout, "A %s header was found at : %I64u\n",
-		  currentneedle->suffix, positionUseCoverageBlockmap(state, startLocation));
+      fprintf(stdout, "A %s %s was found at : %I64u\n",
+	      currentneedle->suffix, isfooter ? "footer" : "header",
+	      positionUseCoverageBlockmap(state, startLocation));
 #else
-	  fprintf(stdout, "A %s header was found at : %llu\n",
-		   currentneedle->suffix, positionUseCoverageBlockmap(state, startLocation));
+      fprintf(stdout, "A %s %s was found at : %llu\n",
+	      currentneedle->suffix, isfooter ? "footer" : "header",
+	      positionUseCoverageBlockmap(state, startLocation));
 #endif
-	}
-
-	currentneedle->offsets.numheaders++;
-	if (currentneedle->offsets.headerstorage <=
-	    currentneedle->offsets.numheaders) {
-	  // need more memory for header offset storage--add an
-	  // additional 100 elements
-	  currentneedle->offsets.headers = 
-	    realloc(currentneedle->offsets.headers, 
-		    sizeof(unsigned long long) * 
-		    (currentneedle->offsets.numheaders + 100));
-	  checkMemoryAllocation(state, currentneedle->offsets.headers, __LINE__, __FILE__, "header array");
-	  currentneedle->offsets.headerstorage = 
-	    currentneedle->offsets.numheaders + 100;
+    }
 
-	  if (state->modeVerbose) {
+    if (appendOffset(state, positions, startLocation,
+		     isfooter ? "footer array" : "header array") &&
+	state->modeVerbose) {
 #ifdef __WIN32
-	    fprintf(stdout, "Memory reallocation performed, total header storage = %I64u\n",
-		    currentneedle->offsets.headerstorage);
+      fprintf(stdout, "Memory allocation performed, total %s storage = %I64u bytes\n",
+	      isfooter ? "footer" : "header", offsetListMemory(positions));
 #else
-	    fprintf(stdout, "Memory reallocation performed, total header storage = %llu\n",
-		    currentneedle->offsets.headerstorage);
+      fprintf(stdout, "Memory allocation performed, total %s storage = %llu bytes\n",
+	      isfooter ? "footer" : "header", offsetListMemory(positions));
 #endif
-	  }
+    }
+  }
+}
 
-	}
-	currentneedle->offsets.headers[currentneedle->offsets.numheaders-1] = 
-	  startLocation;
-      }
 
-      if (foundat) {
-	// move past match position.  Foremost 0.69 didn't find overlapping
-	// headers/footers.  If you need that behavior, specify "-r" on the
-	// command line.  Scalpel's default behavior is to find overlapping
-	// headers/footers.
-	
-	if (state->noSearchOverlap) {
-	  foundat = foundat + currentneedle->beginlength;
-	}
-	else {
-	  foundat++;
-	}
-      }
+// add entries to header/footer database for a chunk of the image
+// file.  searchBuffer() has already found every header and footer for
+// every file type in the chunk, either in one pass of the search
+// automaton or one vectorized pass per needle; the matches are now
+// entered into the database one file type at a time, headers first,
+// exactly as if each needle had been searched for separately.
+
+static int bm_digBuffer(struct scalpelState *state,
+			struct SearchChunk *chunk) {
+  
+  struct SearchAutomaton *ac = state->automaton;
+  struct SearchSpecLine *currentneedle;
+  struct SearchPattern *pattern;
+  struct SearchHitList *hits = chunk->hits;
+  unsigned long long offset = chunk->offset;
+  int k;
+
+  if (chunk->traffic < 0 || state->searchTraffic < 0) {
+    state->searchTraffic = -1;
+  }
+  else {
+    state->searchTraffic += chunk->traffic;
+  }
+  state->constantFillSkipped += chunk->skipped;
+
+  // patterns are ordered by file type, with the header needle for a
+  // type immediately preceding its footer needle
+  for (k = 0; k < ac->numpatterns; k++) {
+    pattern = &(ac->patterns[k]);
+    currentneedle = &(state->SearchSpec[pattern->rule]);
+    
+    if (! pattern->isfooter) {
+      recordNeedleHits(state, currentneedle, FALSE, &hits[k], offset);
     }
 
-    // now footer search, if:
+    // record footers only if:
     //
-    // there's a footer for this file type and
     // at least one header for that type has been previously seen and 
     // at least one header is viable--that is, it was found in the current
     // buffer, or it's less than the max carve distance behind the current
@@ -329,112 +420,330 @@ static int bm_digBuffer(struct scalpelState *state, FILE *infile,
     // a header/footer database is being created.  In this case, ALL headers and
     // footers must be discovered.
 
-    if (
-	// regular case--want to search for only "viable" (in the sense that they are
-	// useful for carving unfragmented files) footers, to save time
-	(currentneedle->offsets.numheaders > 0 &&
-	currentneedle->endlength &&
-	(currentneedle->offsets.headers[currentneedle->offsets.numheaders-1] > offset ||
-	 (offset - currentneedle->offsets.headers[currentneedle->offsets.numheaders-1] < currentneedle->length)))
+    else if (
+	// regular case--want only "viable" (in the sense that they are
+	// useful for carving unfragmented files) footers, to save space
+	(currentneedle->offsets.headers.count > 0 &&
+	 (lastOffset(&(currentneedle->offsets.headers)) > offset ||
+	  (offset - lastOffset(&(currentneedle->offsets.headers)) <
+	   currentneedle->length)))
 
 	||
 	
 	// generating header/footer database, need to find all footers
-	(currentneedle->endlength && state->generateHeaderFooterDatabase)) {
+	state->generateHeaderFooterDatabase) {
 
-      foundat = readbuffer;
-      while (foundat) {
-	
-	// signal check
-	if (signal_caught == SIGTERM || signal_caught == SIGINT){
-	  clean_up(state,signal_caught);
-	}
-	
-	// GGRIII: look for footer
-	foundat = bm_needleinhaystack(currentneedle->end, 
-				      currentneedle->endlength,
-				      foundat,
-				      (int)(lengthofbuf-(foundat-readbuffer)),
-				      currentneedle->end_bm_table,
-				      currentneedle->casesensitive);
-	
-	if (foundat > 0) {
-	  // GGRIII: found a footer--record location in footer offsets
-	  // database...
-	  
-	  startLocation = offset + (foundat-readbuffer);	
-	  
-	  if (state->modeVerbose) {
-#ifdef __WIN32
-	    fprintf(stdout, "A %s footer was found at : %I64u\n",
-		     currentneedle->suffix, positionUseCoverageBlockmap(state, startLocation));
-#else
-	    fprintf(stdout, "A %s footer was found at : %llu\n",
-		     currentneedle->suffix, positionUseCoverageBlockmap(state, startLocation));
-#endif	   
-	  }
-	  
-	  currentneedle->offsets.numfooters++;
-	  if (currentneedle->offsets.footerstorage <= 
-	      currentneedle->offsets.numfooters) {
-	    // need more memory for footer offset storage--add an
-	    // additional 100 elements
-	    currentneedle->offsets.footers = 
-	      realloc(currentneedle->offsets.footers, 
-		      sizeof(unsigned long long) * 
-		      (currentneedle->offsets.numfooters + 100));
-	    checkMemoryAllocation(state, currentneedle->offsets.footers, __LINE__, __FILE__, "footer array");
-	    currentneedle->offsets.footerstorage = 
-	      currentneedle->offsets.numfooters + 100;
-
-	    if (state->modeVerbose) {
-#ifdef __WIN32
-	      fprintf(stdout, "Memory reallocation performed, total footer storage = %I64u\n",
-		      currentneedle->offsets.footerstorage);
-#else
-	      fprintf(stdout, "Memory reallocation performed, total footer storage = %llu\n",
-		      currentneedle->offsets.footerstorage);
-#endif
-	    }
+      recordNeedleHits(state, currentneedle, TRUE, &hits[k], offset);
+    }
+  }
 
-	  }
-	  currentneedle->offsets.footers[currentneedle->offsets.numfooters-1] = 
-	    startLocation;
-	  
-	  // move past match position.  Foremost 0.69 didn't find overlapping
-	  // headers/footers.  If you need that behavior, specify "-r" on the
-	  // command line.  Scalpel's default behavior is to find overlapping
-	  // headers/footers.
-	  if (state->noSearchOverlap) {
-	    foundat = foundat + currentneedle->endlength;
-	  }
-	  else {
-	    foundat++;
-	  }
-	}
-      }
+  return SCALPEL_OK;
+}
+
+
+// search 'chunk', measuring how much the calling thread reads from
+// memory meanwhile with its traffic counter 'counter'
+static void searchChunk(struct scalpelState *state, struct SearchChunk *chunk,
+			int counter) {
+
+  long long before, after;
+
+  before = readTrafficCounter(counter);
+  searchBuffer(state, state->automaton, chunk);
+  after = readTrafficCounter(counter);
+  chunk->traffic = (before < 0 || after < before) ? -1 : after - before;
+}
+
+
+// search thread for pass 1: search chunks of the current batch until
+// there are none left, then wait for the next batch
+static void *searchWorker(void *arg) {
+
+  struct SearchPool *pool = (struct SearchPool *)arg;
+  int c, counter;
+
+  // counters follow the thread that opened them
+  counter = openTrafficCounter();
+
+  pthread_mutex_lock(&(pool->lock));
+  while (1) {
+    while (! pool->shutdown && pool->nextchunk >= pool->numchunks) {
+      pthread_cond_wait(&(pool->work), &(pool->lock));
+    }
+    if (pool->shutdown) {
+      break;
+    }
+    c = pool->nextchunk++;
+    pthread_mutex_unlock(&(pool->lock));
+
+    searchChunk(pool->state, &(pool->chunks[c]), counter);
+
+    pthread_mutex_lock(&(pool->lock));
+    if (--pool->unfinished == 0) {
+      pthread_cond_signal(&(pool->done));
     }
   }
+  pthread_mutex_unlock(&(pool->lock));
+  closeTrafficCounter(counter);
+
+  return NULL;
+}
+
+
+static int startSearchPool(struct scalpelState *state, struct SearchPool *pool,
+			   struct SearchChunk *chunks, int numthreads) {
+
+  int i, err;
+
+  pool->state = state;
+  pool->chunks = chunks;
+  pool->numchunks = 0;
+  pool->nextchunk = 0;
+  pool->unfinished = 0;
+  pool->shutdown = FALSE;
+  pool->numthreads = 0;
+  pthread_mutex_init(&(pool->lock), NULL);
+  pthread_cond_init(&(pool->work), NULL);
+  pthread_cond_init(&(pool->done), NULL);
+
+  pool->threads = (pthread_t *)malloc(numthreads * sizeof(pthread_t));
+  checkMemoryAllocation(state, pool->threads, __LINE__, __FILE__, "search threads");
+
+  // pthread_create() returns its error rather than setting errno.  On
+  // failure, pool->numthreads counts the threads already running, which
+  // the caller's stopSearchPool() (via destroySearchChunks()) joins.
+  for (i = 0; i < numthreads; i++) {
+    if ((err = pthread_create(&(pool->threads[i]), NULL, searchWorker, pool))) {
+      fprintf(stderr, "ERROR: Couldn't create search thread -- %s\n",
+	      strerror(err));
+      return SCALPEL_GENERAL_ABORT;
+    }
+    pool->numthreads++;
+  }
 
   return SCALPEL_OK;
 }
 
 
+// search the first 'numchunks' chunks with the worker threads and
+// wait until they're done
+static void runSearchPool(struct SearchPool *pool, int numchunks) {
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->numchunks = numchunks;
+  pool->nextchunk = 0;
+  pool->unfinished = numchunks;
+  pthread_cond_broadcast(&(pool->work));
+  while (pool->unfinished > 0) {
+    pthread_cond_wait(&(pool->done), &(pool->lock));
+  }
+  pool->numchunks = 0;
+  pthread_mutex_unlock(&(pool->lock));
+}
+
+
+static void stopSearchPool(struct SearchPool *pool) {
+
+  int i;
+
+  pthread_mutex_lock(&(pool->lock));
+  pool->shutdown = TRUE;
+  pthread_cond_broadcast(&(pool->work));
+  pthread_mutex_unlock(&(pool->lock));
+
+  for (i = 0; i < pool->numthreads; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pthread_mutex_destroy(&(pool->lock));
+  pthread_cond_destroy(&(pool->work));
+  pthread_cond_destroy(&(pool->done));
+}
+
+
+// release the pass 1 chunks and, with more than one chunk, the search
+// threads.  The chunks' buffers belong to the image reader.
+static void destroySearchChunks(struct scalpelState *state,
+				struct SearchPool *pool,
+				struct SearchChunk *chunks, int numchunks) {
+
+  int i;
+
+  if (numchunks > 1) {
+    stopSearchPool(pool);
+  }
+  closeTrafficCounter(pool->counter);
+  for (i = 0; i < numchunks; i++) {
+    destroySearchHits(state->automaton, chunks[i].hits);
+  }
+  free(chunks);
+}
+
+
 // GGRIII: Scalpel's approach dictates that this function dig an image
 // file, building the header/footer offset database.  The task of
 // extracting files from the image has been moved to carveImageFile(),
 // which operates in a second pass over the image.  Digging for
 // header/footer values proceeds in SIZE_OF_BUFFER sized chunks of the
-// image file.  This buffer is now global and named "readbuffer".
+// image file, read ahead by the image reader (see reader.c).
+// pass 1: search 'infile', whose remaining 'filesize' bytes start at
+// 'filebegin', from logical position 'resume' for the needles in
+// state->automaton.  Consecutive buffers overlap by 'longestneedle' - 1
+// bytes.
+static int searchImageFile(struct scalpelState *state, FILE *infile,
+			   unsigned long long filesize, unsigned long long filebegin,
+			   unsigned long long resume, int longestneedle) {
+
+  time_t lastcheckpoint;
+  int status, displayUnits = UNITS_BYTES;
+  int numchunks, n, i, done;
+  struct SearchChunk *chunks;
+  struct SearchPool pool;
+  struct ImageReader reader;
+  struct ReadBuffer *rb;
+
+  lastcheckpoint = time(NULL);
+  
+  // GGRIII: process SIZE_OF_BUFFER-sized chunks of the current image
+  // file and look for both headers and footers, recording their
+  // offsets for use in the 2nd scalpel phase, when file data will 
+  // be extracted.
+
+  // with -j, up to numSearchThreads chunks are read and then searched
+  // at once by the worker threads.  Each chunk has its own per-needle
+  // lists of matches, reused for every batch.  The reader fills the
+  // buffers for the next batch while the current one is processed.
+  numchunks = state->numSearchThreads;
+  chunks = (struct SearchChunk *)calloc(numchunks, sizeof(struct SearchChunk));
+  checkMemoryAllocation(state, chunks, __LINE__, __FILE__, "search chunks");
+  for (i = 0; i < numchunks; i++) {
+    chunks[i].hits = allocateSearchHits(state, state->automaton);
+  }
+  pool.counter = numchunks > 1 ? -1 : openTrafficCounter();
+  if (numchunks > 1 &&
+      (status = startSearchPool(state, &pool, chunks, numchunks)) != SCALPEL_OK) {
+    destroySearchChunks(state, &pool, chunks, numchunks);
+    return status;
+  }
+  state->searchTraffic = 0;
+  state->constantFillSkipped = 0;
+
+  // consecutive buffers overlap a bit so headers and footers that
+  // fall across SIZE_OF_BUFFER boundaries in the image file aren't
+  // missed
+  if ((status = startDigReader(state, &reader, infile, longestneedle-1,
+			       2 * numchunks)) != SCALPEL_OK) {
+    destroySearchChunks(state, &pool, chunks, numchunks);
+    return status;
+  }
+
+  fprintf(stdout, "Image file pass 1/2.\n");
+  done = FALSE;
+  while (! done) {
+
+    for (n = 0; n < numchunks; n++) {
+      rb = nextReadBuffer(&reader);
+      if (rb->status == READ_EOF) {
+	done = TRUE;
+	break;
+      }
+
+      if (rb->status == READ_ERROR) {
+	// keep what was found before the read error
+	if (state->checkpointInterval) {
+	  writeCheckpoint(state, filesize, resume);
+	}
+	stopImageReader(&reader);
+	destroySearchChunks(state, &pool, chunks, numchunks);
+	return SCALPEL_ERROR_FILE_READ;      
+      }
+
+      if (state->modeVerbose) {
+#ifdef __WIN32
+	fprintf(stdout, "Read %I64u bytes from image file.\n", rb->length);
+#else
+	fprintf(stdout, "Read %llu bytes from image file.\n", rb->length);
+#endif
+      }
+    
+      // progress report needs a fileposition that doesn't depend on coverage map
+      displayPosition(&displayUnits,rb->fileposition-filebegin,
+		      filesize,state->imagefile);
+
+      chunks[n].buffer = rb->buffer;
+      chunks[n].length = rb->length;
+      chunks[n].offset = rb->position;
+    }
+
+    //signal check
+    checkPass1Signal(state, filesize, resume);
+
+    // search the chunks, in parallel if there are several
+    if (numchunks > 1) {
+      runSearchPool(&pool, n);
+    }
+    else if (n > 0) {
+      searchChunk(state, &chunks[0], pool.counter);
+    }
+
+    // part of a memory mapped image couldn't be read: the chunks may
+    // have been searched with zeros in its place, so drop their matches
+    if (imageReadFailed(&reader)) {
+      if (state->checkpointInterval) {
+	writeCheckpoint(state, filesize, resume);
+      }
+      stopImageReader(&reader);
+      destroySearchChunks(state, &pool, chunks, numchunks);
+      return SCALPEL_ERROR_FILE_READ;
+    }
+
+    // process the chunks' matches in image order.  The next buffer
+    // starts 'longestneedle' - 1 bytes before the end of each one.
+    for (i = 0; i < n; i++) {
+      checkPass1Signal(state, filesize, resume);
+      if ((status = bm_digBuffer(state, &chunks[i])) != SCALPEL_OK) {
+	// GGRIII: error, just return status
+	stopImageReader(&reader);
+	destroySearchChunks(state, &pool, chunks, numchunks);
+	return status;
+      }
+      // clamped in case a chunk is ever shorter than the overlap, so
+      // that 'resume' can't wrap around
+      if (chunks[i].length > (unsigned long long)(longestneedle - 1)) {
+	resume = chunks[i].offset + chunks[i].length - (longestneedle - 1);
+      }
+      else {
+	resume = chunks[i].offset;
+      }
+      releaseReadBuffer(&reader);
+    }
+
+    if (state->checkpointInterval &&
+	(done || time(NULL) - lastcheckpoint >= state->checkpointInterval)) {
+      if ((status = writeCheckpoint(state, filesize, resume)) != SCALPEL_OK) {
+	stopImageReader(&reader);
+	destroySearchChunks(state, &pool, chunks, numchunks);
+	return status;
+      }
+      lastcheckpoint = time(NULL);
+    }
+  }
+
+  stopImageReader(&reader);
+  destroySearchChunks(state, &pool, chunks, numchunks);
+
+  return SCALPEL_OK;
+}
+
+
 int digImageFile(struct scalpelState* state) {
   
   FILE *infile;
-  unsigned long long filesize = 0, bytesread = 0, 
-    fileposition = 0, filebegin = 0, beginreadpos = 0;
+  unsigned long long filesize = 0, filebegin = 0, resume;
+  unsigned long long offsets, offsetmemory, offsetsspilled;
+  struct SearchAutomaton *automaton = state->automaton;
   long err = 0;
-  int status, displayUnits = UNITS_BYTES;
-  int success = 0;
-  int longestneedle;
+  int longestneedle, i, unmatched;
   setupAuditFile(state);
   
   if (state->SearchSpec[0].suffix == NULL) {
@@ -501,58 +810,111 @@ int digImageFile(struct scalpelState* state) {
   if ((err = setupCoverageMaps(state, filesize)) != SCALPEL_OK) {
     return err;
   }
-  
-  // GGRIII: process SIZE_OF_BUFFER-sized chunks of the current image
-  // file and look for both headers and footers, recording their
-  // offsets for use in the 2nd scalpel phase, when file data will 
-  // be extracted.
 
-  fprintf(stdout, "Image file pass 1/2.\n");
-  success = 1;
-  while ((bytesread = 
-	  fread_use_coverage_map(state, readbuffer,
-				 1,
-				 SIZE_OF_BUFFER, infile)) > longestneedle-1 || success == 0) {
+  // a header/footer database saved by an earlier run replaces pass 1
+  // for the rules in it.  Rules added or changed since are searched
+  // for with an automaton built for just those rules; the overlap
+  // between buffers still depends on all the needles, so their
+  // offsets are the same as in a full search.
+  if (state->headerFooterDatabaseDirectory) {
+    if ((err = readHeaderFooterDatabase(state, filesize, &unmatched)) != SCALPEL_OK ||
+	unmatched == 0) {
+      closeFile(infile);
+      return err;
+    }
+    // the automaton for all rules is kept for the next image
+    if ((err = buildSearchAutomaton(state)) != SCALPEL_OK) {
+      if (state->automaton != automaton) {
+	destroySearchAutomaton(state->automaton);
+	state->automaton = automaton;
+      }
+      closeFile(infile);
+      return err;
+    }
+  }
 
-    if (state->modeVerbose) {
+  // continue an interrupted pass 1 from its checkpoint.  The buffer
+  // that follows the last one searched starts at 'resume', so reading
+  // from there reproduces the rest of the uninterrupted run's buffers,
+  // including the overlap with the previous one.
+  resume = ftello_use_coverage_map(state, infile);
+  if (state->resumeFromCheckpoints &&
+      (err = readCheckpoint(state, filesize, &resume)) == SCALPEL_OK) {
+    fseeko_use_coverage_map(state, infile,
+			    resume - ftello_use_coverage_map(state, infile));
+  }
+  if (err == SCALPEL_OK) {
+    err = searchImageFile(state, infile, filesize, filebegin, resume, longestneedle);
+  }
+
+  // free the automaton built for this image's unmatched rules, if any
+  if (state->automaton != automaton) {
+    destroySearchAutomaton(state->automaton);
+    state->automaton = automaton;
+  }
+  if (err != SCALPEL_OK) {
+    closeFile(infile);
+    return err;
+  }
+
+  // wiped or unallocated areas that weren't searched
+  if (state->constantFillSkipped) {
 #ifdef __WIN32
-      fprintf(stdout, "Read %I64u bytes from image file.\n", bytesread);
+    fprintf(state->auditFile, "Skipped %I64u bytes of constant fill "
+	    "(e.g., zeroed sectors) when searching %s.\n",
+	    state->constantFillSkipped, state->imagefile);
+    if (state->modeVerbose) {
+      fprintf(stdout, "Skipped %I64u bytes of constant fill "
+	      "(e.g., zeroed sectors) when searching %s.\n",
+	      state->constantFillSkipped, state->imagefile);
+    }
 #else
-      fprintf(stdout, "Read %llu bytes from image file.\n", bytesread);
-#endif
+    fprintf(state->auditFile, "Skipped %llu bytes of constant fill "
+	    "(e.g., zeroed sectors) when searching %s.\n",
+	    state->constantFillSkipped, state->imagefile);
+    if (state->modeVerbose) {
+      fprintf(stdout, "Skipped %llu bytes of constant fill "
+	      "(e.g., zeroed sectors) when searching %s.\n",
+	      state->constantFillSkipped, state->imagefile);
     }
+#endif
+  }
 
-    if ((err = ferror(infile))) {
-	return SCALPEL_ERROR_FILE_READ;      
+  // last level cache read misses of the searching threads, counted by
+  // the CPU, times the cache line size
+  if (state->modeVerbose && filesize > 0) {
+    if (state->searchTraffic < 0) {
+      fprintf(stdout, "Pass 1 memory traffic: unavailable (no hardware "
+	      "cache miss counter).\n");
     }
-    success = 1;
-    
-    // progress report needs a fileposition that doesn't depend on coverage map
-    fileposition = ftello(infile);
-    displayPosition(&displayUnits,fileposition-filebegin,
-		    filesize,state->imagefile);
-
-    // if carving is dependent on coverage map, need adjusted fileposition
-    fileposition = ftello_use_coverage_map(state, infile);
-    beginreadpos = fileposition - bytesread;
-    
-    //signal check
-    if (signal_caught == SIGTERM || signal_caught == SIGINT)
-      clean_up(state,signal_caught);
-    
-    // process current buffer
-    if ((status = bm_digBuffer(state,infile,
-			       bytesread,beginreadpos)) != SCALPEL_OK) {
-      
-      // GGRIII: error, just return status
-      return status;
+    else {
+      fprintf(stdout, "Pass 1 memory traffic: %.2f bytes per image byte "
+	      "(measured last level cache misses).\n",
+	      (double)state->searchTraffic / filesize);
     }
-    
-    // move file position back a bit so headers and footers that fall
-    // across SIZE_OF_BUFFER boundaries in the image file aren't
-    // missed
+  }
 
-    fseeko_use_coverage_map(state, infile, -1 * (longestneedle-1));
+  if (state->modeVerbose) {
+    offsets = 0;
+    offsetmemory = 0;
+    offsetsspilled = 0;
+    for (i = 0; state->SearchSpec[i].suffix != NULL; i++) {
+      offsets += state->SearchSpec[i].offsets.headers.count +
+	state->SearchSpec[i].offsets.footers.count;
+      offsetmemory += offsetListMemory(&(state->SearchSpec[i].offsets.headers)) +
+	offsetListMemory(&(state->SearchSpec[i].offsets.footers));
+      offsetsspilled += state->SearchSpec[i].offsets.headers.spilled +
+	state->SearchSpec[i].offsets.footers.spilled;
+    }
+#ifdef __WIN32
+    fprintf(stdout, "Header/footer database: %I64u offsets, %I64u on disk, "
+	    "%I64u bytes in memory%s.\n", offsets, offsetsspilled, offsetmemory,
+	    state->compressOffsets ? " (compressed)" : "");
+#else
+    fprintf(stdout, "Header/footer database: %llu offsets, %llu on disk, "
+	    "%llu bytes in memory%s.\n", offsets, offsetsspilled, offsetmemory,
+	    state->compressOffsets ? " (compressed)" : "");
+#endif
   }
   
   closeFile(infile);
@@ -560,330 +922,646 @@ int digImageFile(struct scalpelState* state) {
   return SCALPEL_OK;
 }
 
-// GGRIII: carveImageFile() uses the header/footer offsets database
-// created by digImageFile() to build a list of files to carve.  These
-// files are then carved during a single, sequential pass over the
-// image file.  The global 'readbuffer' is used as a buffer in this
-// function.
+// # of carves in the first slab of a carve list
+#define CARVE_SLAB_SIZE    1024
+
+// storage for a new carve, from 'list's slabs.  Like the offset lists
+// (see offsets.c), each slab is twice the size of the one before and
+// slabs never move, so carves cost no allocation of their own and are
+// all freed at once in destroyCarveList().
+static struct CarveInfo *newCarve(struct scalpelState *state,
+				   struct CarveList *list) {
+
+  int k = list->numslabs - 1;
+
+  if (k < 0 || list->slabused == ((unsigned long long)CARVE_SLAB_SIZE << k)) {
+    k++;
+    list->slabs[k] = (struct CarveInfo *)
+      malloc(sizeof(struct CarveInfo) * ((unsigned long long)CARVE_SLAB_SIZE << k));
+    checkMemoryAllocation(state, list->slabs[k], __LINE__, __FILE__, "carveinfo");
+    list->numslabs++;
+    list->slabused = 0;
+  }
+  return &(list->slabs[k][list->slabused++]);
+}
 
-int carveImageFile(struct scalpelState* state) {
 
-  FILE *infile;
-  struct SearchSpecLine *currentneedle;
-  struct CarveInfo *carveinfo;
-  char fn[MAX_STRING_LENGTH];        // temp buffer for output filename
-  char orgdir[MAX_STRING_LENGTH];    // buffer for name of organizing subdirectory
-  unsigned long long start, stop;    // temp begin/end bytes for file to carve
-  unsigned long long prevstopindex;  // tracks index of first 'reasonable' 
-                                     // footer
-  int needlenum;
-  unsigned long long filesize = 0, bytesread = 0, 
-    fileposition = 0, filebegin = 0; 
-  long err = 0;
-  int displayUnits = UNITS_BYTES;
-  int success = 0;
-  unsigned long long i,j;
-  int halt;
-  char chopped;                     // file chopped because it exceeds
-                                    // max carve size for type?
-  int CURRENTFILESOPEN = 0;         // number of files open (during carve)
+// add 'carve' to 'list'.  Carves must be added in creation order.
+static void addCarve(struct scalpelState *state, struct CarveList *list,
+		     struct CarveInfo *carve) {
 
-  // index of header and footer within image file, in SIZE_OF_BUFFER
-  // blocks
-  unsigned long long headerblockindex, footerblockindex;    
+  if (list->numcarves == list->carvestorage) {
+    list->carvestorage = list->carvestorage ? list->carvestorage * 2 : 1024;
+    list->carves = (struct CarveInfo **)realloc(list->carves,
+						list->carvestorage *
+						sizeof(struct CarveInfo *));
+    checkMemoryAllocation(state, list->carves, __LINE__, __FILE__, "carvelist");
+  }
+  carve->index = list->numcarves;
+  list->carves[list->numcarves++] = carve;
+}
 
-  struct Queue *carvelists;   // one entry for each SIZE_OF_BUFFER bytes of
-                              // input file
 
+static int compareCarveStarts(const void *a, const void *b) {
 
-  // open image file and get size so carvelists can be allocated
-  if ((infile = fopen(state->imagefile,"rb")) == NULL) {
-    fprintf(stderr, "ERROR: Couldn't open input file: %s -- %s\n", 
-	    (*(state->imagefile)=='\0')?"<blank>":state->imagefile,
-	    strerror(errno));
-    return SCALPEL_ERROR_FILE_OPEN;
+  struct CarveInfo *x = *(struct CarveInfo **)a, *y = *(struct CarveInfo **)b;
+
+  if (x->start != y->start) {
+    return x->start < y->start ? -1 : 1;
   }
+  return x->index < y->index ? -1 : (x->index > y->index);
+}
 
-#ifdef __WIN32
-  // explicit binary option for Win32
-   setmode(fileno(infile),O_BINARY);
-#endif
-#ifdef __LINUX
-  fcntl(fileno(infile),F_SETFL, O_LARGEFILE);
-#endif
-  
-  // If skip was activated, then there's no way headers/footers were
-  // found there, so skip during the carve operations, too
 
-  if (state->skip > 0){
-    if (!skipInFile(state,infile)) {
-      return SCALPEL_ERROR_FILE_READ;
+static int compareCarveWork(const void *a, const void *b) {
+
+  unsigned long long x = ((struct CarveWork *)a)->carve->index;
+  unsigned long long y = ((struct CarveWork *)b)->carve->index;
+
+  return x < y ? -1 : (x > y);
+}
+
+
+// prepare 'list' for the sweep over the image file in pass 2, after
+// all carves have been added.  Also merges the buffers each carve
+// touches into ranges of buffers with work.
+static void startCarveList(struct scalpelState *state, struct CarveList *list) {
+
+  unsigned long long i, first, last, n = list->numcarves + 1;
+
+  list->bystart = (struct CarveInfo **)malloc(n * sizeof(struct CarveInfo *));
+  list->active = (struct CarveInfo **)malloc(n * sizeof(struct CarveInfo *));
+  list->ranges = (struct CarveRange *)malloc(n * sizeof(struct CarveRange));
+  list->work = (struct CarveWork *)malloc(n * sizeof(struct CarveWork));
+  list->scratch = (struct CarveWork *)malloc(n * sizeof(struct CarveWork));
+  if (! list->bystart || ! list->active || ! list->ranges || ! list->work ||
+      ! list->scratch) {
+    checkMemoryAllocation(state, NULL, __LINE__, __FILE__, "carvelist");
+  }
+
+  if (list->numcarves > 0) {
+    memcpy(list->bystart, list->carves,
+	   list->numcarves * sizeof(struct CarveInfo *));
+  }
+  qsort(list->bystart, list->numcarves, sizeof(struct CarveInfo *),
+	compareCarveStarts);
+  list->nextstart = 0;
+  list->numactive = 0;
+  list->numwork = 0;
+
+  list->numranges = 0;
+  for (i = 0; i < list->numcarves; i++) {
+    first = list->bystart[i]->start / SIZE_OF_BUFFER;
+    last = list->bystart[i]->stop / SIZE_OF_BUFFER;
+    if (list->numranges > 0 &&
+	first <= list->ranges[list->numranges - 1].last + 1) {
+      if (last > list->ranges[list->numranges - 1].last) {
+	list->ranges[list->numranges - 1].last = last;
+      }
+    }
+    else {
+      list->ranges[list->numranges].first = first;
+      list->ranges[list->numranges].last = last;
+      list->numranges++;
     }
   }
+}
 
-  filebegin = ftello(infile);
-  if ((filesize = measureOpenFile(infile, state)) == -1) {
-    fprintf (stderr,
-	     "ERROR: Couldn't measure size of image file %s\n", 
-	     state->imagefile);
-    return SCALPEL_ERROR_FILE_READ;
+
+// does the SIZE_OF_BUFFER-sized buffer with index 'bufferindex' in the
+// image file hold data to carve?  Used by the pass 2 image reader,
+// possibly in another thread, so only the ranges, which don't change
+// during pass 2, are looked at.
+static int carveListWanted(void *carvelist, unsigned long long bufferindex) {
+
+  struct CarveList *list = (struct CarveList *)carvelist;
+  unsigned long long low = 0, high = list->numranges, middle;
+
+  while (low < high) {
+    middle = low + (high - low) / 2;
+    if (list->ranges[middle].last < bufferindex) {
+      low = middle + 1;
+    }
+    else {
+      high = middle;
+    }
+  }
+  return low < list->numranges && list->ranges[low].first <= bufferindex;
+}
+
+
+// list the work for buffer 'bufferindex' in list->work.  Buffers must
+// be visited in increasing order, but buffers without work may be
+// skipped.
+//
+// The work is ordered by operation.  Within an operation, work for
+// carves created while no carve with a lower operation in this buffer
+// existed comes first, newest first, followed by the rest, oldest
+// first.  This fixes the order in which carved files are closed and
+// logged in the audit file, and matches earlier versions of Scalpel.
+static void planCarveWork(struct CarveList *list, unsigned long long bufferindex) {
+
+  struct CarveInfo *carve;
+  struct CarveWork *swap;
+  unsigned long long i, kept = 0, cut, n = 0;
+  int operation;
+
+  list->numwork = 0;
+
+  // carves started in earlier buffers continue or stop here
+  for (i = 0; i < list->numactive; i++) {
+    carve = list->active[i];
+    list->work[list->numwork].carve = carve;
+    if (carve->stop / SIZE_OF_BUFFER <= bufferindex) {
+      list->work[list->numwork++].operation = STOPCARVE;
+    }
+    else {
+      list->work[list->numwork++].operation = CONTINUECARVE;
+      list->active[kept++] = carve;
+    }
+  }
+  list->numactive = kept;
+
+  // carves starting here
+  while (list->nextstart < list->numcarves &&
+	 list->bystart[list->nextstart]->start / SIZE_OF_BUFFER <= bufferindex) {
+    carve = list->bystart[list->nextstart++];
+    list->work[list->numwork].carve = carve;
+    if (carve->stop / SIZE_OF_BUFFER <= bufferindex) {
+      list->work[list->numwork++].operation = STARTSTOPCARVE;
+    }
+    else {
+      list->work[list->numwork++].operation = STARTCARVE;
+      list->active[list->numactive++] = carve;
+    }
   }
 
-  // allocate memory for carvelists--we alloc a queue for each
-  // SIZE_OF_BUFFER bytes in advance because it's simpler and an empty
-  // queue doesn't consume much memory, anyway.
+  qsort(list->work, list->numwork, sizeof(struct CarveWork), compareCarveWork);
+  for (operation = STARTCARVE; operation <= CONTINUECARVE; operation++) {
+    for (cut = 0; cut < list->numwork && list->work[cut].operation >= operation;
+	 cut++) {
+    }
+    for (i = cut; i-- > 0;) {
+      if (list->work[i].operation == operation) {
+	list->scratch[n++] = list->work[i];
+      }
+    }
+    for (i = cut; i < list->numwork; i++) {
+      if (list->work[i].operation == operation) {
+	list->scratch[n++] = list->work[i];
+      }
+    }
+  }
+  swap = list->work;
+  list->work = list->scratch;
+  list->scratch = swap;
+}
 
-  carvelists = malloc(sizeof(Queue) * (2 + ( filesize / SIZE_OF_BUFFER)));
-  checkMemoryAllocation(state, carvelists, __LINE__, __FILE__, "carvelists");
 
-  // queue associated with each buffer of data holds pointers to
-  // CarveInfo structures.
+// free 'list' and its carves.  Filenames are normally freed when
+// carved files are closed for the last time.
+static void destroyCarveList(struct CarveList *list) {
 
-  fprintf(stdout, "Allocating work queues...\n");
+  unsigned long long i;
+  int k;
 
-  for (i = 0; i < 2 + (filesize / SIZE_OF_BUFFER); i++) {
-    init_queue(&carvelists[i],
-	       sizeof(struct CarveInfo *),
-	       TRUE, 0);
+  for (i = 0; i < list->numcarves; i++) {
+    free(list->carves[i]->filename);
   }
-  fprintf(stdout, "Work queues allocation complete. Building carve lists...\n");
+  for (k = 0; k < list->numslabs; k++) {
+    free(list->slabs[k]);
+  }
+  free(list->carves);
+  free(list->bystart);
+  free(list->active);
+  free(list->ranges);
+  free(list->work);
+  free(list->scratch);
+}
 
-  // build carvelists before 2nd pass over image file
-  
-  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
 
-    currentneedle = &(state->SearchSpec[needlenum]);
+// generate the unique filename for 'carve', from its file type and
+// its # among carved files and among its type's subdirectories.
+// Filenames are made only when carved files are first opened, so
+// that planned carves don't each hold one.
+static char *carveFilename(struct scalpelState *state, struct CarveInfo *carve) {
+
+  struct SearchSpecLine *needle = &(state->SearchSpec[carve->needlenum]);
+  char fn[MAX_STRING_LENGTH];        // temp buffer for output filename
+  char orgdir[MAX_STRING_LENGTH];    // buffer for name of organizing subdirectory
+  char *filename;
+
+  if (state->organizeSubdirectories) {
+    snprintf(orgdir, MAX_STRING_LENGTH, "%s/%s-%d-%1lu", 
+	     state->outputdirectory,
+	     needle->suffix,
+	     carve->needlenum,
+	     carve->dirnum);
+  }
+  else {
+    snprintf(orgdir, MAX_STRING_LENGTH, "%s", state->outputdirectory);
+  }
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wformat-truncation"
+  if (state->modeNoSuffix || needle->suffix[0] == SCALPEL_NOEXTENSION) {
+#ifdef __WIN32
+    snprintf(fn,MAX_STRING_LENGTH,"%s/%08I64u",
+	     orgdir,
+	     carve->filenum);
+#else
+    snprintf(fn,MAX_STRING_LENGTH,"%s/%08llu",
+	     orgdir,
+	     carve->filenum);
+#endif
+  }
+  else {
+#ifdef __WIN32
+    snprintf(fn,MAX_STRING_LENGTH,"%s/%08I64u.%s",
+	     orgdir,
+	     carve->filenum,
+	     needle->suffix);
+#else
+    snprintf(fn,MAX_STRING_LENGTH,"%s/%08llu.%s",
+	     orgdir,
+	     carve->filenum,
+	     needle->suffix);
+#endif
+  }
+#pragma GCC diagnostic pop
 
-    // handle each discovered header independently
+  filename = (char *)malloc(strlen(fn) + 1);
+  checkMemoryAllocation(state, filename, __LINE__, __FILE__, "carveinfo");
+  strcpy(filename, fn);
+  return filename;
+}
 
-    prevstopindex = 0;
-    for (i = 0; i < currentneedle->offsets.numheaders; i++) {
-      start = currentneedle->offsets.headers[i];
 
-      // block aligned test for "-q"
+static void addPlannedCarve(struct CarvePlan *plan, unsigned long long start,
+			    unsigned long long stop, char chopped) {
 
-      if (state->blockAlignedOnly && start % state->alignedblocksize != 0) {
-	continue;
-      }
+  if (plan->numcarves == plan->carvestorage) {
+    plan->carvestorage = plan->carvestorage ? plan->carvestorage * 2 : 1024;
+    plan->carves = (struct PlannedCarve *)realloc(plan->carves,
+						  plan->carvestorage *
+						  sizeof(struct PlannedCarve));
+    checkMemoryAllocation(plan->state, plan->carves, __LINE__, __FILE__,
+			  "carve plan");
+  }
+  plan->carves[plan->numcarves].start = start;
+  plan->carves[plan->numcarves].stop = stop;
+  plan->carves[plan->numcarves].chopped = chopped;
+  plan->numcarves++;
+}
 
-      stop = 0;
-      chopped = 0;
-    
-      // case 1: no footer defined for this file type
-      if (! currentneedle->endlength) {
 
-	// this is the unfortunate case--if file type doesn't have a footer,
-	// all we can done is carve a block between header position and
-	// maximum carve size.
-	stop = start + currentneedle->length - 1;
-	// these are always considered chopped, because we don't really
-	// know the actual size
-	chopped = 1;
+// pair each header of the plan's file type with a footer.  The
+// footers are found through an OffsetIndex, which gives the same
+// footer a scan of the footer list from 'prevstopindex' would, in
+// logarithmic rather than linear time.
+static void planCarves(struct CarvePlan *plan) {
+
+  struct scalpelState *state = plan->state;
+  struct SearchSpecLine *currentneedle = plan->needle;
+  struct OffsetList *footers = &(currentneedle->offsets.footers);
+  struct OffsetIndex footerindex;
+  unsigned long long start, stop;    // temp begin/end bytes for file to carve
+  unsigned long long prevstopindex;  // tracks index of first 'reasonable' 
+                                     // footer
+  unsigned long long i, j, beyond;
+  char chopped;                     // file chopped because it exceeds
+                                    // max carve size for type?
+
+  buildOffsetIndex(state, footers, &footerindex);
+
+  // handle each discovered header independently
+
+  prevstopindex = 0;
+  for (i = 0; i < currentneedle->offsets.headers.count; i++) {
+    start = offsetAt(&(currentneedle->offsets.headers), i);
+
+    // block aligned test for "-q" and ALIGN=
+
+    if (currentneedle->alignment > 1 && start % currentneedle->alignment != 0) {
+      continue;
+    }
+
+    stop = 0;
+    chopped = 0;
+    
+    // case 1: no footer defined for this file type
+    if (! currentneedle->endlength) {
+
+      // this is the unfortunate case--if file type doesn't have a footer,
+      // all we can done is carve a block between header position and
+      // maximum carve size.
+      stop = start + currentneedle->length - 1;
+      // these are always considered chopped, because we don't really
+      // know the actual size
+      chopped = 1;
+    }
+    else if (currentneedle->searchtype == SEARCHTYPE_FORWARD ||
+	     currentneedle->searchtype == SEARCHTYPE_FORWARD_NEXT) {
+      // footer defined: use FORWARD or FORWARD_NEXT semantics.
+      // Stop at first occurrence of footer, but for FORWARD,
+      // include the header in the carved file; for FORWARD_NEXT,
+      // don't include footer in carved file.  For FORWARD_NEXT, if
+      // no footer is found, then the maximum carve size for this
+      // file type will be used and carving will proceed.  For
+      // FORWARD, if no footer is found then no carving will be
+      // performed unless -b was specified on the command line.
+
+      //	if (state->ignoreEmbedded) {
+      //	  adjustForEmbedding(currentneedle, i, &prevstopindex);
+      //	}
+
+      // footers before the first one past the header can't match
+      // this header or any later one
+      j = firstOffsetAbove(footers, &footerindex, prevstopindex, start);
+      if (j > prevstopindex) {
+	prevstopindex = j - 1;
       }
-      else if (currentneedle->searchtype == SEARCHTYPE_FORWARD ||
-	       currentneedle->searchtype == SEARCHTYPE_FORWARD_NEXT) {
-	// footer defined: use FORWARD or FORWARD_NEXT semantics.
-	// Stop at first occurrence of footer, but for FORWARD,
-	// include the header in the carved file; for FORWARD_NEXT,
-	// don't include footer in carved file.  For FORWARD_NEXT, if
-	// no footer is found, then the maximum carve size for this
-	// file type will be used and carving will proceed.  For
-	// FORWARD, if no footer is found then no carving will be
-	// performed unless -b was specified on the command line.
-
-	halt = 0;
-	
-	//	if (state->ignoreEmbedded) {
-	//	  adjustForEmbedding(currentneedle, i, &prevstopindex);
-	//	}
-
-	for (j = prevstopindex; j < currentneedle->offsets.numfooters && 
-	       ! halt; j++) {
-	  if (currentneedle->offsets.footers[j] <= start) {
-	    prevstopindex = j;
-	  }
-	  else {
-	    halt = 1;
-	    stop = currentneedle->offsets.footers[j];
 
-	    if (currentneedle->searchtype == SEARCHTYPE_FORWARD) {
-	      // include footer in carved file
-	      stop += currentneedle->endlength - 1;
+      if (j < footers->count) {
+	stop = offsetAt(footers, j);
+
+	if (currentneedle->searchtype == SEARCHTYPE_FORWARD) {
+	  // include footer in carved file
+	  stop += currentneedle->endlength - 1;
+	}
+	else {
+	  // FORWARD_NEXT--don't include footer in carved file
+	  stop--;
+	}
+	// sanity check on size of potential file to carve--different
+	// actions depending on FORWARD or FORWARD_NEXT semantics
+	if (stop - start + 1 > currentneedle->length) {
+	  if (currentneedle->searchtype == SEARCHTYPE_FORWARD) {
+	    // if the user specified -b, then foremost 0.69
+	    // compatibility is desired: carve this file even 
+	    // though the footer wasn't found and indicate
+	    // the file was chopped, in the log.  Otherwise, 
+	    // carve nothing and move on.
+	    if (state->carveWithMissingFooters) {
+	      stop = start + currentneedle->length - 1;
+	      chopped = 1;
 	    }
 	    else {
-	      // FORWARD_NEXT--don't include footer in carved file
-	      stop--;
+	      stop = 0;
 	    }
-	    // sanity check on size of potential file to carve--different
-	    // actions depending on FORWARD or FORWARD_NEXT semantics
-	    if (stop - start + 1 > currentneedle->length) {
-	      if (currentneedle->searchtype == SEARCHTYPE_FORWARD) {
-		// if the user specified -b, then foremost 0.69
-		// compatibility is desired: carve this file even 
-		// though the footer wasn't found and indicate
-		// the file was chopped, in the log.  Otherwise, 
-		// carve nothing and move on.
-		if (state->carveWithMissingFooters) {
-		  stop = start + currentneedle->length - 1;
-		  chopped = 1;
-		}
-		else {
-		  stop = 0;
-		}
-	      }
-	      else {
-		// footer found for FORWARD_NEXT, but distance exceeds
-		// max carve size for this file type, so use max carve
-		// size as stop
-		stop = start + currentneedle->length - 1;
-		chopped = 1;
-	      }
-	    }
-	  }
-	}
-	if (! halt && 
-	    (currentneedle->searchtype == SEARCHTYPE_FORWARD_NEXT ||
-	     (currentneedle->searchtype == SEARCHTYPE_FORWARD &&
-	      state->carveWithMissingFooters))) {
-	  // no footer found for SEARCHTYPE_FORWARD_NEXT, or no footer
-	  // found for SEARCHTYPE_FORWARD and user specified -b, so just use
-	  // max carve size for this file type as stop
-	  stop = start + currentneedle->length - 1;
-	}
-      }
-      else {
-	// footer defined: use REVERSE semantics: want matching footer
-	// as far away from header as possible, within maximum carving
-	// size for this file type.  Don't bother to look at footers
-	// that can't possibly match a header and remember this info
-	// in prevstopindex, as the next headers will be even deeper
-	// into the image file.  Footer is included in carved file for
-	// this type of carve.
-	halt = 0;
-	for (j = prevstopindex; j < currentneedle->offsets.numfooters && 
-	       ! halt; j++) {
-	  if (currentneedle->offsets.footers[j] <= start) {
-	    prevstopindex = j;
-	  }
-	  else if (currentneedle->offsets.footers[j] - start <= 
-		   currentneedle->length) {
-	    stop = currentneedle->offsets.footers[j] 
-	      + currentneedle->endlength - 1;
 	  }
 	  else {
-	    halt = 1;
+	    // footer found for FORWARD_NEXT, but distance exceeds
+	    // max carve size for this file type, so use max carve
+	    // size as stop
+	    stop = start + currentneedle->length - 1;
+	    chopped = 1;
 	  }
 	}
       }
+      else if (currentneedle->searchtype == SEARCHTYPE_FORWARD_NEXT ||
+	       (currentneedle->searchtype == SEARCHTYPE_FORWARD &&
+		state->carveWithMissingFooters)) {
+	// no footer found for SEARCHTYPE_FORWARD_NEXT, or no footer
+	// found for SEARCHTYPE_FORWARD and user specified -b, so just use
+	// max carve size for this file type as stop
+	stop = start + currentneedle->length - 1;
+      }
+    }
+    else {
+      // footer defined: use REVERSE semantics: want matching footer
+      // as far away from header as possible, within maximum carving
+      // size for this file type.  Don't bother to look at footers
+      // that can't possibly match a header and remember this info
+      // in prevstopindex, as the next headers will be even deeper
+      // into the image file.  Footer is included in carved file for
+      // this type of carve.  Footers between 'prevstopindex' and
+      // the first one beyond the maximum carving size are either
+      // before the header or within reach of it.
+      beyond = firstOffsetAbove(footers, &footerindex, prevstopindex,
+				start + currentneedle->length);
+      j = lastOffsetAbove(footers, &footerindex, prevstopindex, beyond, start);
+      if (j < beyond) {
+	stop = offsetAt(footers, j) + currentneedle->endlength - 1;
+      }
+      j = lastOffsetAtMost(footers, &footerindex, prevstopindex, beyond, start);
+      if (j < beyond) {
+	prevstopindex = j;
+      }
+    }
       
-      // if stop <> 0, then we have enough information to set up a
-      // file carving operation
-      if (stop) {
-	// don't carve past end of image file...
-	stop = stop > filesize ? filesize : stop;
-
-	// find indices (in SIZE_OF_BUFFER units) of header and
-	// footer, so the carveinfo can be placed into the right
-	// queues.  The priority of each element in a queue allows the
-	// appropriate thing to be done (e.g., STARTSTOPCARVE,
-	// STARTCARVE, STOPCARVE, CONTINUECARVE).
-	
-	headerblockindex = start / SIZE_OF_BUFFER;
-	footerblockindex = stop / SIZE_OF_BUFFER;
+    // if stop <> 0, then we have enough information to set up a
+    // file carving operation
+    if (stop) {
+      addPlannedCarve(plan, start, stop, chopped);
+    }
+  }
 
-	// set up a struct CarveInfo for inclusion into the
-	// appropriate carvelists
+  destroyOffsetIndex(&footerindex);
+}
 
-	// generate unique filename for file to carve
 
-	if (state->organizeSubdirectories) {
-	  snprintf(orgdir, MAX_STRING_LENGTH, "%s/%s-%d-%1lu", 
-		   state->outputdirectory,
-		   currentneedle->suffix,
-		   needlenum,
-		   currentneedle->organizeDirNum);
-	  if (! state->previewMode) {
-#ifdef __WIN32
-	    mkdir(orgdir);
-#else
-	    mkdir(orgdir, 0777);
-#endif
-	  }
-	}
-	else {
-	  snprintf(orgdir, MAX_STRING_LENGTH, "%s", state->outputdirectory);
-	}
+// planning thread: plan carves for file types until there are none left
+static void *planWorker(void *arg) {
+
+  struct CarvePlanner *planner = (struct CarvePlanner *)arg;
+  int p;
+
+  while (1) {
+    pthread_mutex_lock(&(planner->lock));
+    p = planner->nextplan++;
+    pthread_mutex_unlock(&(planner->lock));
+    if (p >= planner->numplans) {
+      break;
+    }
+    planCarves(&(planner->plans[p]));
+  }
+
+  return NULL;
+}
+
+
+// plan carves for all file types, with as many threads as are used
+// for searching in pass 1.  If a thread can't be created, the others
+// do its share.
+static void planAllCarves(struct scalpelState *state, struct CarvePlan *plans,
+			  int numplans) {
+
+  struct CarvePlanner planner;
+  pthread_t threads[MAX_SEARCH_THREADS];
+  int numthreads = 0, i;
+
+  planner.plans = plans;
+  planner.numplans = numplans;
+  planner.nextplan = 0;
+  pthread_mutex_init(&(planner.lock), NULL);
+
+  for (i = 1; i < state->numSearchThreads && i < numplans; i++) {
+    if (pthread_create(&(threads[numthreads]), NULL, planWorker, &planner)) {
+      break;
+    }
+    numthreads++;
+  }
+  planWorker(&planner);
+
+  for (i = 0; i < numthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  pthread_mutex_destroy(&(planner.lock));
+}
+
+
+// GGRIII: carveImageFile() uses the header/footer offsets database
+// created by digImageFile() to build a list of files to carve.  These
+// files are then carved during a single, sequential pass over the
+// image file.  The image reader (see reader.c) reads only the
+// SIZE_OF_BUFFER-sized buffers that contain data to carve.
+
+int carveImageFile(struct scalpelState* state) {
+
+  FILE *infile;
+  struct SearchSpecLine *currentneedle;
+  struct CarveInfo *carveinfo;
+  char orgdir[MAX_STRING_LENGTH];    // buffer for name of organizing subdirectory
+  char checkpoint[MAX_STRING_LENGTH];  // name of pass 1 checkpoint
+  unsigned long long start, stop;    // temp begin/end bytes for file to carve
+  struct CarvePlan *plans, *plan;    // carves for each file type
+  int needlenum, numneedles;
+  unsigned long long filesize = 0, filebegin = 0, bufferposition;
+  unsigned long long imageend;      // end of the image, in carve positions
+  long err = 0;
+  int displayUnits = UNITS_BYTES;
+  unsigned long long i;
+  char chopped;                     // file chopped because it exceeds
+                                    // max carve size for type?
+  int CURRENTFILESOPEN = 0;         // number of files open (during carve)
+
+  struct CarveList carvelist;       // all files to carve
+  struct ImageReader reader;
+  struct ReadBuffer *rb;
+  struct IoRing *ring = NULL;       // for writing carved files, if
+                                    // io_uring is available
+  unsigned long long window = 0;    // # of buffers carved from so far
+
+
+  // open image file and get size
+  if ((infile = fopen(state->imagefile,"rb")) == NULL) {
+    fprintf(stderr, "ERROR: Couldn't open input file: %s -- %s\n", 
+	    (*(state->imagefile)=='\0')?"<blank>":state->imagefile,
+	    strerror(errno));
+    return SCALPEL_ERROR_FILE_OPEN;
+  }
 
-	if (state->modeNoSuffix || currentneedle->suffix[0] == 
-	    SCALPEL_NOEXTENSION) {
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wformat-truncation"
 #ifdef __WIN32
-	  snprintf(fn,MAX_STRING_LENGTH,"%s/%08I64u",
-		   orgdir,
-		   state->fileswritten);
-#else
-	  snprintf(fn,MAX_STRING_LENGTH,"%s/%08llu",
-		   orgdir,
-		   state->fileswritten);
+  // explicit binary option for Win32
+   setmode(fileno(infile),O_BINARY);
+#endif
+#ifdef __LINUX
+  fcntl(fileno(infile),F_SETFL, O_LARGEFILE);
 #endif
+  
+  // If skip was activated, then there's no way headers/footers were
+  // found there, so skip during the carve operations, too
 
-	}
-	else {
+  if (state->skip > 0){
+    if (!skipInFile(state,infile)) {
+      return SCALPEL_ERROR_FILE_READ;
+    }
+  }
+
+  filebegin = ftello(infile);
+  if ((filesize = measureOpenFile(infile, state)) == -1) {
+    fprintf (stderr,
+	     "ERROR: Couldn't measure size of image file %s\n", 
+	     state->imagefile);
+    return SCALPEL_ERROR_FILE_READ;
+  }
+
+  // with the coverage blockmap, carve positions skip covered blocks
+  imageend = filebegin + filesize;
+  if (state->useCoverageBlockmap) {
+    imageend = logicalPosition(state, imageend);
+  }
+
+  memset(&carvelist, 0, sizeof(struct CarveList));
+  fprintf(stdout, "Building carve lists...\n");
+
+  // build carve list before 2nd pass over image file.  Headers are
+  // paired with footers for all file types first, in parallel, then
+  // carves are added to the carve list in file type order, so files
+  // are numbered the same way regardless of the # of threads.
+
+  for (numneedles = 0; state->SearchSpec[numneedles].suffix != NULL;
+       numneedles++) {
+  }
+  plans = (struct CarvePlan *)calloc(numneedles + 1, sizeof(struct CarvePlan));
+  checkMemoryAllocation(state, plans, __LINE__, __FILE__, "carve plan");
+  for (needlenum = 0; needlenum < numneedles; needlenum++) {
+    plans[needlenum].state = state;
+    plans[needlenum].needle = &(state->SearchSpec[needlenum]);
+  }
+  planAllCarves(state, plans, numneedles);
+  
+  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
+
+    currentneedle = &(state->SearchSpec[needlenum]);
+
+    plan = &(plans[needlenum]);
+    for (i = 0; i < plan->numcarves; i++) {
+      start = plan->carves[i].start;
+      stop = plan->carves[i].stop;
+      chopped = plan->carves[i].chopped;
+
+      // don't carve past end of image file.  'stop' is the position
+      // of the last byte to carve.
+      if (stop > imageend - 1) {
+	stop = imageend - 1;
+      }
+
+      // set up a struct CarveInfo for the carve list.  The carved
+      // file is named when it's first opened, but its subdirectory
+      // is created now, along with the subdirectory's first file.
+
+      if (state->organizeSubdirectories && ! state->previewMode &&
+	  currentneedle->numfilestocarve % state->organizeMaxFilesPerSub == 0) {
+	snprintf(orgdir, MAX_STRING_LENGTH, "%s/%s-%d-%1lu", 
+		 state->outputdirectory,
+		 currentneedle->suffix,
+		 needlenum,
+		 currentneedle->organizeDirNum);
 #ifdef __WIN32
-	  snprintf(fn,MAX_STRING_LENGTH,"%s/%08I64u.%s",
-		   orgdir,
-		   state->fileswritten,
-		   currentneedle->suffix);
+	mkdir(orgdir);
 #else
-	  snprintf(fn,MAX_STRING_LENGTH,"%s/%08llu.%s",
-		   orgdir,
-		   state->fileswritten,
-		   currentneedle->suffix);
+	mkdir(orgdir, 0777);
 #endif
-	}
-#pragma GCC diagnostic pop
-	state->fileswritten++;     
-	currentneedle->numfilestocarve++;
-	if (currentneedle->numfilestocarve % state->organizeMaxFilesPerSub == 0) {
-	  currentneedle->organizeDirNum++;
-	}
+      }
 
-	carveinfo = malloc(sizeof(struct CarveInfo));
-	checkMemoryAllocation(state, carveinfo, __LINE__, __FILE__, "carveinfo");
-
-	// remember filename
-	carveinfo->filename=malloc(strlen(fn)+1);
-	checkMemoryAllocation(state, carveinfo->filename, __LINE__, __FILE__, "carveinfo");
-	strcpy(carveinfo->filename, fn);
-	carveinfo->start = start;
-	carveinfo->stop = stop;
-	carveinfo->chopped = chopped;
-
-	// fp will be allocated when the first byte of the file is
-	// in the current buffer and cleaned up when we encounter the
-	// last byte of the file.
-	carveinfo->fp = 0;      
-
-	if (headerblockindex == footerblockindex) {
-	  // header and footer will both appear in the same buffer
-	  add_to_queue(&carvelists[headerblockindex], 
-		       &carveinfo, STARTSTOPCARVE);
-	}
-	else {
-	  // header/footer will appear in different buffers, add carveinfo to 
-	  // stop and start lists...
-	  add_to_queue(&carvelists[headerblockindex], &carveinfo, STARTCARVE);
-	  add_to_queue(&carvelists[footerblockindex], &carveinfo, STOPCARVE);
-	  // .. and to all lists in between (these will result in a full
-	  // SIZE_OF_BUFFER bytes being carved into the file).  
-	  for (j = headerblockindex+1; j < footerblockindex; j++) {
-	    add_to_queue(&carvelists[j], &carveinfo, CONTINUECARVE);
-	  }
-	}
+      carveinfo = newCarve(state, &carvelist);
+      carveinfo->filename = NULL;
+      carveinfo->needlenum = needlenum;
+      carveinfo->dirnum = currentneedle->organizeDirNum;
+      carveinfo->filenum = state->fileswritten;
+      carveinfo->start = start;
+      carveinfo->stop = stop;
+      carveinfo->chopped = chopped;
+
+      state->fileswritten++;     
+      currentneedle->numfilestocarve++;
+      if (currentneedle->numfilestocarve % state->organizeMaxFilesPerSub == 0) {
+	currentneedle->organizeDirNum++;
       }
+
+      // fp will be allocated when the first byte of the file is
+      // in the current buffer and cleaned up when we encounter the
+      // last byte of the file.
+      carveinfo->fp = 0;      
+
+      addCarve(state, &carvelist, carveinfo);
     }
+    free(plan->carves);
   }
+  free(plans);
+  startCarveList(state, &carvelist);
   
   fprintf(stdout, "Carve lists built.  Workload:\n");
   for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
@@ -915,109 +1593,97 @@ int carveImageFile(struct scalpelState* state) {
   fprintf(stdout, "Image file pass 2/2.\n");
 
   // now read image file in SIZE_OF_BUFFER-sized windows, writing
-  // carved files to output directory
+  // carved files to output directory.  The reader skips windows for
+  // which there is no work to do.
 
-  success = 1;
-  while (success) {
+  // buffers must line up with the carve list, so if the skip isn't a
+  // multiple of SIZE_OF_BUFFER, start at the buffer boundary below it
+  fseeko(infile, filebegin - filebegin % SIZE_OF_BUFFER, SEEK_SET);
 
-    unsigned long long biglseek = 0L;
-    // goal: skip reading buffers for which there is no work to do by using one big
-    // seek
-    fileposition = ftello_use_coverage_map(state, infile);
-    
-    while (queue_length(&carvelists[fileposition / SIZE_OF_BUFFER]) == 0
-	   && success) {
-      biglseek += SIZE_OF_BUFFER;
-      fileposition += SIZE_OF_BUFFER;
-      success = fileposition <= filesize;
-      
-    }
+  if (! state->previewMode) {
+    ring = startIoRing(state);
+  }
 
-    if (success && biglseek) {
-      fseeko_use_coverage_map(state, infile, biglseek);
+  // with io_uring, a buffer is kept until its writes are done, while
+  // the next one is carved from, so the reader needs a third buffer
+  if ((err = startCarveReader(state, &reader, infile, imageend,
+			      carveListWanted, &carvelist,
+			      state->previewMode, ring ? 3 : 2)) != SCALPEL_OK) {
+    if (ring) {
+      stopIoRing(ring);
     }
-    
-    if (! success) { 
+    return err;
+  }
+
+  while (1) {
+
+    rb = nextReadBuffer(&reader);
+
+    if (rb->status == READ_DONE) { 
       // not an error--just means we've exhausted the image file--show
       // progress report then quit carving
       displayPosition(&displayUnits,filesize, 
 		      filesize,state->imagefile);
-
-      continue;
+      break;
     }
-
-    if (! state->previewMode) {
-      bytesread = fread_use_coverage_map(state,readbuffer,1,SIZE_OF_BUFFER, infile);
-      // Check for read errors
-      if ((err = ferror(infile))) {
-	return SCALPEL_ERROR_FILE_READ;      
-      }
-      else if (bytesread == 0) {   
-	// no error, but image file exhausted
-	success = 0;
-	continue;
-      }
+    else if (rb->status == READ_EOF) {
+      // no error, but image file exhausted
+      break;
     }
-    else {
-      // in preview mode, seeks are used in the 2nd pass instead of
-      // reads.  This isn't optimal, but it's fast enough and avoids
-      // complicating the file carving code further.
-
-      fileposition = ftello_use_coverage_map(state, infile);
-      fseeko_use_coverage_map(state, infile, SIZE_OF_BUFFER);
-      bytesread = ftello_use_coverage_map(state, infile) - fileposition;
-
-      // Check for errors
-      if ((err = ferror(infile))) {
-	return SCALPEL_ERROR_FILE_READ;      
-      }
-      else if (bytesread == 0) {   
-	// no error, but image file exhausted
-	success = 0;
-	continue;
+    else if (rb->status == READ_ERROR) {
+      if (ring) {
+	stopIoRing(ring);
       }
+      stopImageReader(&reader);
+      return SCALPEL_ERROR_FILE_READ;      
     }
 
-    success = 1;
-
     // progress report needs real file position
-    fileposition = ftello(infile);
-    displayPosition(&displayUnits,fileposition-filebegin,
+    displayPosition(&displayUnits,rb->fileposition-filebegin,
 		    filesize,state->imagefile);
 
     // if using coverage map for carving, need adjusted file position
-    fileposition = ftello_use_coverage_map(state, infile);
+    bufferposition = rb->position;
     
     // signal check
     if (signal_caught == SIGTERM || signal_caught == SIGINT) {
       clean_up(state,signal_caught);
     }
 
-    // deal with work for this SIZE_OF_BUFFER-sized block by
-    // examining the associated queue
-    rewind_queue(&carvelists[(fileposition-bytesread) / SIZE_OF_BUFFER]);
+    // deal with work for this SIZE_OF_BUFFER-sized block
+    planCarveWork(&carvelist, bufferposition / SIZE_OF_BUFFER);
 
-    while (! end_of_queue(&carvelists[(fileposition-bytesread) / SIZE_OF_BUFFER])) {
-      struct CarveInfo *carve;
-      int operation;
+    for (i = 0; i < carvelist.numwork; i++) {
+      struct CarveInfo *carve = carvelist.work[i].carve;
+      int operation = carvelist.work[i].operation;
       unsigned long long bytestowrite = 0, byteswritten = 0, offset = 0;
 
-      peek_at_current(&carvelists[(fileposition-bytesread) / SIZE_OF_BUFFER], 
-		      &carve);
-      operation = 
-	current_priority(&carvelists[(fileposition-bytesread)/SIZE_OF_BUFFER]);
-
       // open file, if beginning of carve operation or file had to be closed
       // previously due to resource limitations
       if (operation == STARTSTOPCARVE || 
 	  operation == STARTCARVE || carve->fp == 0) {
 
+	if (! carve->filename) {
+	  carve->filename = carveFilename(state, carve);
+	}
 	if (! state->previewMode && state->modeVerbose) {
 	  fprintf(stdout, "OPENING %s\n", carve->filename);
 	}
 
+	// a resumed run (-R) replaces files the interrupted run carved,
+	// rather than appending to them
+	if (state->resumeFromCheckpoints && ! state->previewMode &&
+	    (operation == STARTSTOPCARVE || operation == STARTCARVE)) {
+	  remove(carve->filename);
+	}
+
 	carve->fp=(FILE *)1;
-	if (! state->previewMode) {
+	if (ring) {
+	  carve->fp = openIoFile(carve->filename,
+				 operation == STARTSTOPCARVE ||
+				 operation == STARTCARVE);
+	}
+	else if (! state->previewMode) {
 	  carve->fp = fopen(carve->filename,"ab");
 	}
 
@@ -1026,6 +1692,10 @@ int carveImageFile(struct scalpelState* state) {
 		   carve->filename, strerror(errno));
 	  fprintf (state->auditFile, "Error opening file: %s -- %s\n", 
 		   carve->filename, strerror(errno));
+	  if (ring) {
+	    stopIoRing(ring);
+	  }
+	  stopImageReader(&reader);
 	  return SCALPEL_ERROR_FILE_WRITE;
 	}
 	else {
@@ -1033,38 +1703,58 @@ int carveImageFile(struct scalpelState* state) {
 	}
       }
 
-      // write some portion of current readbuffer
+      // write some portion of current buffer
       switch (operation) {
       case CONTINUECARVE:
 	offset = 0;
 	bytestowrite = SIZE_OF_BUFFER;
 	break;
       case STARTSTOPCARVE:
-	offset = carve->start - (fileposition-bytesread);
+	offset = carve->start - bufferposition;
 	bytestowrite = carve->stop - carve->start + 1;
 	break;
       case STARTCARVE:
-	offset = carve->start - (fileposition-bytesread);
+	offset = carve->start - bufferposition;
 	bytestowrite = (carve->stop - carve->start + 1) >
 	  (SIZE_OF_BUFFER - offset) ? (SIZE_OF_BUFFER - offset) :
 	  (carve->stop - carve->start + 1);
 	break;
       case STOPCARVE:
 	offset = 0;
-	bytestowrite=carve->stop - (fileposition-bytesread) + 1;
+	bytestowrite=carve->stop - bufferposition + 1;
 	break;
       }
 
-      if (! state->previewMode) {
-	if ((byteswritten = fwrite(readbuffer + offset,
+      if (ring) {
+	// carved files contain image bytes carve->start..carve->stop
+	if ((err = queueIoWrite(ring, carve->fp, rb->buffer + offset,
+				bytestowrite,
+				bufferposition + offset - carve->start, window,
+				carve->filename)) != SCALPEL_OK) {
+	  stopIoRing(ring);
+	  stopImageReader(&reader);
+	  return err;
+	}
+      }
+      else if (! state->previewMode) {
+	if ((byteswritten = fwrite(rb->buffer + offset,
 				   sizeof(char),
 				   bytestowrite,
 				   carve->fp)) != bytestowrite) {
+
+	  // a large write goes straight from the buffer to the kernel,
+	  // which reports an unreadable page of a memory mapped image
+	  // file as EFAULT rather than raising SIGBUS
+	  if (errno == EFAULT) {
+	    stopImageReader(&reader);
+	    return SCALPEL_ERROR_FILE_READ;
+	  }
 	  
 	  fprintf(stderr,"Error writing to file: %s -- %s\n",
 		  carve->filename, strerror(ferror(carve->fp)));
 	  fprintf(state->auditFile,"Error writing to file: %s -- %s\n",
 		  carve->filename, strerror(ferror(carve->fp)));
+	  stopImageReader(&reader);
 	  return SCALPEL_ERROR_FILE_WRITE;
 	}
       }
@@ -1078,10 +1768,23 @@ int carveImageFile(struct scalpelState* state) {
 	  operation == STOPCARVE || 
 	  CURRENTFILESOPEN > MAX_FILES_TO_OPEN) {
 	err = 0;
-	if (! state->previewMode) {
+	if (ring) {
 	  if (state->modeVerbose) {
 	    fprintf(stdout, "CLOSING %s\n", carve->filename);
 	  }
+	  if ((err = closeAfterIo(ring, carve->fp)) != SCALPEL_OK) {
+	    stopIoRing(ring);
+	    stopImageReader(&reader);
+	    return err;
+	  }
+	}
+	else if (! state->previewMode) {
+	  if (state->modeVerbose) {
+	    fprintf(stdout, "CLOSING %s\n", carve->filename);
+	  }
+	  if (state->bypassPageCache && fflush(carve->fp) == 0) {
+	    dropFromPageCache(fileno(carve->fp));
+	  }
 	  err = fclose(carve->fp);
 	}
 
@@ -1090,6 +1793,10 @@ int carveImageFile(struct scalpelState* state) {
 		  carve->filename,strerror(ferror(carve->fp)));
 	  fprintf(state->auditFile, "Error closing file: %s -- %s\n\n",
 		  carve->filename,strerror(ferror(carve->fp)));
+	  if (ring) {
+	    stopIoRing(ring);
+	  }
+	  stopImageReader(&reader);
 	  return SCALPEL_ERROR_FILE_WRITE;
 	}
 	else {
@@ -1101,28 +1808,74 @@ int carveImageFile(struct scalpelState* state) {
 	  // open!
 	  if (operation == STARTSTOPCARVE || operation == STOPCARVE) {
 	    auditUpdateCoverageBlockmap(state, carve);
-	    free(carve->filename);
+	    if (ring) {
+	      freeAfterIo(ring, carve->filename, window);
+	    }
+	    else {
+	      free(carve->filename);
+	    }
+	    carve->filename = NULL;
 	  }
 	}
       }
-      next_element(&carvelists[(fileposition-bytesread) / SIZE_OF_BUFFER]);
+    }
+
+    // part of a memory mapped image couldn't be read while carving
+    // from this buffer
+    if (imageReadFailed(&reader)) {
+      if (ring) {
+	stopIoRing(ring);
+      }
+      stopImageReader(&reader);
+      return SCALPEL_ERROR_FILE_READ;
+    }
+
+    if (ring) {
+      // the writes for this buffer are now in flight; hand the
+      // previous buffer back to the reader once its writes are done
+      if (window > 0) {
+	if ((err = waitIoRing(ring, window - 1)) != SCALPEL_OK) {
+	  stopIoRing(ring);
+	  stopImageReader(&reader);
+	  return err;
+	}
+	releaseReadBuffer(&reader);
+      }
+      window++;
+    }
+    else {
+      releaseReadBuffer(&reader);
     }
   }
-  
+
+  if (ring && (err = stopIoRing(ring)) != SCALPEL_OK) {
+    stopImageReader(&reader);
+    return err;
+  }
+  stopImageReader(&reader);
   closeFile(infile);
 
   // write header/footer database, if necessary, before 
   // cleanup for current image file.  
 
   if (state->generateHeaderFooterDatabase) {
-    if ((err = writeHeaderFooterDatabase(state)) != SCALPEL_OK) {
+    if ((err = writeHeaderFooterDatabase(state, filesize)) != SCALPEL_OK) {
       return err;
     }
   }
 
-  // tear down coverage maps, if necessary
+  // write and tear down coverage maps, if necessary
+  if ((err = saveCoverageBlockmap(state)) != SCALPEL_OK) {
+    return err;
+  }
   destroyCoverageMaps(state);
 
+  // the image file is finished, so its checkpoint isn't needed anymore
+  if (state->checkpointInterval || state->resumeFromCheckpoints) {
+    checkpointName(state, checkpoint);
+    remove(checkpoint);
+  }
+
   printf("Processing of image file complete. Cleaning up...\n");
 
   // tear down header/footer databases
@@ -1131,30 +1884,12 @@ int carveImageFile(struct scalpelState* state) {
        state->SearchSpec[needlenum].suffix != NULL; 
        needlenum++) {
     currentneedle = &(state->SearchSpec[needlenum]);
-    if (currentneedle->offsets.headers) {
-      free(currentneedle->offsets.headers);
-    }
-    if (currentneedle->offsets.footers) {
-      free(currentneedle->offsets.footers);
-    }
-    currentneedle->offsets.headers = 0;
-    currentneedle->offsets.footers = 0;
-    currentneedle->offsets.numheaders = 0;
-    currentneedle->offsets.numfooters = 0;
-    currentneedle->offsets.headerstorage = 0;
-    currentneedle->offsets.footerstorage = 0;
+    destroyOffsetList(&(currentneedle->offsets.headers));
+    destroyOffsetList(&(currentneedle->offsets.footers));
   }
   
-  // tear down work queues--no memory deallocation for each queue
-  // entry required, because memory associated with fp and the
-  // filename was freed after the carved file was closed.
-
-  // destroy queues
-  for (i = 0; i < 2 + (filesize / SIZE_OF_BUFFER); i++) {
-    destroy_queue(&carvelists[i]);
-  }
-  // destroy array of queues
-  free(carvelists);
+  // tear down carve list
+  destroyCarveList(&carvelist);
 
   printf("Done.");
   return SCALPEL_OK;
@@ -1163,10 +1898,12 @@ int carveImageFile(struct scalpelState* state) {
 
 
 // write header/footer database for current image file into the
-// Scalpel output directory. No information is written into the
-// database for file types without a suffix.  The filename used
-// is the current image filename with ".hfd" appended.  The 
-// format of the database file is straightforward:
+// Scalpel output directory.  The filename used is the current image
+// filename with ".hfd" appended.  By default the database is binary
+// (see struct HfdHeader).  With -T the old text format is written
+// instead, for external tools.  No information is written into a
+// text database for file types without a suffix.  The format of the
+// text database file is straightforward:
 //
 // suffix_#1 (string)
 // number_of_headers (unsigned long long)
@@ -1193,7 +1930,8 @@ int carveImageFile(struct scalpelState* state) {
 // database file, because the Scalpel carving engine isn't aware of
 // gaps created by blocks that are covered by previously carved files.
 
-static int writeHeaderFooterDatabase(struct scalpelState *state) {
+static int writeHeaderFooterDatabase(struct scalpelState *state,
+				     unsigned long long imagesize) {
   
   FILE *dbfile;
   char fn[MAX_STRING_LENGTH];  // filename for header/footer database
@@ -1205,6 +1943,10 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
   snprintf(fn,MAX_STRING_LENGTH,"%s/%s.hfd",
 	   state->outputdirectory,
 	   base_name(state->imagefile));
+
+  if (! state->textHeaderFooterDatabase) {
+    return writeBinaryHeaderFooterDatabase(state, fn, imagesize, NULL);
+  }
   
   if ((dbfile = fopen(fn,"w")) == NULL) {
     fprintf(stderr,"Error writing to header/footer database file: %s\n",
@@ -1240,9 +1982,9 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
       
       // # of headers
 #ifdef __WIN32
-      if (fprintf(dbfile, "%I64u\n", currentneedle->offsets.numheaders) <= 0) {
+      if (fprintf(dbfile, "%I64u\n", currentneedle->offsets.headers.count) <= 0) {
 #else
-      if (fprintf(dbfile, "%llu\n", currentneedle->offsets.numheaders) <= 0) {
+      if (fprintf(dbfile, "%llu\n", currentneedle->offsets.headers.count) <= 0) {
 #endif
 	fprintf(stderr,"Error writing to header/footer database file: %s\n",
 		fn);
@@ -1252,11 +1994,11 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
       }
 
       // all header positions for current suffix
-      for (i = 0; i < currentneedle->offsets.numheaders; i++) {
+      for (i = 0; i < currentneedle->offsets.headers.count; i++) {
 #ifdef __WIN32
-	if (fprintf(dbfile, "%I64u\n", positionUseCoverageBlockmap(state, currentneedle->offsets.headers[i])) <= 0) {
+	if (fprintf(dbfile, "%I64u\n", positionUseCoverageBlockmap(state, offsetAt(&(currentneedle->offsets.headers), i))) <= 0) {
 #else
-	  if (fprintf(dbfile, "%llu\n", positionUseCoverageBlockmap(state, currentneedle->offsets.headers[i])) <= 0) {
+	  if (fprintf(dbfile, "%llu\n", positionUseCoverageBlockmap(state, offsetAt(&(currentneedle->offsets.headers), i))) <= 0) {
 #endif
 	  fprintf(stderr,"Error writing to header/footer database file: %s\n",
 		  fn);
@@ -1268,9 +2010,9 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
 	
       // # of footers
 #ifdef __WIN32
-      if (fprintf(dbfile, "%I64u\n", currentneedle->offsets.numfooters) <= 0) {
+      if (fprintf(dbfile, "%I64u\n", currentneedle->offsets.footers.count) <= 0) {
 #else
-      if (fprintf(dbfile, "%llu\n", currentneedle->offsets.numfooters) <= 0) {
+      if (fprintf(dbfile, "%llu\n", currentneedle->offsets.footers.count) <= 0) {
 #endif
 	fprintf(stderr,"Error writing to header/footer database file: %s\n",
 		fn);
@@ -1280,11 +2022,11 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
       }
       
       // all footer positions for current suffix
-      for (i = 0; i < currentneedle->offsets.numfooters; i++) {
+      for (i = 0; i < currentneedle->offsets.footers.count; i++) {
 #ifdef __WIN32
-	if (fprintf(dbfile, "%I64u\n", positionUseCoverageBlockmap(state, currentneedle->offsets.footers[i])) <= 0) {
+	if (fprintf(dbfile, "%I64u\n", positionUseCoverageBlockmap(state, offsetAt(&(currentneedle->offsets.footers), i))) <= 0) {
 #else
-	  if (fprintf(dbfile, "%llu\n", positionUseCoverageBlockmap(state, currentneedle->offsets.footers[i])) <= 0) {
+	  if (fprintf(dbfile, "%llu\n", positionUseCoverageBlockmap(state, offsetAt(&(currentneedle->offsets.footers), i))) <= 0) {
 #endif
 	  fprintf(stderr,"Error writing to header/footer database file: %s\n",
 		  fn);
@@ -1301,6 +2043,542 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
 }
 
       
+// FNV-1a, for the rule and configuration hashes in binary
+// header/footer databases
+#define HFD_HASH_SEED  14695981039346656037ULL
+
+static unsigned long long hashBytes(unsigned long long hash, const void *bytes,
+				    size_t length) {
+
+  const unsigned char *p = (const unsigned char *)bytes;
+
+  while (length--) {
+    hash = (hash ^ *p++) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+
+// hash of everything in a rule that affects which headers and
+// footers are found.  A rule's suffix, size limit and search type
+// only matter when carving, so they can be changed when carving from
+// a saved database (-H).
+static unsigned long long ruleHash(struct SearchSpecLine *rule) {
+
+  unsigned long long hash = HFD_HASH_SEED;
+
+  hash = hashBytes(hash, &(rule->casesensitive), sizeof(int));
+  hash = hashBytes(hash, &(rule->beginlength), sizeof(int));
+  hash = hashBytes(hash, rule->begin, rule->beginlength);
+  hash = hashBytes(hash, &(rule->endlength), sizeof(int));
+  hash = hashBytes(hash, rule->end, rule->endlength);
+  // offsets of aligned headers were only searched for at aligned
+  // offsets
+  if (rule->alignment > 1) {
+    hash = hashBytes(hash, &(rule->alignment), sizeof(unsigned int));
+  }
+  return hash;
+}
+
+
+// hash of all the rules in the configuration file, and the wildcard
+static unsigned long long configHash(struct scalpelState *state) {
+
+  unsigned long long hash = HFD_HASH_SEED, rulehash;
+  int needlenum;
+
+  hash = hashBytes(hash, &wildcard, sizeof(char));
+  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
+    rulehash = ruleHash(&(state->SearchSpec[needlenum]));
+    hash = hashBytes(hash, &rulehash, sizeof(unsigned long long));
+  }
+  return hash;
+}
+
+
+// suffix of a rule as it's written in the configuration file
+static char *ruleSuffix(struct SearchSpecLine *rule) {
+
+  return rule->suffix[0] == SCALPEL_NOEXTENSION ?
+    SCALPEL_NOEXTENSION_SUFFIX : rule->suffix;
+}
+
+
+// offsets written to a binary header/footer database with one fwrite()
+#define HFD_IO_OFFSETS  65536
+
+// write the offsets in 'list' (as real disk image addresses) to a
+// binary header/footer database.  'buffer' holds HFD_IO_OFFSETS
+// offsets.
+static int writeDatabaseOffsets(struct scalpelState *state, FILE *dbfile,
+				struct OffsetList *list, unsigned long long *buffer) {
+
+  unsigned long long i;
+  size_t n = 0;
+
+  for (i = 0; i < list->count; i++) {
+    buffer[n++] = positionUseCoverageBlockmap(state, offsetAt(list, i));
+    if (n == HFD_IO_OFFSETS || i + 1 == list->count) {
+      if (fwrite(buffer, sizeof(unsigned long long), n, dbfile) != n) {
+	return SCALPEL_ERROR_FILE_WRITE;
+      }
+      n = 0;
+    }
+  }
+  return SCALPEL_OK;
+}
+
+
+// write a binary header/footer database, or a pass 1 checkpoint if
+// 'resume' (the position pass 1 continues from) isn't NULL.  The rule
+// table is filled in first, so each section's position is known, then
+// the sections are written in order.  The file is flushed to disk
+// before it's closed.
+static int writeBinaryHeaderFooterDatabase(struct scalpelState *state, char *fn,
+					   unsigned long long imagesize,
+					   unsigned long long *resume) {
+
+  static const char padding[8] = { 0 };
+  FILE *dbfile;
+  struct HfdHeader header;
+  struct HfdRule *rules;
+  struct SearchSpecLine *rule;
+  unsigned long long position, *buffer;
+  int needlenum, numrules, err = SCALPEL_OK;
+  size_t needlebytes;
+
+  for (numrules = 0; state->SearchSpec[numrules].suffix != NULL; numrules++) {
+  }
+
+  memset(&header, 0, sizeof(struct HfdHeader));
+  memcpy(header.magic, HFD_MAGIC, sizeof(header.magic));
+  header.version = HFD_VERSION;
+  header.numrules = numrules;
+  header.confighash = configHash(state);
+  header.imagesize = imagesize;
+  header.skip = state->skip;
+  header.wildcard = (unsigned char)wildcard;
+  header.flags = (state->noSearchOverlap ? HFD_NO_SEARCH_OVERLAP : 0) |
+    (state->useCoverageBlockmap ? HFD_COVERAGE_MAP : 0) |
+    (resume ? HFD_CHECKPOINT : 0) |
+    (state->generateHeaderFooterDatabase ? HFD_ALL_FOOTERS : 0);
+  header.resume = resume ? positionUseCoverageBlockmap(state, *resume) : 0;
+
+  rules = (struct HfdRule *)calloc(numrules + 1, sizeof(struct HfdRule));
+  checkMemoryAllocation(state, rules, __LINE__, __FILE__, "database rules");
+  position = sizeof(struct HfdHeader) + numrules * sizeof(struct HfdRule);
+  for (needlenum = 0; needlenum < numrules; needlenum++) {
+    rule = &(state->SearchSpec[needlenum]);
+    rules[needlenum].rulehash = ruleHash(rule);
+    rules[needlenum].suffixlength = strlen(ruleSuffix(rule));
+    rules[needlenum].beginlength = rule->beginlength;
+    rules[needlenum].endlength = rule->endlength;
+    rules[needlenum].casesensitive = rule->casesensitive;
+    rules[needlenum].searchtype = rule->searchtype;
+    rules[needlenum].maxlength = rule->length;
+    rules[needlenum].numheaders = rule->offsets.headers.count;
+    rules[needlenum].numfooters = rule->offsets.footers.count;
+
+    needlebytes = rules[needlenum].suffixlength + rule->beginlength + rule->endlength;
+    rules[needlenum].needles = position;
+    position += (needlebytes + 7) & ~(size_t)7;
+    rules[needlenum].headers = position;
+    position += rule->offsets.headers.count * sizeof(unsigned long long);
+    rules[needlenum].footers = position;
+    position += rule->offsets.footers.count * sizeof(unsigned long long);
+  }
+
+  buffer = (unsigned long long *)malloc(HFD_IO_OFFSETS * sizeof(unsigned long long));
+  checkMemoryAllocation(state, buffer, __LINE__, __FILE__, "database buffer");
+
+  if ((dbfile = fopen(fn,"wb")) == NULL) {
+    err = SCALPEL_ERROR_FILE_WRITE;
+  }
+  else {
+#ifdef __WIN32
+    // set binary mode for Win32
+    setmode(fileno(dbfile),O_BINARY);
+#endif
+#ifdef __LINUX
+    fcntl(fileno(dbfile),F_SETFL, O_LARGEFILE);
+#endif
+
+    if (fwrite(&header, sizeof(struct HfdHeader), 1, dbfile) != 1 ||
+	(numrules > 0 &&
+	 fwrite(rules, sizeof(struct HfdRule), numrules, dbfile) != (size_t)numrules)) {
+      err = SCALPEL_ERROR_FILE_WRITE;
+    }
+
+    for (needlenum = 0; needlenum < numrules && err == SCALPEL_OK; needlenum++) {
+      rule = &(state->SearchSpec[needlenum]);
+      needlebytes = rules[needlenum].suffixlength + rule->beginlength + rule->endlength;
+      if (fwrite(ruleSuffix(rule), 1, rules[needlenum].suffixlength, dbfile) !=
+	  rules[needlenum].suffixlength ||
+	  fwrite(rule->begin, 1, rule->beginlength, dbfile) != (size_t)rule->beginlength ||
+	  fwrite(rule->end, 1, rule->endlength, dbfile) != (size_t)rule->endlength ||
+	  fwrite(padding, 1, -needlebytes & 7, dbfile) != (-needlebytes & 7)) {
+	err = SCALPEL_ERROR_FILE_WRITE;
+      }
+      else if ((err = writeDatabaseOffsets(state, dbfile, &(rule->offsets.headers),
+					   buffer)) == SCALPEL_OK) {
+	err = writeDatabaseOffsets(state, dbfile, &(rule->offsets.footers), buffer);
+      }
+    }
+
+    if (fflush(dbfile) ||
+#ifdef __WIN32
+	_commit(fileno(dbfile))
+#else
+	fsync(fileno(dbfile))
+#endif
+	) {
+      err = SCALPEL_ERROR_FILE_WRITE;
+    }
+    if (fclose(dbfile)) {
+      err = SCALPEL_ERROR_FILE_WRITE;
+    }
+  }
+
+  free(buffer);
+  free(rules);
+
+  if (err != SCALPEL_OK) {
+    fprintf(stderr,"Error writing to header/footer database file: %s\n",
+	    fn);
+    fprintf(state->auditFile, "Error writing to header/footer database file: %s\n",
+	    fn);
+  }
+  return err;
+}
+
+      
+// read 'count' offsets at 'position' in a binary header/footer
+// database into 'list' ('name' is for allocation errors).  Offsets
+// must be inside the part of the image that was searched, and are
+// translated back to the logical image if a coverage blockmap is in
+// use.
+static int readDatabaseOffsets(struct scalpelState *state, FILE *dbfile,
+			       struct OffsetList *list, unsigned long long position,
+			       unsigned long long count, unsigned long long *buffer,
+			       unsigned long long imagesize, char *name) {
+
+  unsigned long long i, j, n;
+
+  if (fseeko(dbfile, (off64_t)position, SEEK_SET)) {
+    return SCALPEL_ERROR_FATAL_READ;
+  }
+  for (i = 0; i < count; i += n) {
+    n = count - i < HFD_IO_OFFSETS ? count - i : HFD_IO_OFFSETS;
+    if (fread(buffer, sizeof(unsigned long long), n, dbfile) != n) {
+      return SCALPEL_ERROR_FATAL_READ;
+    }
+    for (j = 0; j < n; j++) {
+      if (buffer[j] < state->skip || buffer[j] - state->skip >= imagesize) {
+	return SCALPEL_ERROR_FATAL_READ;
+      }
+      appendOffset(state, list, state->useCoverageBlockmap ?
+		   logicalPosition(state, buffer[j]) : buffer[j], name);
+    }
+  }
+  return SCALPEL_OK;
+}
+
+
+// read the binary header/footer database or pass 1 checkpoint 'fn'
+// into the header/footer offsets.  'resume' is NULL for a database,
+// which must come from a finished pass 1 without a coverage blockmap.
+// A database's rules are matched to the configuration file's by their
+// hashes, wherever they are in either file, and offsets are read only
+// for rules found in it; the others have 'fromdatabase' cleared.  For
+// a checkpoint, the rules must be the same, and the position pass 1
+// continues from is stored in 'resume'.  Either must come from the
+// same image, -s and -r settings.  Checkpoints must also agree on
+// anything else pass 1 depends on.
+static int loadHeaderFooterDatabase(struct scalpelState *state, char *fn,
+				    unsigned long long imagesize,
+				    unsigned long long *resume) {
+
+  FILE *dbfile;
+  struct HfdHeader header;
+  struct HfdRule *rules = NULL;
+  struct SearchSpecLine *rule;
+  unsigned long long *buffer = NULL, rulehash;
+  int needlenum, numrules, stored, reusable, err = SCALPEL_OK;
+  unsigned int k, longest = 0;
+  char *kind = resume ? "Checkpoint" : "Header/footer database";
+  char *problem = NULL;
+
+  if ((dbfile = fopen(fn,"rb")) == NULL) {
+    fprintf(stderr, "Couldn't open %s file: %s -- %s\n",
+	    kind, fn, strerror(errno));
+    fprintf(state->auditFile, "Couldn't open %s file: %s -- %s\n",
+	    kind, fn, strerror(errno));
+    return SCALPEL_ERROR_FILE_OPEN;
+  }
+#ifdef __WIN32
+  // set binary mode for Win32
+  setmode(fileno(dbfile),O_BINARY);
+#endif
+#ifdef __LINUX
+  fcntl(fileno(dbfile),F_SETFL, O_LARGEFILE);
+#endif
+
+  for (numrules = 0; state->SearchSpec[numrules].suffix != NULL; numrules++) {
+  }
+
+  if (fread(&header, sizeof(struct HfdHeader), 1, dbfile) != 1 ||
+      memcmp(header.magic, HFD_MAGIC, sizeof(header.magic))) {
+    problem = "isn't a binary header/footer database";
+  }
+  else if (header.version != HFD_VERSION) {
+    problem = "has an unsupported version";
+  }
+  else if (resume &&
+	   (header.numrules != numrules || header.confighash != configHash(state))) {
+    problem = "was built with different configuration file rules";
+  }
+  else if (header.imagesize != imagesize || header.skip != state->skip) {
+    problem = "doesn't match the size of the image file or -s";
+  }
+  else if (((header.flags & HFD_NO_SEARCH_OVERLAP) != 0) != (state->noSearchOverlap != 0)) {
+    problem = "was built with a different -r setting";
+  }
+  else if (((header.flags & HFD_CHECKPOINT) != 0) != (resume != NULL)) {
+    problem = resume ? "isn't a checkpoint" : "is an unfinished pass 1 checkpoint";
+  }
+  else if (! resume && ((header.flags & HFD_COVERAGE_MAP) || state->useCoverageBlockmap)) {
+    problem = "can't be used with a coverage blockmap (-u)";
+  }
+  else if (resume &&
+	   ((header.flags & HFD_COVERAGE_MAP) != 0) != (state->useCoverageBlockmap != 0)) {
+    problem = "was built with a different -u setting";
+  }
+  else if (resume &&
+	   ((header.flags & HFD_ALL_FOOTERS) != 0) != (state->generateHeaderFooterDatabase != 0)) {
+    problem = "was built with a different -d setting";
+  }
+
+  if (! problem) {
+    rules = (struct HfdRule *)malloc((header.numrules + 1) * sizeof(struct HfdRule));
+    checkMemoryAllocation(state, rules, __LINE__, __FILE__, "database rules");
+    if (fread(rules, sizeof(struct HfdRule), header.numrules, dbfile) != header.numrules) {
+      err = SCALPEL_ERROR_FATAL_READ;
+    }
+  }
+
+  // without -d, which footers pass 1 keeps depends on the size limits
+  for (needlenum = 0; resume && ! state->generateHeaderFooterDatabase &&
+	 ! problem && err == SCALPEL_OK && needlenum < numrules; needlenum++) {
+    if (rules[needlenum].maxlength != state->SearchSpec[needlenum].length) {
+      problem = "was built with different configuration file rules";
+    }
+  }
+
+  if (problem) {
+    fprintf(stderr, "%s file %s %s.\n", kind, fn, problem);
+    fprintf(state->auditFile, "%s file %s %s.\n", kind, fn, problem);
+    free(rules);
+    fclose(dbfile);
+    return SCALPEL_GENERAL_ABORT;
+  }
+
+  // which matches straddle buffers, and so are found twice, depends
+  // on the overlap between buffers, so a database's offsets can only
+  // be reused if its longest needle is the same
+  for (k = 0; ! resume && k < header.numrules && err == SCALPEL_OK; k++) {
+    longest = rules[k].beginlength > longest ? rules[k].beginlength : longest;
+    longest = rules[k].endlength > longest ? rules[k].endlength : longest;
+  }
+  reusable = header.wildcard == (unsigned char)wildcard &&
+    longest == (unsigned int)findLongestNeedle(state->SearchSpec);
+  if (! resume && ! reusable && err == SCALPEL_OK) {
+    scalpelLog(state, "The wildcard or longest needle changed since %s was built, "
+	       "so none of its offsets can be used.\n", fn);
+  }
+
+  buffer = (unsigned long long *)malloc(HFD_IO_OFFSETS * sizeof(unsigned long long));
+  checkMemoryAllocation(state, buffer, __LINE__, __FILE__, "database buffer");
+
+  for (needlenum = 0; needlenum < numrules && err == SCALPEL_OK; needlenum++) {
+    rule = &(state->SearchSpec[needlenum]);
+    stored = resume ? needlenum : -1;
+    if (! resume && reusable) {
+      rulehash = ruleHash(rule);
+      for (k = 0; k < header.numrules && stored < 0; k++) {
+	if (rules[k].rulehash == rulehash) {
+	  stored = k;
+	}
+      }
+      rule->fromdatabase = stored >= 0;
+    }
+    if (stored >= 0 &&
+	(err = readDatabaseOffsets(state, dbfile, &(rule->offsets.headers),
+				   rules[stored].headers, rules[stored].numheaders,
+				   buffer, imagesize, "header array")) == SCALPEL_OK) {
+      err = readDatabaseOffsets(state, dbfile, &(rule->offsets.footers),
+				rules[stored].footers, rules[stored].numfooters,
+				buffer, imagesize, "footer array");
+    }
+  }
+
+  free(buffer);
+  free(rules);
+  fclose(dbfile);
+
+  if (err != SCALPEL_OK) {
+    fprintf(stderr, "Error reading %s file (truncated?): %s\n", kind, fn);
+    fprintf(state->auditFile, "Error reading %s file (truncated?): %s\n", kind, fn);
+    return err;
+  }
+
+  if (resume) {
+    *resume = state->useCoverageBlockmap ?
+      logicalPosition(state, header.resume) : header.resume;
+  }
+  return SCALPEL_OK;
+}
+
+
+// read the binary header/footer database saved for the current image
+// file by an earlier run with -d into the header/footer offsets, in
+// place of pass 1 (-H).  Rules' sizes, suffixes and search types may
+// differ from that run, since they only matter for carving.  The
+// number of rules that aren't in the database, and must still be
+// searched for, is stored in 'unmatched'.
+static int readHeaderFooterDatabase(struct scalpelState *state,
+				    unsigned long long imagesize, int *unmatched) {
+
+  char fn[MAX_STRING_LENGTH];  // filename for header/footer database
+  int err, needlenum;
+
+  snprintf(fn,MAX_STRING_LENGTH,"%s/%s.hfd",
+	   state->headerFooterDatabaseDirectory,
+	   base_name(state->imagefile));
+
+  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
+    state->SearchSpec[needlenum].fromdatabase = FALSE;
+  }
+  if ((err = loadHeaderFooterDatabase(state, fn, imagesize, NULL)) != SCALPEL_OK) {
+    return err;
+  }
+
+  *unmatched = 0;
+  for (needlenum = 0; state->SearchSpec[needlenum].suffix != NULL; needlenum++) {
+    if (! state->SearchSpec[needlenum].fromdatabase) {
+      (*unmatched)++;
+    }
+  }
+  if (*unmatched == 0) {
+    scalpelLog(state, "Read header/footer database %s, skipping pass 1.\n", fn);
+  }
+  else {
+    scalpelLog(state, "Read header/footer database %s; searching only for the "
+	       "%d rules that aren't in it.\n", fn, *unmatched);
+  }
+  return SCALPEL_OK;
+}
+
+
+// name of the pass 1 checkpoint for the current image file, in the
+// output directory
+static void checkpointName(struct scalpelState *state, char *fn) {
+
+  snprintf(fn,MAX_STRING_LENGTH,"%s/%s.checkpoint",
+	   state->outputdirectory,
+	   base_name(state->imagefile));
+}
+
+
+// save the header/footer offsets found so far in pass 1, which has
+// searched everything before 'resume', so an interrupted run can be
+// continued with -R.  The checkpoint is written to a temporary file
+// and renamed over the previous one, so a crash while it's written
+// leaves the previous checkpoint intact.
+static int writeCheckpoint(struct scalpelState *state,
+			   unsigned long long imagesize, unsigned long long resume) {
+
+  char fn[MAX_STRING_LENGTH], tempname[MAX_STRING_LENGTH + 4];
+
+  checkpointName(state, fn);
+  snprintf(tempname, sizeof(tempname), "%s.new", fn);
+
+  if (writeBinaryHeaderFooterDatabase(state, tempname, imagesize, &resume) != SCALPEL_OK) {
+    remove(tempname);
+    return SCALPEL_ERROR_FILE_WRITE;
+  }
+
+#ifdef __WIN32
+  // rename() won't replace an existing file on Win32
+  remove(fn);
+#endif
+  if (rename(tempname, fn)) {
+    fprintf(stderr, "Error writing checkpoint file: %s -- %s\n", fn, strerror(errno));
+    fprintf(state->auditFile, "Error writing checkpoint file: %s -- %s\n", fn,
+	    strerror(errno));
+    remove(tempname);
+    return SCALPEL_ERROR_FILE_WRITE;
+  }
+
+  if (state->modeVerbose) {
+#ifdef __WIN32
+    fprintf(stdout, "Wrote checkpoint %s, pass 1 resumes at %I64u.\n", fn, resume);
+#else
+    fprintf(stdout, "Wrote checkpoint %s, pass 1 resumes at %llu.\n", fn, resume);
+#endif
+  }
+  return SCALPEL_OK;
+}
+
+
+// with -R, load the current image file's checkpoint, if there is one,
+// and store the position pass 1 resumes from in 'resume'.  Without a
+// checkpoint, 'resume' is left alone and pass 1 starts from the
+// beginning.
+static int readCheckpoint(struct scalpelState *state,
+			  unsigned long long imagesize, unsigned long long *resume) {
+
+  char fn[MAX_STRING_LENGTH];
+  struct stat info;
+  int err;
+
+  checkpointName(state, fn);
+  if (stat(fn, &info)) {
+    scalpelLog(state, "No checkpoint for %s, starting pass 1 from the beginning.\n",
+	       state->imagefile);
+    return SCALPEL_OK;
+  }
+
+  if ((err = loadHeaderFooterDatabase(state, fn, imagesize, resume)) == SCALPEL_OK) {
+#ifdef __WIN32
+    scalpelLog(state, "Resuming pass 1 from checkpoint %s at %I64u.\n", fn,
+	       positionUseCoverageBlockmap(state, *resume));
+#else
+    scalpelLog(state, "Resuming pass 1 from checkpoint %s at %llu.\n", fn,
+	       positionUseCoverageBlockmap(state, *resume));
+#endif
+  }
+  return err;
+}
+
+
+// terminate if SIGTERM or SIGINT was caught during pass 1, first
+// writing a checkpoint if they're enabled.  Everything before
+// 'resume' has been searched.
+static void checkPass1Signal(struct scalpelState *state,
+			     unsigned long long imagesize, unsigned long long resume) {
+
+  if (signal_caught == SIGTERM || signal_caught == SIGINT) {
+    if (state->checkpointInterval) {
+      writeCheckpoint(state, imagesize, resume);
+    }
+    clean_up(state,signal_caught);
+  }
+}
+
+
+// coverage blockmap entries read or written by one stdio call
+#define COVERAGE_IO_ENTRIES  65536
+
 // The coverage blockmap illustrates which blocks (of a
 // user-specified size) have been "covered" by a carved file.
 // The filename used for the coverage bitmap is the current
@@ -1321,13 +2599,25 @@ static int writeHeaderFooterDatabase(struct scalpelState *state) {
 static int setupCoverageMaps(struct scalpelState *state, unsigned long long filesize) {
 	
   char fn[MAX_STRING_LENGTH];  // filename for coverage blockmap
-  unsigned long long i, k;
+  struct CoverageMapHeader header;
+  unsigned long long i, k, count;
   int empty;
-  unsigned int blocksize, entry;
+  unsigned int *entries;
   
 
   state->coveragebitmap = 0;
+  state->coveragerank = 0;
+  state->coveragemap = 0;
+  state->coverageextents = 0;
+  state->coveragediscard = 0;
   state->coverageblockmap = 0;
+  state->coverageruns = 0;
+  state->coveragenumruns = 0;
+  state->coverageupdates = 0;
+  state->coveragenumupdates = 0;
+  state->coverageupdatestorage = 0;
+  // new blockmaps are written in the compact format
+  state->coveragecompact = TRUE;
   
   if (state->modeVerbose && (state->useCoverageBlockmap || state->updateCoverageBlockmap)) {
     fprintf(stdout, "Setting up coverage maps.\n");
@@ -1335,9 +2625,7 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
   
   if (state->updateCoverageBlockmap || state->useCoverageBlockmap) {
     // generate pathname for coverage blockmap
-    snprintf(fn,MAX_STRING_LENGTH,"%s/%s.map",
-	     state->coveragedirectory,
-	     base_name(state->imagefile));
+    coverageMapName(state, fn);
 
     if (state->modeVerbose) {
       fprintf(stdout, "Coverage blockmap is \"%s\".\n", 
@@ -1365,7 +2653,8 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
       }
 
       // read block size and make sure it matches user-specified block size
-      if (fread(&blocksize, sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
+      if ((state->coveragecompact = readCoverageHeader(state->coverageblockmap,
+						       &header)) < 0) {
 	fprintf(stderr,"Error reading coverage blockmap blocksize in\ncoverage blockmap file: %s\n",
 		fn);
 	fprintf(state->auditFile, "Error reading coverage blockmap blocksize in\ncoverage blockmap file: %s\n",
@@ -1373,15 +2662,23 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
 	return SCALPEL_ERROR_FATAL_READ;
       }
 
+      if (state->coveragecompact && header.version != COVERAGE_MAP_VERSION) {
+	fprintf(stderr,"Unsupported version %u of coverage blockmap file: %s\n",
+		header.version, fn);
+	fprintf(state->auditFile, "Unsupported version %u of coverage blockmap file: %s\n",
+		header.version, fn);
+	return SCALPEL_GENERAL_ABORT;
+      }
+
       if (state->useCoverageBlockmap && ! state->updateCoverageBlockmap) {
 	// just use blocksize in blockmap coverage file
-	state->coverageblocksize = blocksize;
+	state->coverageblocksize = header.blocksize;
 
 	if (state->modeVerbose) {
 	  fprintf(stdout, "Blocksize for coverage blockmap is %u.\n", state->coverageblocksize);
 	}
       }
-      else if (blocksize != state->coverageblocksize) {
+      else if (header.blocksize != state->coverageblocksize) {
 	fprintf(stderr,"User-specified blocksize does not match blocksize in\ncoverage blockmap file: %s\n",
 		fn);
 	fprintf(state->auditFile, "User-specified blocksize does not match blocksize in\ncoverage blockmap file: %s\n",
@@ -1398,36 +2695,82 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
 #endif
       }
 
+      if (state->coveragecompact) {
+	// a compact blockmap is read completely now; it's rewritten
+	// after carving if it's being updated
+	if (header.numblocks != state->coveragenumblocks) {
+	  fprintf(stderr,"Coverage blockmap file doesn't match the size of the image file: %s\n",
+		  fn);
+	  fprintf(state->auditFile, "Coverage blockmap file doesn't match the size of the image file: %s\n",
+		  fn);
+	  return SCALPEL_GENERAL_ABORT;
+	}
+	if (readCoverageRuns(state, state->coverageblockmap, &header) != SCALPEL_OK) {
+	  fprintf(stderr,"Error reading coverage blockmap entry (blockmap truncated?): %s\n", 
+		  fn);
+	  fprintf(state->auditFile, "Error reading coverage blockmap entry (blockmap truncated?): %s\n",
+		  fn);
+	  return SCALPEL_ERROR_FATAL_READ;
+	}
+	fclose(state->coverageblockmap);
+	state->coverageblockmap = 0;
+
+	if (state->modeVerbose) {
+#ifdef __WIN32
+	  fprintf(stdout, "Coverage blockmap has %I64u runs of covered blocks.\n",
+		  state->coveragenumruns);
+#else
+	  fprintf(stdout, "Coverage blockmap has %llu runs of covered blocks.\n",
+		  state->coveragenumruns);
+#endif
+	}
+      }
+
       if (state->useCoverageBlockmap) {
 	if (state->modeVerbose) {
 	  fprintf(stdout, "Allocating and clearing coverage bitmap.\n");
 	}
-	// for bitmap, 8 bits per unsigned char, with each bit representing one
-	// block
-	state->coveragebitmap = malloc((state->coveragenumblocks / 8) 
-				       * sizeof(unsigned char));
+	// for bitmap, 64 bits per unsigned long long, with each bit
+	// representing one block
+	state->coveragebitmap = (unsigned long long *)
+	  calloc(state->coveragenumblocks / 64 + 1, sizeof(unsigned long long));
 	checkMemoryAllocation(state, state->coveragebitmap, __LINE__, __FILE__, "coveragebitmap");
-
-	// zap coverage bitmap 
-	for (k = 0; k < state->coveragenumblocks / 8; k++) {
-	  state->coveragebitmap[k] = 0;
-	}
-	
-	fprintf(stdout, "Reading existing coverage blockmap...this may take a while.\n");
 	
-	for (i = 0; i < state->coveragenumblocks; i++) {
-	  fseeko(state->coverageblockmap, (i + 1) * sizeof(unsigned int), SEEK_SET);
-	  if (fread(&entry, sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
-	    fprintf(stderr,"Error reading coverage blockmap entry (blockmap truncated?): %s\n", 
-		    fn);
-	    fprintf(state->auditFile, "Error reading coverage blockmap entry (blockmap truncated?): %s\n",
-		    fn);
-	    return SCALPEL_ERROR_FATAL_READ;
+	if (state->coveragecompact) {
+	  for (i = 0; i < state->coveragenumruns; i++) {
+	    markCovered(state, state->coverageruns[i].start,
+			state->coverageruns[i].length);
 	  }
-	  if (entry) {
-	    state->coveragebitmap[i / 8] |= 1 << (i % 8);
+	}
+	else {
+	  fprintf(stdout, "Reading existing coverage blockmap...this may take a while.\n");
+	
+	  entries = (unsigned int *)malloc(COVERAGE_IO_ENTRIES * sizeof(unsigned int));
+	  checkMemoryAllocation(state, entries, __LINE__, __FILE__, "entries");
+	  fseeko(state->coverageblockmap, sizeof(unsigned int), SEEK_SET);
+	  for (i = 0; i < state->coveragenumblocks; i += count) {
+	    count = state->coveragenumblocks - i;
+	    if (count > COVERAGE_IO_ENTRIES) {
+	      count = COVERAGE_IO_ENTRIES;
+	    }
+	    if (fread(entries, sizeof(unsigned int), count, state->coverageblockmap) != count) {
+	      fprintf(stderr,"Error reading coverage blockmap entry (blockmap truncated?): %s\n", 
+		      fn);
+	      fprintf(state->auditFile, "Error reading coverage blockmap entry (blockmap truncated?): %s\n",
+		      fn);
+	      free(entries);
+	      return SCALPEL_ERROR_FATAL_READ;
+	    }
+	    for (k = 0; k < count; k++) {
+	      if (entries[k]) {
+		state->coveragebitmap[(i + k) / 64] |= 1ULL << ((i + k) % 64);
+	      }
+	    }
 	  }
+	  free(entries);
 	}
+
+	buildCoverageIndex(state);
       }
     }
     else if (empty && state->useCoverageBlockmap) {
@@ -1437,75 +2780,380 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
 	      fn);
       return SCALPEL_GENERAL_ABORT;
     }
-    else {
-      state->coveragenumblocks = ceil((double)filesize / (double)state->coverageblocksize);
-      if (state->modeVerbose) {
+    else {
+      state->coveragenumblocks = ceil((double)filesize / (double)state->coverageblocksize);
+      if (state->modeVerbose) {
+#ifdef __WIN32
+	fprintf(stdout, "# of blocks in coverage blockmap is %I64u.\n", state->coveragenumblocks);
+#else
+	fprintf(stdout, "# of blocks in coverage blockmap is %llu.\n", state->coveragenumblocks);
+#endif
+      }
+    }
+    
+    if (state->updateCoverageBlockmap && state->coveragecompact) {
+      // create an empty compact blockmap now, so an unwritable
+      // blockmap is found before carving
+      if (empty && writeCoverageRuns(fn, state->coverageblocksize,
+				     state->coveragenumblocks, 0, 0) != SCALPEL_OK) {
+	fprintf(stderr,"Error writing to coverage blockmap file: %s\n",
+		fn);
+	fprintf(state->auditFile, "Error writing to coverage blockmap file: %s\n",
+		fn);
+	return SCALPEL_ERROR_FILE_WRITE;
+      }
+    }
+    else if (state->updateCoverageBlockmap) {
+      // change mode to read/write for future updates of a legacy
+      // coverage blockmap
+      if (state->modeVerbose) {
+	fprintf(stdout, "Changing mode of coverage blockmap file to R/W.\n");
+      }
+      
+      fclose(state->coverageblockmap);
+      if ((state->coverageblockmap = fopen(fn,"r+b")) == NULL) {
+	fprintf(stderr,"Error writing to coverage blockmap file: %s\n",
+		fn);
+	fprintf(state->auditFile, "Error writing to coverage blockmap file: %s\n",
+		fn);
+	return SCALPEL_ERROR_FILE_WRITE;
+      }
+
+#ifdef __WIN32
+      // set binary mode for Win32
+      setmode(fileno(state->coverageblockmap),O_BINARY);
+#endif
+#ifdef __LINUX
+      fcntl(fileno(state->coverageblockmap),F_SETFL, O_LARGEFILE);
+#endif
+
+      mapCoverageBlockmap(state);
+    }
+  }
+  
+  if (state->modeVerbose && (state->useCoverageBlockmap || state->updateCoverageBlockmap)) {
+    printf("Finished setting up coverage maps.\n");
+  }
+
+  return SCALPEL_OK;
+
+ }
+
+// The coverage bitmap has one bit per block of the image, set if the
+// block is covered.  With -u, carving works on a "logical" image made
+// of just the uncovered blocks, so positions must be translated
+// between the logical image and the real one.  Instead of walking the
+// bitmap from block 0, translation uses a rank/select index:
+// coveragerank holds the # of covered blocks before each superblock
+// of COVERAGE_SUPERBLOCK_WORDS bitmap words, so the # of covered
+// blocks before any block (its rank) takes a few popcounts, and the
+// k'th uncovered block (select) is found by a binary search over the
+// superblocks and a scan of one superblock's words.
+
+#define COVERAGE_SUPERBLOCK_WORDS  8
+#define COVERAGE_SUPERBLOCK_BLOCKS (COVERAGE_SUPERBLOCK_WORDS * 64)
+
+static int countBits(unsigned long long word) {
+
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_popcountll(word);
+#else
+  int n;
+
+  for (n = 0; word; n++) {
+    word &= word - 1;
+  }
+  return n;
+#endif
+}
+
+
+// index of the lowest set bit in 'word', which mustn't be 0
+static int lowestBit(unsigned long long word) {
+
+#if defined(__GNUC__) || defined(__clang__)
+  return __builtin_ctzll(word);
+#else
+  int n;
+
+  for (n = 0; ! (word & 1); n++) {
+    word >>= 1;
+  }
+  return n;
+#endif
+}
+
+
+static int blockCovered(struct scalpelState *state, unsigned long long block) {
+
+  return (state->coveragebitmap[block / 64] >> (block % 64)) & 1;
+}
+
+
+// build the rank index for the coverage bitmap.  Bits past the last
+// block are set, so they're never taken for uncovered blocks.
+static void buildCoverageIndex(struct scalpelState *state) {
+
+  unsigned long long numwords = state->coveragenumblocks / 64 + 1, w, total = 0;
+
+  state->coveragebitmap[state->coveragenumblocks / 64] |=
+    ~0ULL << (state->coveragenumblocks % 64);
+
+  state->coveragerank = (unsigned long long *)
+    malloc((numwords / COVERAGE_SUPERBLOCK_WORDS + 1) * sizeof(unsigned long long));
+  checkMemoryAllocation(state, state->coveragerank, __LINE__, __FILE__, "coveragerank");
+
+  for (w = 0; w < numwords; w++) {
+    if (w % COVERAGE_SUPERBLOCK_WORDS == 0) {
+      state->coveragerank[w / COVERAGE_SUPERBLOCK_WORDS] = total;
+    }
+    total += countBits(state->coveragebitmap[w]);
+  }
+
+  state->coverageuncovered = state->coveragenumblocks -
+    coveredBefore(state, state->coveragenumblocks);
+
+  buildCoverageExtents(state);
+}
+
+
+// # of covered blocks before 'block' (rank)
+static unsigned long long coveredBefore(struct scalpelState *state,
+					unsigned long long block) {
+
+  unsigned long long w = block / 64, n, k;
+
+  n = state->coveragerank[w / COVERAGE_SUPERBLOCK_WORDS];
+  for (k = w - w % COVERAGE_SUPERBLOCK_WORDS; k < w; k++) {
+    n += countBits(state->coveragebitmap[k]);
+  }
+  if (block % 64) {
+    n += countBits(state->coveragebitmap[w] & ((1ULL << (block % 64)) - 1));
+  }
+  return n;
+}
+
+
+// the k'th uncovered block, counting from 0 (select), or
+// coveragenumblocks if there are no more than k uncovered blocks
+static unsigned long long uncoveredBlock(struct scalpelState *state,
+					 unsigned long long k) {
+
+  unsigned long long numwords = state->coveragenumblocks / 64 + 1;
+  unsigned long long lo = 0, hi = (numwords - 1) / COVERAGE_SUPERBLOCK_WORDS,
+    mid, w, word;
+  int zeros;
+
+  if (k >= state->coverageuncovered) {
+    return state->coveragenumblocks;
+  }
+
+  // last superblock with at most k uncovered blocks before it
+  while (lo < hi) {
+    mid = (lo + hi + 1) / 2;
+    if (mid * COVERAGE_SUPERBLOCK_BLOCKS - state->coveragerank[mid] <= k) {
+      lo = mid;
+    }
+    else {
+      hi = mid - 1;
+    }
+  }
+  k -= lo * COVERAGE_SUPERBLOCK_BLOCKS - state->coveragerank[lo];
+
+  for (w = lo * COVERAGE_SUPERBLOCK_WORDS; w < numwords; w++) {
+    word = ~state->coveragebitmap[w];
+    zeros = countBits(word);
+    if (k < (unsigned long long)zeros) {
+      while (k--) {
+	word &= word - 1;
+      }
+      return w * 64 + lowestBit(word);
+    }
+    k -= zeros;
+  }
+  return state->coveragenumblocks;
+}
+
+
+// first block at or after 'block' that is covered (or uncovered, if
+// 'covered' is FALSE), or coveragenumblocks if there is none
+static unsigned long long nextBlock(struct scalpelState *state,
+				    unsigned long long block, int covered) {
+
+  unsigned long long numwords = state->coveragenumblocks / 64 + 1, w, word;
+
+  if (block >= state->coveragenumblocks) {
+    return state->coveragenumblocks;
+  }
+  w = block / 64;
+  word = covered ? state->coveragebitmap[w] : ~state->coveragebitmap[w];
+  word &= ~0ULL << (block % 64);
+  while (! word) {
+    if (++w >= numwords) {
+      return state->coveragenumblocks;
+    }
+    word = covered ? state->coveragebitmap[w] : ~state->coveragebitmap[w];
+  }
+  block = w * 64 + lowestBit(word);
+  return block < state->coveragenumblocks ? block : state->coveragenumblocks;
+}
+
+
+// translate a position in the image file into a position in the
+// logical image.  A position in a covered block is translated to
+// the position of the next uncovered byte.
+static unsigned long long logicalPosition(struct scalpelState *state,
+					  unsigned long long position) {
+
+  unsigned long long block = position / state->coverageblocksize;
+
+  if (block >= state->coveragenumblocks) {
+    return position - (state->coveragenumblocks - state->coverageuncovered) *
+      state->coverageblocksize;
+  }
+  return position - coveredBefore(state, block) * state->coverageblocksize -
+    (blockCovered(state, block) ? position % state->coverageblocksize : 0);
+}
+
+
+// Reads that use the coverage blockmap work from a list of the runs
+// of uncovered blocks, built once.  Consecutive runs separated by at
+// most COVERAGE_MAX_GAP covered bytes are read with a single preadv(),
+// with the covered bytes read into coveragediscard; reading through a
+// short gap is cheaper than another system call and seek.
+
+#define COVERAGE_MAX_GAP     (256 * 1024)
+#define COVERAGE_MAX_IOVECS  256
+
+static void buildCoverageExtents(struct scalpelState *state) {
+
+  unsigned long long block = 0, end, allocated = 16, logical = 0;
+  struct CoverageExtent *extent;
+
+  state->coverageextents = (struct CoverageExtent *)
+    malloc(allocated * sizeof(struct CoverageExtent));
+  checkMemoryAllocation(state, state->coverageextents, __LINE__, __FILE__,
+			"coverageextents");
+  state->coveragenumextents = 0;
+
+  while ((block = nextBlock(state, block, FALSE)) < state->coveragenumblocks) {
+    end = nextBlock(state, block, TRUE);
+    if (state->coveragenumextents == allocated) {
+      allocated *= 2;
+      state->coverageextents = (struct CoverageExtent *)
+	realloc(state->coverageextents, allocated * sizeof(struct CoverageExtent));
+      checkMemoryAllocation(state, state->coverageextents, __LINE__, __FILE__,
+			    "coverageextents");
+    }
+    extent = &(state->coverageextents[state->coveragenumextents++]);
+    extent->logical = logical;
+    extent->physical = block * state->coverageblocksize;
+    extent->length = (end - block) * state->coverageblocksize;
+    logical += extent->length;
+    block = end;
+  }
+
+  state->coveragediscard = (char *)malloc(COVERAGE_MAX_GAP);
+  checkMemoryAllocation(state, state->coveragediscard, __LINE__, __FILE__,
+			"coveragediscard");
+
+  if (state->modeVerbose) {
 #ifdef __WIN32
-	fprintf(stdout, "# of blocks in coverage blockmap is %I64u.\n", state->coveragenumblocks);
+    fprintf(stdout, "Coverage blockmap has %I64u uncovered extents.\n",
+	    state->coveragenumextents);
 #else
-	fprintf(stdout, "# of blocks in coverage blockmap is %llu.\n", state->coveragenumblocks);
+    fprintf(stdout, "Coverage blockmap has %llu uncovered extents.\n",
+	    state->coveragenumextents);
 #endif
-      }
+  }
+}
+
+
+// index of the uncovered extent holding logical position 'position',
+// or coveragenumextents if it's past the last one
+static unsigned long long findExtent(struct scalpelState *state,
+				     unsigned long long position) {
+
+  unsigned long long lo = 0, hi = state->coveragenumextents, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (state->coverageextents[mid].logical +
+	state->coverageextents[mid].length <= position) {
+      lo = mid + 1;
     }
-    
-    // change mode to read/write for future updates if coverage blockmap will be updated
-    if (state->updateCoverageBlockmap) {
-      if (state->modeVerbose) {
-	fprintf(stdout, "Changing mode of coverage blockmap file to R/W.\n");
-      }
-      
-      if (! empty) {
-	fclose(state->coverageblockmap);
-      }
-      if ((state->coverageblockmap = fopen(fn,(empty?"w+b":"r+b"))) == NULL) {
-	fprintf(stderr,"Error writing to coverage blockmap file: %s\n",
-		fn);
-	fprintf(state->auditFile, "Error writing to coverage blockmap file: %s\n",
-		fn);
-	return SCALPEL_ERROR_FILE_WRITE;
-      }
+    else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+
+// read the image bytes starting at 'offset' into the 'numiov'
+// buffers in 'iov' (at most COVERAGE_MAX_IOVECS), in order.  Returns
+// the # of bytes read, or -1 on error.  Doesn't change the stream
+// position on systems with preadv().
+static long long readExtents(FILE *stream, struct iovec *iov, int numiov,
+			     unsigned long long offset) {
 
 #ifdef __WIN32
-      // set binary mode for Win32
-      setmode(fileno(state->coverageblockmap),O_BINARY);
-#endif
-#ifdef __LINUX
-      fcntl(fileno(state->coverageblockmap),F_SETFL, O_LARGEFILE);
-#endif
+  long long total = 0;
+  size_t bytesread;
+  int i;
 
-      if (empty) {
-	// create entries in empty coverage blockmap file
-	fprintf(stdout, "Writing empty coverage blockmap...this may take a while.\n");
-	entry = 0;
-	if (fwrite(&(state->coverageblocksize), sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
-	  fprintf(stderr,"Error writing initial entry in coverage blockmap file!\n");
-	  fprintf(state->auditFile, "Error writing initial entry in coverage blockmap file!\n");
-	  return SCALPEL_ERROR_FILE_WRITE;
-	}
-	for (k = 0; k < state->coveragenumblocks; k++) {
-	  if (fwrite(&entry, sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
-	    fprintf(stderr,"Error writing to coverage blockmap file!\n");
-	    fprintf(state->auditFile, "Error writing to coverage blockmap file!\n");
-	    return SCALPEL_ERROR_FILE_WRITE;
-	  }
-	}
-      }
+  if (fseeko(stream, (off64_t)offset, SEEK_SET)) {
+    return -1;
+  }
+  for (i = 0; i < numiov; i++) {
+    bytesread = fread(iov[i].iov_base, 1, iov[i].iov_len, stream);
+    total += bytesread;
+    if (bytesread < iov[i].iov_len) {
+      return ferror(stream) ? -1 : total;
     }
   }
-  
-  if (state->modeVerbose && (state->useCoverageBlockmap || state->updateCoverageBlockmap)) {
-    printf("Finished setting up coverage maps.\n");
+  return total;
+#else
+  long long total = 0, bytesread;
+  struct iovec pending[COVERAGE_MAX_IOVECS];
+
+  // preadv() may return early, like read()
+  memcpy(pending, iov, numiov * sizeof(struct iovec));
+  iov = pending;
+  while (numiov > 0) {
+    if ((bytesread = preadv(fileno(stream), iov, numiov,
+			    (off_t)(offset + total))) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    else if (bytesread == 0) {
+      break;
+    }
+    total += bytesread;
+    while (numiov > 0 && (size_t)bytesread >= iov->iov_len) {
+      bytesread -= iov->iov_len;
+      iov++;
+      numiov--;
+    }
+    if (numiov > 0) {
+      iov->iov_base = (char *)iov->iov_base + bytesread;
+      iov->iov_len -= bytesread;
+    }
   }
+  return total;
+#endif
+}
 
-  return SCALPEL_OK;
-
- }
 
 // map carve->start ... carve->stop into a queue of 'fragments' that
-// define a carved file in the disk image.  
+// define a carved file in the disk image.  Each fragment is a run of
+// uncovered blocks, found by scanning the coverage bitmap a word at a
+// time.
  static void generateFragments(struct scalpelState *state, Queue *fragments, CarveInfo *carve) {
 
-  unsigned long long curblock, neededbytes = carve->stop - carve->start + 1, bytestoskip, 
+  unsigned long long curblock, neededbytes = carve->stop - carve->start + 1,
     morebytes, totalbytes = 0, curpos;
 
   Fragment frag;
@@ -1524,33 +3172,19 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
   }
   else {
     curpos = positionUseCoverageBlockmap(state, carve->start);
-    curblock= curpos / state->coverageblocksize;
-    
-    while (totalbytes < neededbytes && curblock < state->coveragenumblocks) {
-
-      morebytes = 0;
-      bytestoskip = 0;
+    while (totalbytes < neededbytes) {
       
       // skip covered blocks
-      while (curblock < state->coveragenumblocks && 
-	     (state->coveragebitmap[curblock / 8] & (1 << (curblock % 8)))) {
-	bytestoskip += state->coverageblocksize - 
-			curpos % state->coverageblocksize;
-	curblock++;
+      curblock = nextBlock(state, curpos / state->coverageblocksize, FALSE);
+      if (curblock >= state->coveragenumblocks) {
+	break;
+      }
+      if (curblock * state->coverageblocksize > curpos) {
+	curpos = curblock * state->coverageblocksize;
       }
-      
-      curpos += bytestoskip;
       
       // accumulate uncovered blocks in fragment
-      while (curblock < state->coveragenumblocks && 
-	     ((state->coveragebitmap[curblock / 8] & (1 << (curblock % 8))) == 0) &&
-	     totalbytes + morebytes < neededbytes) {
-	
-	morebytes += state->coverageblocksize - 
-		      curpos % state->coverageblocksize;
-	
-	curblock++;
-      }
+      morebytes = nextBlock(state, curblock, TRUE) * state->coverageblocksize - curpos;
       
       // cap size
       if (totalbytes + morebytes > neededbytes) {
@@ -1572,54 +3206,23 @@ static int setupCoverageMaps(struct scalpelState *state, unsigned long long file
  // coverage blockmap to map a logical index in the disk image (i.e.,
  // the index skips covered blocks) to an actual disk image index.  If
  // the coverage blockmap isn't being used, just returns the second
- // argument.  
- //
- // ***This function assumes that the 'position' does NOT lie
- // within a covered block! ***
+ // argument.  Positions past the last uncovered block are taken to
+ // follow the end of the image.
 static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state, unsigned long long position) {
    
+  unsigned long long k;
 
-  unsigned long long totalbytes = 0, neededbytes = position,
-    morebytes, curblock = 0, curpos = 0, bytestoskip;
-   
    if (! state->useCoverageBlockmap) {
      return position;
    }
    else {
-     while (totalbytes < neededbytes && curblock < state->coveragenumblocks) {
-       morebytes = 0;
-       bytestoskip = 0;
-      
-       // skip covered blocks
-       while (curblock < state->coveragenumblocks && 
-	      (state->coveragebitmap[curblock / 8] & (1 << (curblock % 8)))) {
-	 bytestoskip += state->coverageblocksize - 
-	   curpos % state->coverageblocksize;
-	 curblock++;
-       }
-      
-      curpos += bytestoskip;
-      
-      // accumulate uncovered blocks
-      while (curblock < state->coveragenumblocks && 
-	     ((state->coveragebitmap[curblock / 8] & (1 << (curblock % 8))) == 0) &&
-	     totalbytes + morebytes < neededbytes) {
-	
-	morebytes += state->coverageblocksize - 
-		      curpos % state->coverageblocksize;
-	curblock++;
-      }
-      
-      // cap size
-      if (totalbytes + morebytes > neededbytes) {
-	morebytes = neededbytes - totalbytes;
-      }
-      
-      curpos += morebytes;
-      totalbytes += morebytes;
+     k = position / state->coverageblocksize;
+     if (k >= state->coverageuncovered) {
+       return position + (state->coveragenumblocks - state->coverageuncovered) *
+	 state->coverageblocksize;
      }
-     
-     return curpos;
+     return uncoveredBlock(state, k) * state->coverageblocksize +
+       position % state->coverageblocksize;
    }
  }
 
@@ -1632,7 +3235,7 @@ static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state
 
    struct Queue fragments;  
    Fragment *frag;
-   int k, err;
+   int err;
 
    // If the coverage blockmap used to guide carving, then carve->start and
    // carve->stop may not correspond to addresses in the disk image--the coverage blockmap
@@ -1669,12 +3272,10 @@ static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state
 
      // update coverage blockmap, if appropriate
      if (state->updateCoverageBlockmap) {
-       for (k = frag->start / state->coverageblocksize; 
-	    k <= frag->stop / state->coverageblocksize; k++) {
-	 if ((err = updateCoverageBlockmap(state, k)) != SCALPEL_OK) {
-	   destroy_queue(&fragments);
-	   return err;
-	 }
+       if ((err = updateCoverageBlockmap(state, frag->start / state->coverageblocksize,
+					 frag->stop / state->coverageblocksize)) != SCALPEL_OK) {
+	 destroy_queue(&fragments);
+	 return err;
        }
      }
      next_element(&fragments);
@@ -1687,42 +3288,461 @@ static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state
    
 
 
- static int updateCoverageBlockmap(struct scalpelState *state, unsigned long long block) {
+ // A legacy coverage blockmap file holds the block size followed by
+ // one unsigned int per block, counting the carved files that cover
+ // the block.  For updates the file is mmap'd, if possible, so a
+ // carved file's blocks are counted with increments in memory.
+ // Otherwise entries are read and written COVERAGE_IO_ENTRIES at a
+ // time.  Updates to a compact blockmap are collected as runs of
+ // blocks and merged into the blockmap's runs after carving.
+
+ // add one to the coverage blockmap entries for blocks first...last
+ static int updateCoverageBlockmap(struct scalpelState *state, unsigned long long first,
+				   unsigned long long last) {
    
-   unsigned int entry;
+   unsigned long long k, count, i;
+   unsigned int *entries;
+
+   if (! state->updateCoverageBlockmap) {
+     return SCALPEL_OK;
+   }
+
+   if (last >= state->coveragenumblocks) {
+     fprintf(stderr,"Error reading coverage blockmap entry!\n");
+     fprintf(state->auditFile, "Error reading coverage blockmap entry!\n");
+     return SCALPEL_ERROR_FATAL_READ;
+   }
+
+   if (state->coveragecompact) {
+     addCoverageRun(state, &(state->coverageupdates), &(state->coveragenumupdates),
+		    &(state->coverageupdatestorage), first, last - first + 1, 1);
+     return SCALPEL_OK;
+   }
+
+   if (state->coveragemap) {
+     // first entry in file is block size
+     for (k = first; k <= last; k++) {
+       state->coveragemap[k + 1]++;
+     }
+     return SCALPEL_OK;
+   }
 
-   if (state->updateCoverageBlockmap) {
+   entries = (unsigned int *)malloc(COVERAGE_IO_ENTRIES * sizeof(unsigned int));
+   checkMemoryAllocation(state, entries, __LINE__, __FILE__, "entries");
+   for (k = first; k <= last; k += count) {
+     count = last - k + 1;
+     if (count > COVERAGE_IO_ENTRIES) {
+       count = COVERAGE_IO_ENTRIES;
+     }
      // first entry in file is block size, so seek one unsigned int further
-     fseeko(state->coverageblockmap, (block+1) * sizeof(unsigned int), SEEK_SET);
-     if (fread(&entry, sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
+     fseeko(state->coverageblockmap, (k + 1) * sizeof(unsigned int), SEEK_SET);
+     if (fread(entries, sizeof(unsigned int), count, state->coverageblockmap) != count) {
        fprintf(stderr,"Error reading coverage blockmap entry!\n");
        fprintf(state->auditFile, "Error reading coverage blockmap entry!\n");
+       free(entries);
        return SCALPEL_ERROR_FATAL_READ;
      }
-     entry++;
-     // first entry in file is block size, so seek one unsigned int further 
-     fseeko(state->coverageblockmap, (block+1) * sizeof(unsigned int), SEEK_SET);
-     if (fwrite(&entry, sizeof(unsigned int), 1, state->coverageblockmap) != 1) {
+     for (i = 0; i < count; i++) {
+       entries[i]++;
+     }
+     fseeko(state->coverageblockmap, (k + 1) * sizeof(unsigned int), SEEK_SET);
+     if (fwrite(entries, sizeof(unsigned int), count, state->coverageblockmap) != count) {
        fprintf(stderr,"Error writing to coverage blockmap file!\n");
        fprintf(state->auditFile, "Error writing to coverage blockmap file!\n");
+       free(entries);
        return SCALPEL_ERROR_FILE_WRITE;
      }
    }
+   free(entries);
    
    return SCALPEL_OK;
  }
+
+
+ // mmap the coverage blockmap file for updates.  If it can't be
+ // mapped, coveragemap stays NULL and updates use stdio.
+ static void mapCoverageBlockmap(struct scalpelState *state) {
+
+#ifndef __WIN32
+   unsigned long long size = (state->coveragenumblocks + 1) * sizeof(unsigned int);
+   struct stat info;
+   void *map;
+
+   if (state->coveragenumblocks == 0 || size > (size_t)-1 ||
+       fflush(state->coverageblockmap) ||
+       fstat(fileno(state->coverageblockmap), &info) ||
+       (unsigned long long)info.st_size < size) {
+     return;
+   }
+
+   map = mmap(NULL, (size_t)size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	      fileno(state->coverageblockmap), 0);
+   if (map != MAP_FAILED) {
+     state->coveragemap = (unsigned int *)map;
+     state->coveragemapsize = (size_t)size;
+     if (state->modeVerbose) {
+       fprintf(stdout, "Coverage blockmap is memory mapped for updates.\n");
+     }
+   }
+#endif
+ }
  
  
  
+ // coverage blockmap filename for the current image file
+ static void coverageMapName(struct scalpelState *state, char *fn) {
+
+   snprintf(fn,MAX_STRING_LENGTH,"%s/%s.map",
+	    state->coveragedirectory,
+	    base_name(state->imagefile));
+ }
+
+
+ // read the header of coverage blockmap file 'f' into 'header'.
+ // Returns TRUE for a compact blockmap, FALSE for a legacy one (only
+ // the block size is filled in) or -1 if the header can't be read.
+ static int readCoverageHeader(FILE *f, struct CoverageMapHeader *header) {
+
+   size_t bytesread;
+   unsigned int blocksize;
+
+   memset(header, 0, sizeof(struct CoverageMapHeader));
+   bytesread = fread(header, 1, sizeof(struct CoverageMapHeader), f);
+   if (bytesread == sizeof(struct CoverageMapHeader) &&
+       memcmp(header->magic, COVERAGE_MAP_MAGIC, sizeof(header->magic)) == 0) {
+     return TRUE;
+   }
+   else if (bytesread < sizeof(unsigned int)) {
+     return -1;
+   }
+
+   // legacy blockmaps start with the block size
+   memcpy(&blocksize, header, sizeof(unsigned int));
+   memset(header, 0, sizeof(struct CoverageMapHeader));
+   header->blocksize = blocksize;
+   return FALSE;
+ }
+
+
+ // read the runs of a compact coverage blockmap, which must be in
+ // order and inside the image
+ static int readCoverageRuns(struct scalpelState *state, FILE *f,
+			     struct CoverageMapHeader *header) {
+
+   unsigned long long i, end = 0;
+   struct CoverageRun *run;
+
+   if (header->numruns > state->coveragenumblocks) {
+     return SCALPEL_ERROR_FATAL_READ;
+   }
+   state->coveragenumruns = header->numruns;
+   state->coverageruns = (struct CoverageRun *)
+     malloc((header->numruns + 1) * sizeof(struct CoverageRun));
+   checkMemoryAllocation(state, state->coverageruns, __LINE__, __FILE__, "coverageruns");
+   if (fread(state->coverageruns, sizeof(struct CoverageRun), header->numruns, f) !=
+       header->numruns) {
+     return SCALPEL_ERROR_FATAL_READ;
+   }
+
+   for (i = 0; i < header->numruns; i++) {
+     run = &(state->coverageruns[i]);
+     if (run->start < end || run->start >= state->coveragenumblocks ||
+	 run->length == 0 || run->count == 0 ||
+	 run->length > state->coveragenumblocks - run->start) {
+       return SCALPEL_ERROR_FATAL_READ;
+     }
+     end = run->start + run->length;
+   }
+
+   return SCALPEL_OK;
+ }
+
+
+ // append a run to a growing array of runs
+ static void addCoverageRun(struct scalpelState *state, struct CoverageRun **runs,
+			    unsigned long long *numruns, unsigned long long *storage,
+			    unsigned long long start, unsigned long long length,
+			    unsigned long long count) {
+
+   if (*numruns == *storage) {
+     *storage = *storage ? *storage * 2 : 1024;
+     *runs = (struct CoverageRun *)realloc(*runs, *storage * sizeof(struct CoverageRun));
+     checkMemoryAllocation(state, *runs, __LINE__, __FILE__, "coverage runs");
+   }
+   (*runs)[*numruns].start = start;
+   (*runs)[*numruns].length = length;
+   (*runs)[*numruns].count = count;
+   (*numruns)++;
+ }
+
+
+ // the count covering blocks changes by 'delta' at 'block'
+ typedef struct CoverageEvent {
+   unsigned long long block;
+   long long delta;
+ } CoverageEvent;
+
+ static int compareCoverageEvents(const void *a, const void *b) {
+
+   const struct CoverageEvent *x = (const struct CoverageEvent *)a;
+   const struct CoverageEvent *y = (const struct CoverageEvent *)b;
+
+   return x->block < y->block ? -1 : (x->block > y->block ? 1 : 0);
+ }
+
+
+ // merge the runs of carved files' blocks into the runs of a compact
+ // blockmap.  Each run becomes a +count and a -count event; sweeping
+ // the sorted events gives the new runs, with adjacent blocks that
+ // have the same count joined.
+ static void mergeCoverageUpdates(struct scalpelState *state) {
+
+   unsigned long long numevents, i, e, start = 0, numruns = 0, storage = 0;
+   struct CoverageEvent *events;
+   struct CoverageRun *runs = 0, *run;
+   long long count = 0, previous;
+
+   numevents = 2 * (state->coveragenumruns + state->coveragenumupdates);
+   events = (struct CoverageEvent *)malloc((numevents + 1) * sizeof(struct CoverageEvent));
+   checkMemoryAllocation(state, events, __LINE__, __FILE__, "coverage events");
+
+   e = 0;
+   for (i = 0; i < state->coveragenumruns + state->coveragenumupdates; i++) {
+     run = i < state->coveragenumruns ? &(state->coverageruns[i]) :
+       &(state->coverageupdates[i - state->coveragenumruns]);
+     events[e].block = run->start;
+     events[e++].delta = run->count;
+     events[e].block = run->start + run->length;
+     events[e++].delta = -(long long)run->count;
+   }
+   qsort(events, numevents, sizeof(struct CoverageEvent), compareCoverageEvents);
+
+   for (i = 0; i < numevents; ) {
+     previous = count;
+     e = events[i].block;
+     while (i < numevents && events[i].block == e) {
+       count += events[i++].delta;
+     }
+     if (count != previous) {
+       if (previous > 0) {
+	 addCoverageRun(state, &runs, &numruns, &storage, start, e - start, previous);
+       }
+       start = e;
+     }
+   }
+
+   free(events);
+   free(state->coverageruns);
+   free(state->coverageupdates);
+   state->coverageruns = runs;
+   state->coveragenumruns = numruns;
+   state->coverageupdates = 0;
+   state->coveragenumupdates = 0;
+   state->coverageupdatestorage = 0;
+ }
+
+
+ // write a compact coverage blockmap.  The blockmap is written to a
+ // new file which then replaces 'fn', so an error doesn't destroy an
+ // existing blockmap.
+ static int writeCoverageRuns(char *fn, unsigned int blocksize,
+			      unsigned long long numblocks,
+			      struct CoverageRun *runs, unsigned long long numruns) {
+
+   char tempname[MAX_STRING_LENGTH];
+   struct CoverageMapHeader header;
+   FILE *f;
+   int err = 0;
+
+   memset(&header, 0, sizeof(struct CoverageMapHeader));
+   memcpy(header.magic, COVERAGE_MAP_MAGIC, sizeof(header.magic));
+   header.version = COVERAGE_MAP_VERSION;
+   header.blocksize = blocksize;
+   header.numblocks = numblocks;
+   header.numruns = numruns;
+
+   snprintf(tempname, MAX_STRING_LENGTH, "%s.new", fn);
+   if ((f = fopen(tempname, "wb")) == NULL) {
+     return SCALPEL_ERROR_FILE_WRITE;
+   }
+#ifdef __WIN32
+   // set binary mode for Win32
+   setmode(fileno(f),O_BINARY);
+#endif
+
+   if (fwrite(&header, sizeof(struct CoverageMapHeader), 1, f) != 1 ||
+       (numruns > 0 && fwrite(runs, sizeof(struct CoverageRun), numruns, f) != numruns)) {
+     err = 1;
+   }
+   if (fclose(f) || err) {
+     remove(tempname);
+     return SCALPEL_ERROR_FILE_WRITE;
+   }
+
+#ifdef __WIN32
+   // rename() won't replace an existing file on Win32
+   remove(fn);
+#endif
+   if (rename(tempname, fn)) {
+     remove(tempname);
+     return SCALPEL_ERROR_FILE_WRITE;
+   }
+
+   return SCALPEL_OK;
+ }
+
+
+ // write a compact coverage blockmap that was updated while carving.
+ // Legacy blockmaps are updated in place.
+ static int saveCoverageBlockmap(struct scalpelState *state) {
+
+   char fn[MAX_STRING_LENGTH];
+
+   if (! state->updateCoverageBlockmap || ! state->coveragecompact) {
+     return SCALPEL_OK;
+   }
+
+   mergeCoverageUpdates(state);
+   coverageMapName(state, fn);
+   if (writeCoverageRuns(fn, state->coverageblocksize, state->coveragenumblocks,
+			 state->coverageruns, state->coveragenumruns) != SCALPEL_OK) {
+     fprintf(stderr,"Error writing to coverage blockmap file: %s\n", fn);
+     fprintf(state->auditFile, "Error writing to coverage blockmap file: %s\n", fn);
+     return SCALPEL_ERROR_FILE_WRITE;
+   }
+
+   if (state->modeVerbose) {
+#ifdef __WIN32
+     fprintf(stdout, "Wrote coverage blockmap with %I64u runs of covered blocks.\n",
+	     state->coveragenumruns);
+#else
+     fprintf(stdout, "Wrote coverage blockmap with %llu runs of covered blocks.\n",
+	     state->coveragenumruns);
+#endif
+   }
+
+   return SCALPEL_OK;
+ }
+
+
+ // set the coverage bitmap bits for 'count' blocks from 'first', a
+ // word at a time
+ static void markCovered(struct scalpelState *state, unsigned long long first,
+			 unsigned long long count) {
+
+   unsigned long long end = first + count, bits;
+
+   while (first < end) {
+     bits = end - first < 64 - first % 64 ? end - first : 64 - first % 64;
+     state->coveragebitmap[first / 64] |=
+       (bits == 64 ? ~0ULL : ((1ULL << bits) - 1)) << (first % 64);
+     first += bits;
+   }
+ }
+
+
+ // convert the legacy coverage blockmap file 'fn' (-U) to the compact
+ // format
+ int convertCoverageBlockmap(struct scalpelState *state, char *fn) {
+
+   struct CoverageMapHeader header;
+   struct CoverageRun *runs = 0, *last;
+   unsigned long long numruns = 0, storage = 0, numblocks = 0, k, count;
+   unsigned int *entries;
+   FILE *f;
+   int err;
+
+   if ((f = fopen(fn, "rb")) == NULL) {
+     fprintf(stderr, "Couldn't open coverage blockmap file: %s -- %s\n",
+	     fn, strerror(errno));
+     return SCALPEL_ERROR_FILE_OPEN;
+   }
+#ifdef __WIN32
+   // set binary mode for Win32
+   setmode(fileno(f),O_BINARY);
+#endif
+
+   if ((err = readCoverageHeader(f, &header)) < 0) {
+     fprintf(stderr,"Error reading coverage blockmap blocksize in\ncoverage blockmap file: %s\n",
+	     fn);
+     fclose(f);
+     return SCALPEL_ERROR_FATAL_READ;
+   }
+   else if (err) {
+     fprintf(stdout, "Coverage blockmap %s is already in the compact format.\n", fn);
+     fclose(f);
+     return SCALPEL_OK;
+   }
+
+   entries = (unsigned int *)malloc(COVERAGE_IO_ENTRIES * sizeof(unsigned int));
+   checkMemoryAllocation(state, entries, __LINE__, __FILE__, "entries");
+   fseeko(f, sizeof(unsigned int), SEEK_SET);
+   while ((count = fread(entries, sizeof(unsigned int), COVERAGE_IO_ENTRIES, f)) > 0) {
+     for (k = 0; k < count; k++, numblocks++) {
+       if (! entries[k]) {
+	 continue;
+       }
+       last = numruns ? &(runs[numruns - 1]) : 0;
+       if (last && last->start + last->length == numblocks && last->count == entries[k]) {
+	 last->length++;
+       }
+       else {
+	 addCoverageRun(state, &runs, &numruns, &storage, numblocks, 1, entries[k]);
+       }
+     }
+   }
+   free(entries);
+   err = ferror(f);
+   fclose(f);
+   if (err) {
+     fprintf(stderr, "Error reading coverage blockmap entry: %s\n", fn);
+     free(runs);
+     return SCALPEL_ERROR_FATAL_READ;
+   }
+
+   if (writeCoverageRuns(fn, header.blocksize, numblocks, runs, numruns) != SCALPEL_OK) {
+     fprintf(stderr, "Error writing to coverage blockmap file: %s\n", fn);
+     free(runs);
+     return SCALPEL_ERROR_FILE_WRITE;
+   }
+
+#ifdef __WIN32
+   fprintf(stdout, "Converted coverage blockmap %s: %I64u blocks, %I64u runs of covered blocks.\n",
+	   fn, numblocks, numruns);
+#else
+   fprintf(stdout, "Converted coverage blockmap %s: %llu blocks, %llu runs of covered blocks.\n",
+	   fn, numblocks, numruns);
+#endif
+   free(runs);
+
+   return SCALPEL_OK;
+ }
+
+
  static void destroyCoverageMaps(struct scalpelState *state) {
    
    // free memory associated with coverage bitmap, close coverage blockmap file
    
    if (state->coveragebitmap) {
      free(state->coveragebitmap);
+     free(state->coveragerank);
+     free(state->coverageextents);
+     free(state->coveragediscard);
+   }
+   
+#ifndef __WIN32
+   if (state->coveragemap) {
+     munmap(state->coveragemap, state->coveragemapsize);
+     state->coveragemap = 0;
    }
+#endif
+
+   free(state->coverageruns);
+   free(state->coverageupdates);
+   state->coverageruns = 0;
+   state->coverageupdates = 0;
    
-   if (state->useCoverageBlockmap || state->updateCoverageBlockmap) {
+   if (state->coverageblockmap) {
      fclose(state->coverageblockmap);
    }
  }
@@ -1734,52 +3754,12 @@ static unsigned long long positionUseCoverageBlockmap(struct scalpelState *state
  // blocks are silently skipped when seeking if the coverage blockmap
  // is used, otherwise an fseeko() with an umodified offset is
  // performed.
-static int fseeko_use_coverage_map(struct scalpelState *state, FILE *fp, off64_t offset) {
-
-  off64_t currentpos;
-  unsigned long long curblock, bytestoskip, bytestokeep, totalbytes = 0;
-  int sign;
+int fseeko_use_coverage_map(struct scalpelState *state, FILE *fp, off64_t offset) {
 
   if (state->useCoverageBlockmap) {
-    currentpos = ftello(fp);
-    sign = (offset > 0 ? 1 : -1);
-
-     curblock = currentpos / state->coverageblocksize;
-     
-     while (totalbytes < (offset > 0 ? offset : offset * -1) && 
-	    curblock < state->coveragenumblocks && curblock >= 0) {
-       bytestoskip = 0;
-
-       // covered blocks increase offset
-       while (curblock < state->coveragenumblocks &&
-	      curblock >= 0 &&
-	      (state->coveragebitmap[curblock / 8] & (1 << (curblock % 8)))) {
-
-	 bytestoskip += (state->coverageblocksize - 
-			 currentpos % state->coverageblocksize);
-	 curblock += sign;
-       }
-       
-       offset += (bytestoskip * sign);
-       currentpos += (bytestoskip * sign);
-
-       bytestokeep = 0;
-
-       // uncovered blocks don't increase offset
-       while (curblock < state->coveragenumblocks && 
-	      curblock >= 0 &&
-	      ((state->coveragebitmap[curblock / 8] & (1 << (curblock % 8))) == 0) &&
-	      totalbytes < (offset > 0 ? offset : offset * -1)) {
-	 
-	 bytestokeep += (state->coverageblocksize - 
-			currentpos % state->coverageblocksize);
-	 
-	 curblock += sign;
-       }
-
-       totalbytes += bytestokeep;
-       currentpos += (bytestokeep * sign);
-     }
+    // translate to the logical image, seek there, and translate back
+    return fseeko(fp, positionUseCoverageBlockmap(state, logicalPosition(state, ftello(fp)) + offset),
+		  SEEK_SET);
   }
 
   return fseeko(fp, offset, SEEK_CUR);
@@ -1792,31 +3772,16 @@ static int fseeko_use_coverage_map(struct scalpelState *state, FILE *fp, off64_t
 // marked blocks, IF the coverage blockmap is being used.  If a
 // coverage blockmap isn't in use, just performs a standard ftello()
 // call.
-//
-// GGRIII:  *** This could use optimization, e.g., use of a pre-computed
-// table to avoid walking the coverage bitmap on each call.
  
-static off64_t ftello_use_coverage_map(struct scalpelState *state, FILE *fp) {
+off64_t ftello_use_coverage_map(struct scalpelState *state, FILE *fp) {
    
   off64_t currentpos, decrease = 0;
-  unsigned long long endblock, k;
 
   currentpos=ftello(fp);  
 
   if (state->useCoverageBlockmap) {
-    endblock = currentpos / state->coverageblocksize;
-    
     // covered blocks don't contribute to current file position
-    for (k = 0; k <= endblock; k++) {
-      if (state->coveragebitmap[k / 8] & (1 << (k % 8))) {
-	decrease += state->coverageblocksize;
-      }
-    }
-
-    if (state->coveragebitmap[endblock / 8] & (1 << (endblock % 8))) {
-      decrease += (state->coverageblocksize - 
-		   currentpos % state->coverageblocksize);
-    }
+    decrease = currentpos - logicalPosition(state, currentpos);
     
     if (state->modeVerbose && state->useCoverageBlockmap) {
 #ifdef __WIN32
@@ -1835,12 +3800,15 @@ static off64_t ftello_use_coverage_map(struct scalpelState *state, FILE *fp) {
  // simple wrapper for fread() that uses the coverage bitmap--the read silently
  // skips blocks that are marked covered (corresponding bit in coverage
  // bitmap is 1)
-static size_t fread_use_coverage_map(struct scalpelState *state, void *ptr, 
+size_t fread_use_coverage_map(struct scalpelState *state, void *ptr, 
 			      size_t size, size_t nmemb, FILE *stream) {  
 
-  unsigned long long curblock, neededbytes = nmemb * size, bytestoskip, 
-    bytestoread, bytesread, totalbytesread = 0, curpos;
-  int shortread;
+  unsigned long long neededbytes = nmemb * size, totalbytesread = 0,
+    logical, physical, e, skip, length, wanted, end, gap;
+  struct CoverageExtent *extents = state->coverageextents;
+  struct iovec iov[COVERAGE_MAX_IOVECS];
+  long long bytesread;
+  int numiov, i, numextents;
 
 
    if (state->useCoverageBlockmap) {
@@ -1852,73 +3820,77 @@ static size_t fread_use_coverage_map(struct scalpelState *state, void *ptr,
 #endif
      }
      
-     curpos = ftello(stream);
-     curblock = curpos / state->coverageblocksize;
-     shortread = 0;
+     logical = logicalPosition(state, ftello(stream));
+     e = findExtent(state, logical);
      
-     while (totalbytesread < neededbytes && curblock < state->coveragenumblocks && ! shortread) {
-       bytestoread = 0;
-       bytestoskip = 0;
-
-       // skip covered blocks
-       while (curblock < state->coveragenumblocks && 
-	      (state->coveragebitmap[curblock / 8] & (1 << (curblock % 8)))) {
-	 bytestoskip += (state->coverageblocksize - 
-			 curpos % state->coverageblocksize);
-	 curblock++;
-       }
-       
-       curpos += bytestoskip;
-
+     while (totalbytesread < neededbytes && e < state->coveragenumextents) {
+
+       // gather uncovered extents, and the short covered gaps between
+       // them, for a single read
+       skip = logical - extents[e].logical;
+       physical = end = extents[e].physical + skip;
+       numiov = 0;
+       numextents = 0;
+       wanted = 0;
+       while (e < state->coveragenumextents && totalbytesread + wanted < neededbytes &&
+	      numiov + 2 <= COVERAGE_MAX_IOVECS) {
+	 if (numiov > 0) {
+	   gap = extents[e].physical - end;
+	   if (gap > COVERAGE_MAX_GAP) {
+	     break;
+	   }
+	   iov[numiov].iov_base = state->coveragediscard;
+	   iov[numiov++].iov_len = gap;
+	 }
 
-       if (state->modeVerbose) {
-#ifdef __WIN32
-	 fprintf(stdout, "fread using coverage map to skip %I64u bytes.\n", bytestoskip);
-#else
-	 fprintf(stdout, "fread using coverage map to skip %llu bytes.\n", bytestoskip);
-#endif
+	 length = extents[e].length - skip;
+	 if (length > neededbytes - totalbytesread - wanted) {
+	   length = neededbytes - totalbytesread - wanted;
+	 }
+	 iov[numiov].iov_base = (char *)ptr + totalbytesread + wanted;
+	 iov[numiov++].iov_len = length;
+	 numextents++;
+	 wanted += length;
+	 logical += length;
+	 end = extents[e].physical + skip + length;
+	 if (skip + length < extents[e].length) {
+	   break;
+	 }
+	 skip = 0;
+	 e++;
        }
-       
-       fseeko(stream, (off64_t)bytestoskip, SEEK_CUR);
-       
-       // accumulate uncovered blocks for read
-       while (curblock < state->coveragenumblocks && 
-	      ((state->coveragebitmap[curblock / 8] & (1 << (curblock % 8))) == 0) &&
-	      totalbytesread + bytestoread <= neededbytes) {
-
-	 bytestoread += (state->coverageblocksize - 
-			 curpos % state->coverageblocksize);
-	 
-	 curblock++;
+
+       if ((bytesread = readExtents(stream, iov, numiov, physical)) < 0) {
+	 fprintf(stderr, "Error reading image file: %s\n", strerror(errno));
+	 break;
        }
 
-       // cap read size
-       if (totalbytesread + bytestoread > neededbytes) {
-	 bytestoread = neededbytes - totalbytesread;
+       // only the bytes read into uncovered extents count
+       for (i = 0; i < numiov && bytesread > 0; i++) {
+	 length = (unsigned long long)bytesread < iov[i].iov_len ?
+	   (unsigned long long)bytesread : iov[i].iov_len;
+	 if (iov[i].iov_base != state->coveragediscard) {
+	   totalbytesread += length;
+	 }
+	 bytesread -= length;
+	 physical += length;
        }
 
+       fseeko(stream, (off64_t)physical, SEEK_SET);
 
        if (state->modeVerbose) {
 #ifdef __WIN32
-	 fprintf(stdout, "fread using coverage map found %I64u consecutive bytes.\n", bytestoread);
+	 fprintf(stdout, "fread using coverage map found %I64u bytes in %d extents.\n",
+		 wanted, numextents);
 #else
-	 fprintf(stdout, "fread using coverage map found %llu consecutive bytes.\n", bytestoread);
+	 fprintf(stdout, "fread using coverage map found %llu bytes in %d extents.\n",
+		 wanted, numextents);
 #endif
        }
 
-       if ((bytesread = fread((char *)ptr+totalbytesread, 1, (size_t)bytestoread, stream)) < bytestoread) {
-	 shortread = 1;
-       }
-
-       totalbytesread += bytesread;
-       curpos += bytestoread;
-
-       if (state->modeVerbose) {
-#ifdef __WIN32
-	 fprintf(stdout, "fread using coverage map read %I64u bytes.\n", bytesread);
-#else
-	 fprintf(stdout, "fread using coverage map read %llu bytes.\n", bytesread);
-#endif
+       if (physical < end) {
+	 // short read, end of image file
+	 break;
        }
      }
 
@@ -23,6 +23,9 @@
 // Thanks to Kris Kendall, Jesse Kornblum, et al for their work on
 // foremost.
 
+// for sync_file_range()
+#define _GNU_SOURCE
+
 #include "scalpel.h"
 
 // Returns TRUE if the directory exists and is empty. 
@@ -88,14 +91,17 @@ int outputDirectoryOK(char *dir) {
     char* timestring = ctime(&now);
     char fn[MAX_STRING_LENGTH];
     
-    if (!outputDirectoryOK(state->outputdirectory)) {
+    // a resumed run (-R) continues in the interrupted run's output
+    // directory, appending to its audit file
+    if (!state->resumeFromCheckpoints &&
+	!outputDirectoryOK(state->outputdirectory)) {
       return SCALPEL_ERROR_FILE_OPEN;
     }
     
     snprintf(fn,MAX_STRING_LENGTH,"%s/audit.txt",
 	     state->outputdirectory);
     
-    if (!(state->auditFile = fopen(fn,"w"))) {    
+    if (!(state->auditFile = fopen(fn,state->resumeFromCheckpoints ? "a" : "w"))) {    
       fprintf(stderr,"Couldn't open %s -- %s\n",fn,strerror(errno));
       return SCALPEL_ERROR_FILE_OPEN;
     }
@@ -127,6 +133,27 @@ int closeFile(FILE* f) {
 }
 
 
+// with -D, evict a carved file that is about to be closed from the
+// page cache.  POSIX_FADV_DONTNEED skips dirty pages and pages still
+// under writeback, so the file is written out and waited for first.
+void dropFromPageCache(int fd) {
+
+#if !defined(__WIN32) && defined(POSIX_FADV_DONTNEED)
+#ifdef SYNC_FILE_RANGE_WRITE
+  if (sync_file_range(fd, 0, 0, SYNC_FILE_RANGE_WAIT_BEFORE |
+		      SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER)) {
+    return;
+  }
+#else
+  if (fdatasync(fd)) {
+    return;
+  }
+#endif
+  posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+#endif
+}
+
+
 // helper function for measureOpenFile(), based on e2fsprogs utility
 // function valid_offset()
 
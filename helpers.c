@@ -26,6 +26,18 @@
 
 #include "scalpel.h"
 
+#ifdef SCALPEL_SIMD_X86
+#include <immintrin.h>
+#endif
+
+#ifdef __LINUX
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+// a last level cache miss reads one line from memory
+#define TRAFFIC_LINE_SIZE    64
+
 
 void checkMemoryAllocation(struct scalpelState *state, void *ptr, int line,
 			   char *file, char *structure) {
@@ -116,14 +128,73 @@ int memwildcardcmp(const void *s1, const void *s2,
   return 0;
 }
 
+// how much a needle character narrows a search.  Zeros and 0xFF fill
+// large stretches of most disk images, and spaces and lowercase
+// letters are everywhere in text, so anchors made of them produce
+// many false candidates.
+static int characterRarity(unsigned char c) {
+
+  if (c == 0x00 || c == 0xFF) {
+    return 1;
+  }
+  if (c == ' ' || islower(c)) {
+    return 2;
+  }
+  return 3;
+}
+
+
+// find the "anchor" of a needle: the run of non-wildcard characters
+// that is searched for, after which the rest of the needle (including
+// any wildcards) is verified around each hit.  Longer runs of rarer
+// characters are preferred; the first run wins ties.  'anchorlength'
+// is 0 if the needle is nothing but wildcards.
+void findNeedleAnchor(char *needle, size_t len, size_t *anchor,
+		      size_t *anchorlength) {
+
+  size_t i, runstart = 0, runlength = 0;
+  int score = 0, bestscore = 0;
+
+  *anchor = 0;
+  *anchorlength = 0;
+  for (i = 0; i < len; i++) {
+    if (needle[i] == wildcard) {
+      runlength = 0;
+      score = 0;
+    }
+    else {
+      if (runlength == 0) {
+	runstart = i;
+      }
+      runlength++;
+      score += characterRarity((unsigned char)needle[i]);
+      if (score > bestscore) {
+	bestscore = score;
+	*anchor = runstart;
+	*anchorlength = runlength;
+      }
+    }
+  }
+}
+
+
 // initialize Boyer-Moore "jump table" for search. Dependence
 // on search type (e.g., FORWARD, REVERSE, etc.) from Foremost
 // has been removed, because Scalpel always performs searches across
-// a buffer in a forward direction.
+// a buffer in a forward direction.  A wildcard limits every shift in
+// the table to its distance from the end of the needle, so only the
+// needle's anchor (see findNeedleAnchor()) goes into the table, and
+// its position is returned in 'anchor' and 'anchorlength'.
+
 void init_bm_table(char *needle, size_t table[UCHAR_MAX + 1],
-		   size_t len, int casesensitive) {
+		   size_t len, int casesensitive,
+		   size_t *anchor, size_t *anchorlength) {
+
+  size_t i = 0,currentindex = 0;
 
-  size_t i = 0,j = 0,currentindex = 0;
+  findNeedleAnchor(needle, len, anchor, anchorlength);
+  needle += *anchor;
+  len = *anchorlength;
 
   for (i = 0; i <= UCHAR_MAX; i++) {
     table[i] = len;
@@ -131,12 +202,6 @@ void init_bm_table(char *needle, size_t table[UCHAR_MAX + 1],
 
   for (i = 0; i < len; i++) {
     currentindex = len-i-1; //Count from the back of string
-    //No skip entry can advance us past the last wildcard in the string
-    if (needle[i] == wildcard) {
-      for (j=0; j<= UCHAR_MAX; j++) {
-	table[j] = currentindex;
-      }
-    }
     table[(unsigned char)needle[i]] = currentindex;
     if (! casesensitive && needle[i] > 0) {
       table[tolower(needle[i])] = currentindex;
@@ -145,30 +210,441 @@ void init_bm_table(char *needle, size_t table[UCHAR_MAX + 1],
   }
 }
 
+// Vectorized candidate search.  Rather than stepping through the
+// haystack one table lookup at a time, the SSE2 and AVX2 kernels
+// compare two "probe" characters of the needle--chosen for rarity,
+// see findProbePositions()--against 32 (SSE2) or 64 (AVX2) consecutive
+// haystack positions at once.  Only positions where both probes match
+// are verified with memwildcardcmp().  This is much faster than
+// Boyer-Moore for short needles, whose maximum shift is tiny, and for
+// needles with wildcards, which collapse the shift table.  The kernel
+// is chosen at run time, so the same binary runs on CPUs without AVX2.
+
+#ifdef SCALPEL_SIMD_X86
+
+#define SIMD_LEVEL_UNKNOWN     -1
+#define SIMD_LEVEL_NONE         0
+#define SIMD_LEVEL_SSE2         1
+#define SIMD_LEVEL_AVX2         2
+
+static int simdlevel = SIMD_LEVEL_UNKNOWN;
+
+static int selectSimdLevel(void) {
+
+  if (simdlevel == SIMD_LEVEL_UNKNOWN) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      simdlevel = SIMD_LEVEL_AVX2;
+    }
+    else if (__builtin_cpu_supports("sse2")) {
+      simdlevel = SIMD_LEVEL_SSE2;
+    }
+    else {
+      simdlevel = SIMD_LEVEL_NONE;
+    }
+  }
+  return simdlevel;
+}
+
+
+// choose the two needle characters the kernels compare: the rarest
+// non-wildcard character (see characterRarity()) and the rarest of
+// the others, preferring the one furthest from the first.  'first'
+// precedes 'last' in the needle.  Returns FALSE if the needle is
+// nothing but wildcards.
+static int findProbePositions(char *needle, size_t needle_len,
+			      size_t *first, size_t *last) {
+
+  size_t i, a = needle_len, b = needle_len, distance, bestdistance = 0;
+  int rarity, best = 0;
+
+  for (i = 0; i < needle_len; i++) {
+    if (needle[i] != wildcard &&
+	(rarity = characterRarity((unsigned char)needle[i])) > best) {
+      best = rarity;
+      a = i;
+    }
+  }
+  if (a == needle_len) {
+    return FALSE;
+  }
+
+  best = 0;
+  for (i = 0; i < needle_len; i++) {
+    if (needle[i] == wildcard || i == a) {
+      continue;
+    }
+    rarity = characterRarity((unsigned char)needle[i]);
+    distance = i > a ? i - a : a - i;
+    if (rarity > best || (rarity == best && distance > bestdistance)) {
+      best = rarity;
+      bestdistance = distance;
+      b = i;
+    }
+  }
+  if (b == needle_len) {
+    // only one non-wildcard character
+    b = a;
+  }
+
+  *first = a < b ? a : b;
+  *last = a < b ? b : a;
+  return TRUE;
+}
+
+
+// both cases of a probe character match if the search is
+// case-insensitive, consistent with charactersMatch()
+static void probeCases(char c, int casesensitive, char *c1, char *c2) {
+
+  *c1 = *c2 = c;
+  if (! casesensitive && c > 0) {
+    *c1 = tolower(c);
+    *c2 = toupper(c);
+  }
+}
+
+
+// check candidates from 'start' onward one at a time.  Used for the
+// end of the haystack, which is too short for a full vector.
+static char *scalarProbeSearch(char *needle, size_t needle_len,
+			       char *haystack, size_t haystack_len,
+			       int casesensitive, size_t start,
+			       size_t first, size_t last) {
+
+  char f1, f2, l1, l2, c;
+  size_t s;
+
+  probeCases(needle[first], casesensitive, &f1, &f2);
+  probeCases(needle[last], casesensitive, &l1, &l2);
+
+  for (s = start; s + needle_len <= haystack_len; s++) {
+    c = haystack[s + first];
+    if (c != f1 && c != f2) {
+      continue;
+    }
+    c = haystack[s + last];
+    if (c != l1 && c != l2) {
+      continue;
+    }
+    if (memwildcardcmp(needle, haystack + s, needle_len, casesensitive) == 0) {
+      return haystack + s;
+    }
+  }
+  return NULL;
+}
+
+
+__attribute__((target("sse2")))
+static char *sse2ProbeSearch(char *needle, size_t needle_len,
+			     char *haystack, size_t haystack_len,
+			     int casesensitive, size_t start,
+			     size_t first, size_t last) {
+
+  char f1, f2, l1, l2;
+  __m128i vf1, vf2, vl1, vl2, a, b;
+  unsigned int mask;
+  size_t s = start, candidate;
+
+  probeCases(needle[first], casesensitive, &f1, &f2);
+  probeCases(needle[last], casesensitive, &l1, &l2);
+  vf1 = _mm_set1_epi8(f1);
+  vf2 = _mm_set1_epi8(f2);
+  vl1 = _mm_set1_epi8(l1);
+  vl2 = _mm_set1_epi8(l2);
+
+  // 'last' is the furthest probe, so each vector load stays inside
+  // the haystack
+  while (s + last + 32 <= haystack_len) {
+    a = _mm_loadu_si128((__m128i *)(haystack + s + first));
+    b = _mm_loadu_si128((__m128i *)(haystack + s + last));
+    mask = _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, vf1),
+							_mm_cmpeq_epi8(a, vf2)),
+					   _mm_or_si128(_mm_cmpeq_epi8(b, vl1),
+							_mm_cmpeq_epi8(b, vl2))));
+    a = _mm_loadu_si128((__m128i *)(haystack + s + first + 16));
+    b = _mm_loadu_si128((__m128i *)(haystack + s + last + 16));
+    mask |= (unsigned int)
+      _mm_movemask_epi8(_mm_and_si128(_mm_or_si128(_mm_cmpeq_epi8(a, vf1),
+						   _mm_cmpeq_epi8(a, vf2)),
+				      _mm_or_si128(_mm_cmpeq_epi8(b, vl1),
+						   _mm_cmpeq_epi8(b, vl2)))) << 16;
+    while (mask) {
+      candidate = s + __builtin_ctz(mask);
+      if (candidate + needle_len <= haystack_len &&
+	  memwildcardcmp(needle, haystack + candidate, needle_len, casesensitive) == 0) {
+	return haystack + candidate;
+      }
+      mask &= mask - 1;
+    }
+    s += 32;
+  }
+
+  return scalarProbeSearch(needle, needle_len, haystack, haystack_len,
+			   casesensitive, s, first, last);
+}
+
+
+__attribute__((target("avx2")))
+static char *avx2ProbeSearch(char *needle, size_t needle_len,
+			     char *haystack, size_t haystack_len,
+			     int casesensitive, size_t start,
+			     size_t first, size_t last) {
+
+  char f1, f2, l1, l2;
+  __m256i vf1, vf2, vl1, vl2, a, b;
+  unsigned long long mask;
+  size_t s = start, candidate;
+
+  probeCases(needle[first], casesensitive, &f1, &f2);
+  probeCases(needle[last], casesensitive, &l1, &l2);
+  vf1 = _mm256_set1_epi8(f1);
+  vf2 = _mm256_set1_epi8(f2);
+  vl1 = _mm256_set1_epi8(l1);
+  vl2 = _mm256_set1_epi8(l2);
+
+  while (s + last + 64 <= haystack_len) {
+    a = _mm256_loadu_si256((__m256i *)(haystack + s + first));
+    b = _mm256_loadu_si256((__m256i *)(haystack + s + last));
+    mask = (unsigned int)
+      _mm256_movemask_epi8(_mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, vf1),
+							    _mm256_cmpeq_epi8(a, vf2)),
+					    _mm256_or_si256(_mm256_cmpeq_epi8(b, vl1),
+							    _mm256_cmpeq_epi8(b, vl2))));
+    a = _mm256_loadu_si256((__m256i *)(haystack + s + first + 32));
+    b = _mm256_loadu_si256((__m256i *)(haystack + s + last + 32));
+    mask |= (unsigned long long)(unsigned int)
+      _mm256_movemask_epi8(_mm256_and_si256(_mm256_or_si256(_mm256_cmpeq_epi8(a, vf1),
+							    _mm256_cmpeq_epi8(a, vf2)),
+					    _mm256_or_si256(_mm256_cmpeq_epi8(b, vl1),
+							    _mm256_cmpeq_epi8(b, vl2)))) << 32;
+    while (mask) {
+      candidate = s + __builtin_ctzll(mask);
+      if (candidate + needle_len <= haystack_len &&
+	  memwildcardcmp(needle, haystack + candidate, needle_len, casesensitive) == 0) {
+	return haystack + candidate;
+      }
+      mask &= mask - 1;
+    }
+    s += 64;
+  }
+
+  return scalarProbeSearch(needle, needle_len, haystack, haystack_len,
+			   casesensitive, s, first, last);
+}
+
+
+
+// constant fill check for constantFillByte(), 64 bytes per step.
+// Most sectors that aren't constant differ within the first step.
+__attribute__((target("sse2")))
+static int sse2ConstantFill(char *buf, size_t len) {
+
+  __m128i c = _mm_set1_epi8(buf[0]), a;
+  size_t s;
+  int i;
+
+  for (s = 0; s + 64 <= len; s += 64) {
+    a = _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + s)), c);
+    for (i = 16; i < 64; i += 16) {
+      a = _mm_and_si128(a, _mm_cmpeq_epi8(_mm_loadu_si128((__m128i *)(buf + s + i)), c));
+    }
+    if (_mm_movemask_epi8(a) != 0xFFFF) {
+      return FALSE;
+    }
+  }
+  for (; s < len; s++) {
+    if (buf[s] != buf[0]) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+
+__attribute__((target("avx2")))
+static int avx2ConstantFill(char *buf, size_t len) {
+
+  __m256i c = _mm256_set1_epi8(buf[0]), a;
+  size_t s;
+
+  for (s = 0; s + 64 <= len; s += 64) {
+    a = _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(buf + s)), c),
+			 _mm256_cmpeq_epi8(_mm256_loadu_si256((__m256i *)(buf + s + 32)), c));
+    if ((unsigned int)_mm256_movemask_epi8(a) != 0xFFFFFFFF) {
+      return FALSE;
+    }
+  }
+  for (; s < len; s++) {
+    if (buf[s] != buf[0]) {
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+#endif  /* ifdef SCALPEL_SIMD_X86 */
+
+
+// if every byte of buf[0..len) has the same value--a zeroed or
+// 0xFF-filled sector, say--return that value, otherwise -1.
+int constantFillByte(char *buf, size_t len) {
+
+  int constant;
+
+  if (len == 0) {
+    return -1;
+  }
+#ifdef SCALPEL_SIMD_X86
+  switch (selectSimdLevel()) {
+  case SIMD_LEVEL_AVX2:
+    constant = avx2ConstantFill(buf, len);
+    break;
+  case SIMD_LEVEL_SSE2:
+    constant = sse2ConstantFill(buf, len);
+    break;
+  default:
+    constant = memcmp(buf, buf + 1, len - 1) == 0;
+  }
+#else
+  // each byte equals the next one
+  constant = memcmp(buf, buf + 1, len - 1) == 0;
+#endif
+  return constant ? (unsigned char)buf[0] : -1;
+}
+
+
+// number of haystack positions examined per step by the vectorized
+// search kernel this CPU will use, or 0 if there is none
+int vectorSearchWidth(void) {
+
+#ifdef SCALPEL_SIMD_X86
+  switch (selectSimdLevel()) {
+  case SIMD_LEVEL_AVX2:
+    return 64;
+  case SIMD_LEVEL_SSE2:
+    return 32;
+  }
+#endif
+  return 0;
+}
+
+
+// open a hardware performance counter of last level cache read misses
+// for the calling thread, in user space only.  Returns -1 if there is
+// no such counter (not Linux, no PMU, e.g. in many virtual machines, or
+// not permitted by perf_event_paranoid).
+int openTrafficCounter(void) {
+
+#ifdef __LINUX
+  struct perf_event_attr attr;
+  int counter;
+
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_LL |
+    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  if ((counter = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0)) < 0) {
+    // some PMUs only have the generic event
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    counter = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+  }
+  return counter < 0 ? -1 : counter;
+#else
+  return -1;
+#endif
+}
+
+
+// bytes read from memory by the calling thread since 'counter' was
+// opened, or -1 if unknown
+long long readTrafficCounter(int counter) {
+
+  unsigned long long misses;
+
+  if (counter < 0 ||
+      read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+    return -1;
+  }
+  return (long long)(misses * TRAFFIC_LINE_SIZE);
+}
+
+
+void closeTrafficCounter(int counter) {
+
+  if (counter >= 0) {
+    close(counter);
+  }
+}
+
+
 // Perform a modified Boyer-Moore string search, supporting wildcards,
 // case-insensitive searches, and specifiable start locations in the buffer.
 // Dependence on search type (e.g., FORWARD, REVERSe, etc.) from Foremost has
 // been removed, because Scalpel always performs forward searching.
+// 'start_pos' is the position of the last character of the first
+// candidate match.  The Boyer-Moore loop looks for the needle's anchor
+// with the table built by init_bm_table() and then verifies the whole
+// needle around it.  If the CPU supports it, one of the vectorized
+// kernels above is used instead of the Boyer-Moore loop.
 
 char *bm_needleinhaystack_skipnchars(char *needle, size_t needle_len,
 				     char *haystack, size_t haystack_len,
 				     size_t table[UCHAR_MAX + 1],
+				     size_t anchor, size_t anchorlength,
 				     int casesensitive,
 				     int start_pos) {
   register size_t shift = 0;
-  register size_t pos = start_pos;
+  register size_t pos;
+  size_t start = start_pos - (needle_len - 1), limit;
   char *here;
+#ifdef SCALPEL_SIMD_X86
+  size_t first, last;
+#endif
 
   if(needle_len == 0) {
     return haystack;
   }
 
-  while (pos < haystack_len){
-    while( pos < haystack_len && (shift = table[(unsigned char)haystack[pos]]) > 0) {
+  // a needle of nothing but wildcards matches wherever it fits
+  if (anchorlength == 0) {
+    return start + needle_len <= haystack_len ? haystack + start : NULL;
+  }
+
+#ifdef SCALPEL_SIMD_X86
+  if (selectSimdLevel() != SIMD_LEVEL_NONE &&
+      findProbePositions(needle, needle_len, &first, &last)) {
+    if (simdlevel == SIMD_LEVEL_AVX2) {
+      return avx2ProbeSearch(needle, needle_len, haystack, haystack_len,
+			     casesensitive, start, first, last);
+    }
+    else {
+      return sse2ProbeSearch(needle, needle_len, haystack, haystack_len,
+			     casesensitive, start, first, last);
+    }
+  }
+#endif
+
+  if (needle_len > haystack_len) {
+    return NULL;
+  }
+
+  // 'pos' is the position of the last character of the anchor; the
+  // part of the needle after the anchor must also fit
+  pos = start + anchor + anchorlength - 1;
+  limit = haystack_len - (needle_len - anchor - anchorlength);
+
+  while (pos < limit){
+    while( pos < limit && (shift = table[(unsigned char)haystack[pos]]) > 0) {
       pos += shift;
     }
     if (0 == shift) {
-      if (0 == memwildcardcmp(needle,here = (char *)&haystack[pos-needle_len+1], needle_len, casesensitive)) {
+      if (0 == memwildcardcmp(needle,here = (char *)&haystack[pos-anchorlength+1-anchor], needle_len, casesensitive)) {
 	return(here);
       }
       else {
@@ -179,16 +655,19 @@ char *bm_needleinhaystack_skipnchars(char *needle, size_t needle_len,
   return NULL;
 }
 
-
 char *bm_needleinhaystack(char *needle, size_t needle_len,
                           char *haystack, size_t haystack_len,
-                          size_t table[UCHAR_MAX + 1], int casesensitive) {
+                          size_t table[UCHAR_MAX + 1],
+			  size_t anchor, size_t anchorlength,
+			  int casesensitive) {
 
   return bm_needleinhaystack_skipnchars(needle,
 					needle_len,
 					haystack,
 					haystack_len,
 					table,
+					anchor,
+					anchorlength,
 					casesensitive,
 					needle_len - 1);
 }
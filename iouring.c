@@ -0,0 +1,514 @@
+// Scalpel Copyright (C) 2005-6 by Golden G. Richard III.
+// Written by Golden G. Richard III.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+
+// io_uring engine for writing carved files in pass 2 (Linux only,
+// build with "make linux-uring").  A buffer with tens of thousands of
+// small carves used to cost a blocking fwrite() per carve.  Instead,
+// each write becomes a pwritev request in the submission queue, and
+// the queue is handed to the kernel in batches with a single
+// io_uring_enter() call.
+//
+// Writes are tagged with the number of the image buffer ("window")
+// whose data they write.  The caller keeps the buffer until
+// waitIoRing() says all writes for its window are done, so the
+// writes for window N can still be in flight while window N+1 is
+// processed.  Carved files are closed once their writes have been
+// submitted (the kernel holds its own reference to the file), and
+// their names, which are needed for error messages, are freed once
+// their writes have completed.  With -D, that is also when a carved
+// file is reopened by name and dropped from the page cache: dropping
+// it any earlier would leave the pages that are still being written.
+//
+// Writes use IORING_OP_WRITEV rather than IORING_OP_WRITE, which
+// needs Linux 5.6, so that every kernel that can set up a ring (5.1
+// and later) can also carry out the writes.
+//
+// The ring is set up with raw system calls, so liburing isn't needed.
+// If the kernel doesn't support io_uring, or Scalpel was built
+// without it, startIoRing() returns NULL and carveImageFile() uses
+// stdio.
+
+#include "scalpel.h"
+
+#ifdef SCALPEL_IO_URING
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+
+// submission queue entries; the completion queue is twice as long
+#define IO_RING_ENTRIES        256
+
+// carved files whose writes haven't been submitted yet
+#define IO_RING_MAX_CLOSES     64
+
+typedef struct IoRequest {
+  struct iovec iov;                 // read by the kernel until completion
+  char *filename;                   // for error messages
+  unsigned long long length;
+  unsigned long long window;
+  int next;                         // next free request, or -1
+} IoRequest;
+
+typedef struct IoRetired {
+  char *filename;
+  unsigned long long window;
+} IoRetired;
+
+typedef struct IoRing {
+  struct scalpelState *state;
+  int fd;
+
+  // submission queue
+  unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+  struct io_uring_sqe *sqes;
+  unsigned sqentries;
+  unsigned queued;                  // entries not yet submitted
+
+  // completion queue
+  unsigned *cqhead, *cqtail, *cqmask;
+  struct io_uring_cqe *cqes;
+
+  void *sqring, *cqring;
+  size_t sqringsize, cqringsize, sqessize;
+
+  // one request per completion queue entry, so the completion queue
+  // can't overflow
+  struct IoRequest *requests;
+  int freerequest;
+  unsigned long long inflight[2];   // requests in flight, by window parity
+
+  FILE *closes[IO_RING_MAX_CLOSES]; // closed once submitted
+  int numcloses;
+
+  struct IoRetired *retired;        // filenames freed once their
+  unsigned long long numretired;    // window's writes are done
+  unsigned long long retiredstorage;
+
+  int error;                        // SCALPEL_OK or first error
+} IoRing;
+
+
+static int ioRingEnter(struct IoRing *ring, unsigned tosubmit,
+		       unsigned mincomplete) {
+
+  int ret;
+
+  do {
+    ret = syscall(__NR_io_uring_enter, ring->fd, tosubmit, mincomplete,
+		  mincomplete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (ret < 0 && errno == EINTR);
+
+  return ret;
+}
+
+
+// hand queued requests to the kernel, then close the carved files
+// whose writes are now all submitted
+static int submitQueued(struct IoRing *ring) {
+
+  int ret, i, err = SCALPEL_OK;
+
+  while (ring->queued > 0) {
+    if ((ret = ioRingEnter(ring, ring->queued, 0)) <= 0) {
+      fprintf(stderr, "ERROR: io_uring submission failed -- %s\n",
+	      strerror(ret < 0 ? errno : EAGAIN));
+      err = SCALPEL_ERROR_FILE_WRITE;
+      break;
+    }
+    ring->queued -= ret;
+  }
+
+  for (i = 0; i < ring->numcloses; i++) {
+    if (fclose(ring->closes[i])) {
+      fprintf(stderr, "Error closing carved file -- %s\n\n", strerror(errno));
+      fprintf(ring->state->auditFile, "Error closing carved file -- %s\n\n",
+	      strerror(errno));
+      ring->error = SCALPEL_ERROR_FILE_WRITE;
+    }
+  }
+  ring->numcloses = 0;
+
+  return err;
+}
+
+
+// -D: drop carved file 'filename', whose writes have all completed,
+// from the page cache
+static void dropCarvedFile(char *filename) {
+
+  int fd;
+
+  if ((fd = open(filename, O_RDONLY)) >= 0) {
+    dropFromPageCache(fd);
+    close(fd);
+  }
+}
+
+
+// process all available completions.  If 'wait' is set and none are
+// available, wait for at least one.
+static int reapCompletions(struct IoRing *ring, int wait) {
+
+  struct io_uring_cqe *cqe;
+  struct IoRequest *request;
+  unsigned head, tail;
+  int result;
+
+  head = *(ring->cqhead);
+  tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+  if (head == tail && wait) {
+    if (ioRingEnter(ring, 0, 1) < 0) {
+      fprintf(stderr, "ERROR: io_uring wait failed -- %s\n", strerror(errno));
+      return SCALPEL_ERROR_FILE_WRITE;
+    }
+    tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+  }
+
+  while (head != tail) {
+    cqe = &(ring->cqes[head & *(ring->cqmask)]);
+    request = &(ring->requests[cqe->user_data]);
+    result = cqe->res;
+
+    if (result == -EFAULT) {
+      // the kernel couldn't read the page of a memory mapped image
+      // file that was to be written
+      ring->error = SCALPEL_ERROR_FILE_READ;
+    }
+    else if (result < 0 || (unsigned long long)result != request->length) {
+      // short writes to regular files only happen when out of space
+      fprintf(stderr, "Error writing to file: %s -- %s\n",
+	      request->filename, strerror(result < 0 ? -result : ENOSPC));
+      fprintf(ring->state->auditFile, "Error writing to file: %s -- %s\n",
+	      request->filename, strerror(result < 0 ? -result : ENOSPC));
+      ring->error = SCALPEL_ERROR_FILE_WRITE;
+    }
+
+    ring->inflight[request->window % 2]--;
+    request->next = ring->freerequest;
+    ring->freerequest = cqe->user_data;
+    head++;
+  }
+  __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+
+  return SCALPEL_OK;
+}
+
+
+// set up an io_uring instance.  Returns NULL if io_uring isn't
+// available.
+struct IoRing *startIoRing(struct scalpelState *state) {
+
+  struct io_uring_params params;
+  struct IoRing *ring;
+  unsigned i;
+
+  ring = (struct IoRing *)calloc(1, sizeof(struct IoRing));
+  checkMemoryAllocation(state, ring, __LINE__, __FILE__, "io_uring");
+  ring->state = state;
+
+  memset(&params, 0, sizeof(params));
+  if ((ring->fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params)) < 0) {
+    if (state->modeVerbose) {
+      fprintf(stdout, "io_uring isn't available (%s); using stdio.\n",
+	      strerror(errno));
+    }
+    free(ring);
+    return NULL;
+  }
+
+  ring->sqringsize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqringsize = params.cq_off.cqes +
+    params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cqringsize > ring->sqringsize) {
+      ring->sqringsize = ring->cqringsize;
+    }
+    ring->cqringsize = ring->sqringsize;
+  }
+  ring->sqessize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+  ring->sqring = mmap(NULL, ring->sqringsize, PROT_READ | PROT_WRITE,
+		      MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cqring = ring->sqring;
+  }
+  else {
+    ring->cqring = mmap(NULL, ring->cqringsize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+  }
+  ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE,
+		    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqring == MAP_FAILED || ring->cqring == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Couldn't map io_uring queues -- %s\n",
+	    strerror(errno));
+    fprintf(stderr, "Using stdio instead.\n");
+    if (ring->sqring != MAP_FAILED) {
+      munmap(ring->sqring, ring->sqringsize);
+    }
+    if (ring->cqring != MAP_FAILED && ring->cqring != ring->sqring) {
+      munmap(ring->cqring, ring->cqringsize);
+    }
+    if (ring->sqes != MAP_FAILED) {
+      munmap(ring->sqes, ring->sqessize);
+    }
+    close(ring->fd);
+    free(ring);
+    return NULL;
+  }
+
+  ring->sqhead = (unsigned *)((char *)ring->sqring + params.sq_off.head);
+  ring->sqtail = (unsigned *)((char *)ring->sqring + params.sq_off.tail);
+  ring->sqmask = (unsigned *)((char *)ring->sqring + params.sq_off.ring_mask);
+  ring->sqarray = (unsigned *)((char *)ring->sqring + params.sq_off.array);
+  ring->sqentries = params.sq_entries;
+  ring->cqhead = (unsigned *)((char *)ring->cqring + params.cq_off.head);
+  ring->cqtail = (unsigned *)((char *)ring->cqring + params.cq_off.tail);
+  ring->cqmask = (unsigned *)((char *)ring->cqring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cqring + params.cq_off.cqes);
+
+  ring->requests = (struct IoRequest *)malloc(params.cq_entries *
+					      sizeof(struct IoRequest));
+  checkMemoryAllocation(state, ring->requests, __LINE__, __FILE__, "io_uring");
+  for (i = 0; i < params.cq_entries; i++) {
+    ring->requests[i].next = (i + 1 < params.cq_entries ? i + 1 : -1);
+  }
+  ring->freerequest = 0;
+  ring->error = SCALPEL_OK;
+
+  if (state->modeVerbose) {
+    fprintf(stdout, "Writing carved files with io_uring.\n");
+  }
+
+  return ring;
+}
+
+
+// open a carved file for writing with io_uring.  Writes are at
+// explicit offsets and may complete in any order, so unlike the stdio
+// path, the file can't be opened for appending.  'truncate' is set
+// when a carve is first opened, so that the stale tail of a longer
+// file that was already there doesn't survive.
+FILE *openIoFile(char *filename, int truncate) {
+
+  FILE *fp;
+  int fd;
+
+  if ((fd = open(filename, O_WRONLY | O_CREAT | (truncate ? O_TRUNC : 0),
+		 0666)) < 0) {
+    return NULL;
+  }
+  if ((fp = fdopen(fd, "wb")) == NULL) {
+    close(fd);
+  }
+
+  return fp;
+}
+
+
+// queue a write of 'length' bytes from 'buffer' at 'offset' in the
+// carved file 'fp'.  'buffer' must stay valid until waitIoRing() for
+// 'window' returns.
+int queueIoWrite(struct IoRing *ring, FILE *fp, char *buffer,
+		 unsigned long long length, unsigned long long offset,
+		 unsigned long long window, char *filename) {
+
+  struct io_uring_sqe *sqe;
+  struct IoRequest *request;
+  unsigned tail;
+  int err, index;
+
+  // a free request means a free completion queue entry
+  while (ring->freerequest < 0) {
+    if ((err = submitQueued(ring)) != SCALPEL_OK ||
+	(err = reapCompletions(ring, TRUE)) != SCALPEL_OK) {
+      return err;
+    }
+  }
+  if (ring->queued == ring->sqentries &&
+      (err = submitQueued(ring)) != SCALPEL_OK) {
+    return err;
+  }
+
+  index = ring->freerequest;
+  request = &(ring->requests[index]);
+  ring->freerequest = request->next;
+  request->filename = filename;
+  request->length = length;
+  request->window = window;
+  request->iov.iov_base = buffer;
+  request->iov.iov_len = length;
+  ring->inflight[window % 2]++;
+
+  tail = *(ring->sqtail);
+  sqe = &(ring->sqes[tail & *(ring->sqmask)]);
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = IORING_OP_WRITEV;
+  sqe->fd = fileno(fp);
+  sqe->addr = (unsigned long)&(request->iov);
+  sqe->len = 1;
+  sqe->off = offset;
+  sqe->user_data = index;
+  ring->sqarray[tail & *(ring->sqmask)] = tail & *(ring->sqmask);
+  __atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+
+  return ring->error;
+}
+
+
+// close carved file 'fp' once its queued writes have been submitted
+int closeAfterIo(struct IoRing *ring, FILE *fp) {
+
+  int err;
+
+  if (ring->numcloses == IO_RING_MAX_CLOSES &&
+      (err = submitQueued(ring)) != SCALPEL_OK) {
+    return err;
+  }
+  ring->closes[ring->numcloses++] = fp;
+
+  return ring->error;
+}
+
+
+// free 'filename' once all writes for 'window' have completed
+void freeAfterIo(struct IoRing *ring, char *filename,
+		 unsigned long long window) {
+
+  if (ring->numretired == ring->retiredstorage) {
+    ring->retiredstorage = ring->retiredstorage ? ring->retiredstorage * 2 : 1024;
+    ring->retired = (struct IoRetired *)realloc(ring->retired,
+						ring->retiredstorage *
+						sizeof(struct IoRetired));
+    checkMemoryAllocation(ring->state, ring->retired, __LINE__, __FILE__,
+			  "io_uring");
+  }
+  ring->retired[ring->numretired].filename = filename;
+  ring->retired[ring->numretired].window = window;
+  ring->numretired++;
+}
+
+
+// submit everything queued, then wait until all writes for 'window'
+// have completed.  Writes for earlier windows must already have been
+// waited for, so that at most two windows have writes in flight.
+// Returns SCALPEL_OK or the first error seen since the ring was
+// started.
+int waitIoRing(struct IoRing *ring, unsigned long long window) {
+
+  unsigned long long i, kept = 0;
+  int err;
+
+  if ((err = submitQueued(ring)) != SCALPEL_OK) {
+    return err;
+  }
+  while (ring->inflight[window % 2] > 0) {
+    if ((err = reapCompletions(ring, TRUE)) != SCALPEL_OK) {
+      return err;
+    }
+  }
+
+  for (i = 0; i < ring->numretired; i++) {
+    if (ring->retired[i].window <= window) {
+      if (ring->state->bypassPageCache) {
+	dropCarvedFile(ring->retired[i].filename);
+      }
+      free(ring->retired[i].filename);
+    }
+    else {
+      ring->retired[kept++] = ring->retired[i];
+    }
+  }
+  ring->numretired = kept;
+
+  return ring->error;
+}
+
+
+// wait for all writes, then tear down the ring
+int stopIoRing(struct IoRing *ring) {
+
+  unsigned long long i;
+  int err;
+
+  if ((err = submitQueued(ring)) == SCALPEL_OK) {
+    while (ring->inflight[0] + ring->inflight[1] > 0 &&
+	   (err = reapCompletions(ring, TRUE)) == SCALPEL_OK) {
+    }
+  }
+  if (err == SCALPEL_OK) {
+    err = ring->error;
+  }
+
+  for (i = 0; i < ring->numretired; i++) {
+    if (err == SCALPEL_OK && ring->state->bypassPageCache) {
+      dropCarvedFile(ring->retired[i].filename);
+    }
+    free(ring->retired[i].filename);
+  }
+  free(ring->retired);
+  free(ring->requests);
+  munmap(ring->sqes, ring->sqessize);
+  if (ring->cqring != ring->sqring) {
+    munmap(ring->cqring, ring->cqringsize);
+  }
+  munmap(ring->sqring, ring->sqringsize);
+  close(ring->fd);
+  free(ring);
+
+  return err;
+}
+
+#else
+
+// built without io_uring support: carveImageFile() always uses stdio
+
+struct IoRing *startIoRing(struct scalpelState *state) {
+  return NULL;
+}
+
+FILE *openIoFile(char *filename, int truncate) {
+  return NULL;
+}
+
+int queueIoWrite(struct IoRing *ring, FILE *fp, char *buffer,
+		 unsigned long long length, unsigned long long offset,
+		 unsigned long long window, char *filename) {
+  return SCALPEL_ERROR_FILE_WRITE;
+}
+
+int closeAfterIo(struct IoRing *ring, FILE *fp) {
+  return SCALPEL_ERROR_FILE_WRITE;
+}
+
+void freeAfterIo(struct IoRing *ring, char *filename,
+		 unsigned long long window) {
+}
+
+int waitIoRing(struct IoRing *ring, unsigned long long window) {
+  return SCALPEL_OK;
+}
+
+int stopIoRing(struct IoRing *ring) {
+  return SCALPEL_OK;
+}
+
+#endif  /* ifdef SCALPEL_IO_URING */
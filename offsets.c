@@ -0,0 +1,783 @@
+// Scalpel Copyright (C) 2005-6 by Golden G. Richard III.
+// Written by Golden G. Richard III.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+
+// Storage for the header/footer offsets found in pass 1.  A needle
+// can match millions of times (e.g., the mpg header \x00\x00\x01\xba),
+// so offsets are kept in chunks that double in size, and chunks are
+// never moved or copied once allocated.  Chunk k holds
+// OFFSET_CHUNK_SIZE << k offsets, so the chunk holding any offset is
+// found with a single bit scan, and no more than half of the storage
+// is ever unused.
+//
+// With -z, offsets are compressed instead.  Pass 1 produces them in
+// nearly ascending order (matches in the overlap between buffers are
+// found twice, so an offset may be a little smaller than the one
+// before it), so each is stored as the zigzag-coded difference from
+// its predecessor, in a variable number of bytes, 7 bits per byte.
+// Every OFFSET_BLOCK_SIZE offsets, a block starts with an absolute
+// offset, and the position of each block is kept in an uncompressed
+// list, so decoding can start at any block.  Offsets are decoded
+// sequentially, remembering where the last one was found, which suits
+// the way carveImageFile() and writeHeaderFooterDatabase() walk them.
+// Dense matches take about 1-2 bytes per offset instead of 8.
+//
+// With -M, the offsets held in memory by all of the lists together
+// are kept within a budget.  When storing an offset would exceed it,
+// every list moves the offsets it holds to the end of a temporary
+// file in the output directory, as a run of 8 byte offsets, and
+// starts over in memory.  All lists share the one file, so spilling
+// doesn't use up file handles needed for carving.  Since pass 1
+// appends offsets in image order, one list's runs follow each other
+// through the image, so merging them is just reading them back to
+// back; each list reads its runs through a small window, which
+// follows the mostly forward walk of carveImageFile().  The windows
+// don't count against the budget, since spilling can't shrink them.
+// Only the offsets are bounded: the OffsetIndex summaries and the
+// carve list built from the offsets in pass 2 aren't.
+
+#include "scalpel.h"
+
+// # of offsets in the first chunk
+#define OFFSET_CHUNK_SIZE      1024
+
+// compressed storage: # of bytes in the first chunk, # of offsets per
+// block, and the most bytes a block can take
+#define OFFSET_BYTE_CHUNK_SIZE (64 * KILOBYTE)
+#define OFFSET_BLOCK_SIZE      128
+#define MAX_OFFSET_BLOCK_BYTES (OFFSET_BLOCK_SIZE * 10)
+
+// block positions in compressed storage: chunk in the top bits, byte
+// within the chunk in the rest
+#define OFFSET_POSITION_SHIFT  56
+
+// # of offsets read from or written to a spill file at a time
+#define OFFSET_SPILL_WINDOW    2048
+
+
+// find the chunk holding the offset with index 'index', and the
+// offset's index within that chunk
+static int chunkOf(unsigned long long index, unsigned long long *within) {
+
+  unsigned long long q = index / OFFSET_CHUNK_SIZE + 1;
+  int k;
+
+#if defined(__GNUC__) || defined(__clang__)
+  k = 63 - __builtin_clzll(q);
+#else
+  for (k = 0; q >> (k + 1); k++) {
+  }
+#endif
+  *within = index - OFFSET_CHUNK_SIZE * ((1ULL << k) - 1);
+  return k;
+}
+
+
+static unsigned char *putVarint(unsigned char *p, unsigned long long value) {
+
+  while (value >= 0x80) {
+    *p++ = (unsigned char)(value | 0x80);
+    value >>= 7;
+  }
+  *p++ = (unsigned char)value;
+  return p;
+}
+
+
+static unsigned long long getVarint(unsigned char **p) {
+
+  unsigned long long value = 0;
+  int shift = 0;
+
+  while (**p & 0x80) {
+    value |= (unsigned long long)(*(*p)++ & 0x7f) << shift;
+    shift += 7;
+  }
+  value |= (unsigned long long)(*(*p)++) << shift;
+  return value;
+}
+
+
+// append 'offset' uncompressed
+static int appendPlain(struct scalpelState *state, struct OffsetList *list,
+		       unsigned long long offset, char *structure) {
+
+  unsigned long long within;
+  int k, grew = FALSE;
+
+  k = chunkOf(list->count - list->spilled, &within);
+  if (k == list->numchunks) {
+    list->chunks[k] = (unsigned long long *)
+      malloc(sizeof(unsigned long long) * (OFFSET_CHUNK_SIZE << k));
+    checkMemoryAllocation(state, list->chunks[k], __LINE__, __FILE__, structure);
+    list->numchunks++;
+    grew = TRUE;
+  }
+  list->chunks[k][within] = offset;
+  list->last = offset;
+  list->count++;
+
+  return grew;
+}
+
+
+// append 'offset' in compressed form
+static int appendCompressed(struct scalpelState *state, struct OffsetList *list,
+			    unsigned long long offset, char *structure) {
+
+  unsigned long long delta;
+  unsigned char *p;
+  int k = list->numbytechunks - 1, grew = FALSE;
+
+  if ((list->count - list->spilled) % OFFSET_BLOCK_SIZE == 0) {
+    // start a new block, in a new chunk if this one might not hold it
+    if (k < 0 ||
+	list->bytesused + MAX_OFFSET_BLOCK_BYTES > (OFFSET_BYTE_CHUNK_SIZE << k)) {
+      k++;
+      list->bytes[k] = (unsigned char *)malloc(OFFSET_BYTE_CHUNK_SIZE << k);
+      checkMemoryAllocation(state, list->bytes[k], __LINE__, __FILE__, structure);
+      list->numbytechunks++;
+      list->bytesused = 0;
+      grew = TRUE;
+    }
+    if (! list->blocks) {
+      list->blocks = (struct OffsetList *)calloc(1, sizeof(struct OffsetList));
+      checkMemoryAllocation(state, list->blocks, __LINE__, __FILE__, structure);
+    }
+    appendPlain(state, list->blocks,
+		 ((unsigned long long)k << OFFSET_POSITION_SHIFT) | list->bytesused,
+		 structure);
+    p = putVarint(list->bytes[k] + list->bytesused, offset);
+  }
+  else {
+    // zigzag: small negative differences stay small
+    delta = offset - list->last;
+    delta = (delta << 1) ^ (unsigned long long)((long long)delta >> 63);
+    p = putVarint(list->bytes[k] + list->bytesused, delta);
+  }
+  list->bytesused = p - list->bytes[k];
+
+  return grew;
+}
+
+
+// decode the compressed offset with index 'index'
+static unsigned long long compressedOffsetAt(struct OffsetList *list,
+					     unsigned long long index) {
+
+  unsigned long long block = index / OFFSET_BLOCK_SIZE, position, delta;
+
+  if (! list->cursor || list->cursorindex > index ||
+      list->cursorindex / OFFSET_BLOCK_SIZE != block) {
+    position = offsetAt(list->blocks, block);
+    list->cursor = list->bytes[position >> OFFSET_POSITION_SHIFT] +
+      (position & ((1ULL << OFFSET_POSITION_SHIFT) - 1));
+    list->cursorvalue = getVarint(&(list->cursor));
+    list->cursorindex = block * OFFSET_BLOCK_SIZE;
+  }
+  while (list->cursorindex < index) {
+    delta = getVarint(&(list->cursor));
+    list->cursorvalue += (delta >> 1) ^ (0 - (delta & 1));
+    list->cursorindex++;
+  }
+
+  return list->cursorvalue;
+}
+
+
+// # of bytes the next append to 'list' will allocate
+static unsigned long long growth(struct OffsetList *list) {
+
+  unsigned long long within, total = 0;
+  int k;
+
+  if (! list->compressed) {
+    k = chunkOf(list->count - list->spilled, &within);
+    return k == list->numchunks ?
+      sizeof(unsigned long long) * (OFFSET_CHUNK_SIZE << k) : 0;
+  }
+
+  if ((list->count - list->spilled) % OFFSET_BLOCK_SIZE == 0) {
+    k = list->numbytechunks - 1;
+    if (k < 0 ||
+	list->bytesused + MAX_OFFSET_BLOCK_BYTES > (OFFSET_BYTE_CHUNK_SIZE << k)) {
+      total += OFFSET_BYTE_CHUNK_SIZE << (k + 1);
+    }
+    if (list->blocks) {
+      total += growth(list->blocks);
+    }
+    else {
+      total += sizeof(struct OffsetList) +
+	sizeof(unsigned long long) * OFFSET_CHUNK_SIZE;
+    }
+  }
+  return total;
+}
+
+
+// # of bytes of offsets 'list' holds in memory, leaving out its
+// spill window
+static unsigned long long residentListMemory(struct OffsetList *list) {
+
+  return offsetListMemory(list) -
+    (list->spill ? sizeof(unsigned long long) * OFFSET_SPILL_WINDOW : 0);
+}
+
+
+// # of bytes of offsets held in memory by the offset lists of all
+// file types, which spilling them to disk would free
+static unsigned long long residentMemory(struct scalpelState *state) {
+
+  unsigned long long total = 0;
+  int i;
+
+  for (i = 0; state->SearchSpec[i].suffix != NULL; i++) {
+    total += residentListMemory(&(state->SearchSpec[i].offsets.headers)) +
+      residentListMemory(&(state->SearchSpec[i].offsets.footers));
+  }
+  return total;
+}
+
+
+// release the offsets 'list' holds in memory
+static void freeResident(struct OffsetList *list) {
+
+  int k;
+
+  for (k = 0; k < list->numchunks; k++) {
+    free(list->chunks[k]);
+  }
+  list->numchunks = 0;
+  for (k = 0; k < list->numbytechunks; k++) {
+    free(list->bytes[k]);
+  }
+  list->numbytechunks = 0;
+  list->bytesused = 0;
+  if (list->blocks) {
+    destroyOffsetList(list->blocks);
+    free(list->blocks);
+    list->blocks = NULL;
+  }
+  list->cursor = NULL;
+}
+
+
+// move the offsets 'list' holds in memory to the end of the spill
+// file, as a new run
+static void spillOffsetList(struct scalpelState *state, struct OffsetList *list) {
+
+  struct OffsetSpill *spill = list->spill;
+  struct OffsetSpillRun *run;
+  unsigned long long resident = list->count - list->spilled, i, j, n;
+
+  if (resident == 0) {
+    return;
+  }
+
+  if (! state->offsetSpillFile) {
+    state->offsetSpillName = (char *)malloc(MAX_STRING_LENGTH * sizeof(char));
+    checkMemoryAllocation(state, state->offsetSpillName, __LINE__, __FILE__,
+			  "offset spill");
+    snprintf(state->offsetSpillName, MAX_STRING_LENGTH, "%s/offsets.spill",
+	     state->outputdirectory);
+    if ((state->offsetSpillFile = fopen(state->offsetSpillName, "w+b")) == NULL) {
+      fprintf(stderr, "Error creating file: %s -- %s\n",
+	      state->offsetSpillName, strerror(errno));
+      handleError(state, SCALPEL_ERROR_FILE_WRITE);  // fatal
+    }
+#ifndef __WIN32
+    // the file goes away when it is closed, even if scalpel dies
+    unlink(state->offsetSpillName);
+#endif
+  }
+
+  if (! spill) {
+    spill = (struct OffsetSpill *)calloc(1, sizeof(struct OffsetSpill));
+    checkMemoryAllocation(state, spill, __LINE__, __FILE__, "offset spill");
+    spill->window = (unsigned long long *)
+      malloc(sizeof(unsigned long long) * OFFSET_SPILL_WINDOW);
+    checkMemoryAllocation(state, spill->window, __LINE__, __FILE__, "offset spill");
+    spill->state = state;
+    list->spill = spill;
+    state->offsetSpillUsers++;
+  }
+
+  if (spill->numruns == spill->runstorage) {
+    spill->runstorage = spill->runstorage ? spill->runstorage * 2 : 16;
+    spill->runs = (struct OffsetSpillRun *)
+      realloc(spill->runs, spill->runstorage * sizeof(struct OffsetSpillRun));
+    checkMemoryAllocation(state, spill->runs, __LINE__, __FILE__, "offset spill");
+  }
+  fseeko(state->offsetSpillFile, 0, SEEK_END);
+  run = &(spill->runs[spill->numruns++]);
+  run->first = list->spilled;
+  run->count = resident;
+  run->position = ftello(state->offsetSpillFile);
+
+  for (i = 0; i < resident; i += n) {
+    n = resident - i < OFFSET_SPILL_WINDOW ? resident - i : OFFSET_SPILL_WINDOW;
+    for (j = 0; j < n; j++) {
+      spill->window[j] = offsetAt(list, list->spilled + i + j);
+    }
+    if (fwrite(spill->window, sizeof(unsigned long long), n,
+	       state->offsetSpillFile) != n) {
+      fprintf(stderr, "Error writing to file: %s -- %s\n",
+	      state->offsetSpillName, strerror(errno));
+      handleError(state, SCALPEL_ERROR_FILE_WRITE);  // fatal
+    }
+  }
+  spill->windowcount = 0;
+
+  freeResident(list);
+  list->spilled = list->count;
+}
+
+
+// move the offsets of all file types to disk
+static void spillOffsets(struct scalpelState *state) {
+
+  unsigned long long before = residentMemory(state);
+  int i;
+
+  for (i = 0; state->SearchSpec[i].suffix != NULL; i++) {
+    spillOffsetList(state, &(state->SearchSpec[i].offsets.headers));
+    spillOffsetList(state, &(state->SearchSpec[i].offsets.footers));
+  }
+
+  if (state->modeVerbose) {
+#ifdef __WIN32
+    fprintf(stdout, "Memory budget reached, moved %I64u bytes of offsets to disk\n",
+	    before);
+#else
+    fprintf(stdout, "Memory budget reached, moved %llu bytes of offsets to disk\n",
+	    before);
+#endif
+  }
+}
+
+
+// read the offset with index 'index' from the spill file.  Carve
+// lists for different file types are built in parallel, so reads of
+// the shared file are serialized.
+static unsigned long long spilledOffsetAt(struct OffsetList *list,
+					  unsigned long long index) {
+
+  struct OffsetSpill *spill = list->spill;
+  struct scalpelState *state = spill->state;
+  struct OffsetSpillRun *run;
+  unsigned long long start;
+  int lo = 0, hi = spill->numruns - 1, mid;
+  size_t n;
+
+  if (index < spill->windowstart ||
+      index >= spill->windowstart + spill->windowcount) {
+    // the run holding 'index'
+    while (lo < hi) {
+      mid = (lo + hi + 1) / 2;
+      if (spill->runs[mid].first <= index) {
+	lo = mid;
+      }
+      else {
+	hi = mid - 1;
+      }
+    }
+    run = &(spill->runs[lo]);
+
+    // footer scans restart a little before where the last one went,
+    // so keep some of the offsets before 'index' in the window
+    start = index - run->first < OFFSET_SPILL_WINDOW / 4 ?
+      run->first : index - OFFSET_SPILL_WINDOW / 4;
+    n = run->first + run->count - start < OFFSET_SPILL_WINDOW ?
+      run->first + run->count - start : OFFSET_SPILL_WINDOW;
+
+    pthread_mutex_lock(&(state->offsetSpillLock));
+    if (fseeko(state->offsetSpillFile, run->position +
+	       (start - run->first) * sizeof(unsigned long long), SEEK_SET) ||
+	fread(spill->window, sizeof(unsigned long long), n,
+	      state->offsetSpillFile) != n) {
+      fprintf(stderr, "Error reading from file: %s -- %s\n",
+	      state->offsetSpillName, strerror(errno));
+      handleError(state, SCALPEL_ERROR_FATAL_READ);  // fatal
+    }
+    pthread_mutex_unlock(&(state->offsetSpillLock));
+    spill->windowstart = start;
+    spill->windowcount = n;
+  }
+
+  return spill->window[index - spill->windowstart];
+}
+
+
+void initOffsetList(struct OffsetList *list) {
+
+  memset(list, 0, sizeof(struct OffsetList));
+}
+
+
+// append 'offset' to 'list'.  Returns TRUE if more storage had to be
+// allocated.
+int appendOffset(struct scalpelState *state, struct OffsetList *list,
+		 unsigned long long offset, char *structure) {
+
+  int grew;
+
+  if (list->count == list->spilled) {
+    list->compressed = state->compressOffsets;
+  }
+
+  if (state->memoryBudget && growth(list) > 0 &&
+      residentMemory(state) + growth(list) > state->memoryBudget) {
+    spillOffsets(state);
+  }
+
+  if (! list->compressed) {
+    return appendPlain(state, list, offset, structure);
+  }
+  grew = appendCompressed(state, list, offset, structure);
+  list->last = offset;
+  list->count++;
+
+  return grew;
+}
+
+
+// the offset with index 'index', which must be less than list->count
+unsigned long long offsetAt(struct OffsetList *list, unsigned long long index) {
+
+  unsigned long long within;
+  int k;
+
+  if (index < list->spilled) {
+    return spilledOffsetAt(list, index);
+  }
+  index -= list->spilled;
+  if (list->compressed) {
+    return compressedOffsetAt(list, index);
+  }
+  k = chunkOf(index, &within);
+  return list->chunks[k][within];
+}
+
+
+// the offset appended last; 'list' must not be empty
+unsigned long long lastOffset(struct OffsetList *list) {
+
+  return list->last;
+}
+
+
+// # of bytes allocated for 'list'
+unsigned long long offsetListMemory(struct OffsetList *list) {
+
+  unsigned long long total = 0;
+  int k;
+
+  if (list->numchunks > 0) {
+    total += sizeof(unsigned long long) * OFFSET_CHUNK_SIZE *
+      ((1ULL << list->numchunks) - 1);
+  }
+  for (k = 0; k < list->numbytechunks; k++) {
+    total += OFFSET_BYTE_CHUNK_SIZE << k;
+  }
+  if (list->blocks) {
+    total += sizeof(struct OffsetList) + offsetListMemory(list->blocks);
+  }
+  if (list->spill) {
+    total += sizeof(unsigned long long) * OFFSET_SPILL_WINDOW;
+  }
+  return total;
+}
+
+
+void destroyOffsetList(struct OffsetList *list) {
+
+  struct scalpelState *state;
+
+  freeResident(list);
+  if (list->spill) {
+    state = list->spill->state;
+    free(list->spill->runs);
+    free(list->spill->window);
+    free(list->spill);
+
+    // the last list with spilled offsets closes the spill file
+    if (--state->offsetSpillUsers == 0) {
+      fclose(state->offsetSpillFile);
+#ifdef __WIN32
+      remove(state->offsetSpillName);
+#endif
+      free(state->offsetSpillName);
+      state->offsetSpillFile = NULL;
+      state->offsetSpillName = NULL;
+    }
+  }
+  initOffsetList(list);
+}
+
+
+// An OffsetIndex answers "where is the next (or previous) offset
+// above (or at most) some value" for carveImageFile(), which pairs
+// each header with footers.  Offsets are mostly but not entirely in
+// ascending order (see above), so instead of a binary search, the
+// index keeps the largest and smallest offset of each group of
+// OFFSET_INDEX_FANOUT offsets, and of each group of those groups, and
+// so on.  A search looks at the rest of the starting group, climbs
+// until a group summary says there is a match, then descends into
+// it, finding exactly the offset a scan of the list would, in
+// O(OFFSET_INDEX_FANOUT * levels) time.
+
+void buildOffsetIndex(struct scalpelState *state, struct OffsetList *list,
+		      struct OffsetIndex *index) {
+
+  unsigned long long i, g, n = list->count, value;
+  int level = 0;
+
+  memset(index, 0, sizeof(struct OffsetIndex));
+  if (n == 0) {
+    return;
+  }
+
+  do {
+    index->count[level] = (n + OFFSET_INDEX_FANOUT - 1) / OFFSET_INDEX_FANOUT;
+    index->max[level] = (unsigned long long *)
+      malloc(sizeof(unsigned long long) * index->count[level]);
+    checkMemoryAllocation(state, index->max[level], __LINE__, __FILE__, "offset index");
+    index->min[level] = (unsigned long long *)
+      malloc(sizeof(unsigned long long) * index->count[level]);
+    checkMemoryAllocation(state, index->min[level], __LINE__, __FILE__, "offset index");
+
+    for (i = 0; i < n; i++) {
+      g = i / OFFSET_INDEX_FANOUT;
+      if (level == 0) {
+	value = offsetAt(list, i);
+	if (i % OFFSET_INDEX_FANOUT == 0 || value > index->max[0][g]) {
+	  index->max[0][g] = value;
+	}
+	if (i % OFFSET_INDEX_FANOUT == 0 || value < index->min[0][g]) {
+	  index->min[0][g] = value;
+	}
+      }
+      else {
+	if (i % OFFSET_INDEX_FANOUT == 0 ||
+	    index->max[level-1][i] > index->max[level][g]) {
+	  index->max[level][g] = index->max[level-1][i];
+	}
+	if (i % OFFSET_INDEX_FANOUT == 0 ||
+	    index->min[level-1][i] < index->min[level][g]) {
+	  index->min[level][g] = index->min[level-1][i];
+	}
+      }
+    }
+    n = index->count[level++];
+  } while (n > OFFSET_INDEX_FANOUT && level < MAX_OFFSET_INDEX_LEVELS);
+  index->numlevels = level;
+}
+
+
+static int offsetMatches(unsigned long long offset, unsigned long long value,
+			 int above) {
+
+  return above ? offset > value : offset <= value;
+}
+
+
+static int groupMatches(struct OffsetIndex *index, int level,
+			unsigned long long group, unsigned long long value,
+			int above) {
+
+  return above ?
+    index->max[level][group] > value : index->min[level][group] <= value;
+}
+
+
+// index of the first offset at or after 'from' that is above (or at
+// most) 'value', or list->count if there is none
+static unsigned long long searchForward(struct OffsetList *list,
+					struct OffsetIndex *index,
+					unsigned long long from,
+					unsigned long long value, int above) {
+
+  unsigned long long n = list->count, end, group, groupend, j;
+  int level;
+
+  // rest of the group holding 'from'
+  end = (from / OFFSET_INDEX_FANOUT + 1) * OFFSET_INDEX_FANOUT;
+  end = end < n ? end : n;
+  for (j = from; j < end; j++) {
+    if (offsetMatches(offsetAt(list, j), value, above)) {
+      return j;
+    }
+  }
+  if (end >= n) {
+    return n;
+  }
+
+  // climb until some group has a match
+  group = end / OFFSET_INDEX_FANOUT;
+  level = 0;
+  while (1) {
+    groupend = (group / OFFSET_INDEX_FANOUT + 1) * OFFSET_INDEX_FANOUT;
+    if (level == index->numlevels - 1 || groupend > index->count[level]) {
+      groupend = index->count[level];
+    }
+    for (; group < groupend; group++) {
+      if (groupMatches(index, level, group, value, above)) {
+	break;
+      }
+    }
+    if (group < groupend) {
+      break;
+    }
+    if (group >= index->count[level]) {
+      return n;
+    }
+    group /= OFFSET_INDEX_FANOUT;
+    level++;
+  }
+
+  // descend to the first matching offset in the group
+  while (level > 0) {
+    level--;
+    group *= OFFSET_INDEX_FANOUT;
+    while (! groupMatches(index, level, group, value, above)) {
+      group++;
+    }
+  }
+  for (j = group * OFFSET_INDEX_FANOUT; 
+       ! offsetMatches(offsetAt(list, j), value, above); j++) {
+  }
+  return j;
+}
+
+
+// index of the last offset before 'before' that is above (or at most)
+// 'value', or 'before' if there is none
+static unsigned long long searchBackward(struct OffsetList *list,
+					 struct OffsetIndex *index,
+					 unsigned long long before,
+					 unsigned long long value, int above) {
+
+  unsigned long long begin, group, groupbegin, j;
+  int level;
+
+  if (before == 0) {
+    return before;
+  }
+
+  // start of the group holding 'before - 1'
+  begin = (before - 1) / OFFSET_INDEX_FANOUT * OFFSET_INDEX_FANOUT;
+  for (j = before; j > begin; ) {
+    j--;
+    if (offsetMatches(offsetAt(list, j), value, above)) {
+      return j;
+    }
+  }
+
+  // climb until some group has a match; groups before 'group' remain
+  group = begin / OFFSET_INDEX_FANOUT;
+  level = 0;
+  while (1) {
+    if (group == 0) {
+      return before;
+    }
+    groupbegin = level == index->numlevels - 1 ? 0 :
+      (group - 1) / OFFSET_INDEX_FANOUT * OFFSET_INDEX_FANOUT;
+    while (group > groupbegin) {
+      group--;
+      if (groupMatches(index, level, group, value, above)) {
+	break;
+      }
+    }
+    if (groupMatches(index, level, group, value, above)) {
+      break;
+    }
+    group /= OFFSET_INDEX_FANOUT;
+    level++;
+  }
+
+  // descend to the last matching offset in the group
+  while (level > 0) {
+    level--;
+    group = group * OFFSET_INDEX_FANOUT + OFFSET_INDEX_FANOUT - 1;
+    if (group >= index->count[level]) {
+      group = index->count[level] - 1;
+    }
+    while (! groupMatches(index, level, group, value, above)) {
+      group--;
+    }
+  }
+  j = group * OFFSET_INDEX_FANOUT + OFFSET_INDEX_FANOUT - 1;
+  if (j >= list->count) {
+    j = list->count - 1;
+  }
+  while (! offsetMatches(offsetAt(list, j), value, above)) {
+    j--;
+  }
+  return j;
+}
+
+
+// index of the first offset at or after 'from' that is above 'value',
+// or list->count if there is none
+unsigned long long firstOffsetAbove(struct OffsetList *list,
+				    struct OffsetIndex *index,
+				    unsigned long long from,
+				    unsigned long long value) {
+
+  return from >= list->count ? list->count :
+    searchForward(list, index, from, value, TRUE);
+}
+
+
+// index of the last offset from 'from' up to 'before' that is above
+// 'value', or 'before' if there is none
+unsigned long long lastOffsetAbove(struct OffsetList *list,
+				   struct OffsetIndex *index,
+				   unsigned long long from,
+				   unsigned long long before,
+				   unsigned long long value) {
+
+  unsigned long long j = searchBackward(list, index, before, value, TRUE);
+
+  return j < from ? before : j;
+}
+
+
+// index of the last offset from 'from' up to 'before' that is at most
+// 'value', or 'before' if there is none
+unsigned long long lastOffsetAtMost(struct OffsetList *list,
+				    struct OffsetIndex *index,
+				    unsigned long long from,
+				    unsigned long long before,
+				    unsigned long long value) {
+
+  unsigned long long j = searchBackward(list, index, before, value, FALSE);
+
+  return j < from ? before : j;
+}
+
+
+void destroyOffsetIndex(struct OffsetIndex *index) {
+
+  int level;
+
+  for (level = 0; level < index->numlevels; level++) {
+    free(index->max[level]);
+    free(index->min[level]);
+  }
+  memset(index, 0, sizeof(struct OffsetIndex));
+}
@@ -0,0 +1,754 @@
+// Scalpel Copyright (C) 2005-6 by Golden G. Richard III.
+// Written by Golden G. Richard III.
+//
+// This program is free software; you can redistribute it and/or
+// modify it under the terms of the GNU General Public License as
+// published by the Free Software Foundation; either version 2 of the
+// License, or (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful, but
+// WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+// General Public License for more details.
+
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA
+// 02110-1301, USA.
+
+// Asynchronous image reader.  Both passes over an image file used to
+// alternate between reading a buffer and processing it, leaving the
+// disk idle while headers and footers were searched for or carved
+// files were written.  Now a reader thread fills a ring of
+// SIZE_OF_BUFFER-sized buffers ahead of the code that processes them,
+// so reading buffer N+1 overlaps processing of buffer N.
+//
+// In pass 1 (READER_DIG), every buffer of the image is read, and the
+// last 'overlap' bytes of each buffer are copied to the start of the
+// next, so that headers and footers that straddle buffer boundaries
+// aren't missed.  The image is read strictly sequentially, never
+// re-reading the overlap.  In pass 2 (READER_CARVE), only buffers
+// for which there is carving work are read, skipping the others with
+// one big seek; in preview mode buffers are skipped, not read.
+//
+// Regular image files are memory mapped instead, unless a coverage
+// blockmap is in use.  The buffers handed out are then just windows
+// into the mapping, so no data is copied and no reader thread is
+// needed: each window after the one being handed out is passed to
+// madvise(MADV_WILLNEED), and the kernel reads it in the background.
+// Block devices, pipes, and files that can't be mapped are read with
+// stdio.  An I/O error on a mapped page, or the image file shrinking
+// while it is mapped, raises SIGBUS instead of failing a read.  The
+// SIGBUS handler puts a page of zeros in place of the one that
+// couldn't be read, so the access that faulted (in whichever thread)
+// can complete, and records the failure.  The caller checks
+// imageReadFailed() once it is done with a buffer and treats the
+// buffer as a READ_ERROR, as it would with stdio.
+//
+// With -D, the image file is read with O_DIRECT instead, so that
+// reading a large evidence drive doesn't evict everything else from
+// the page cache.  Direct reads must start and end on
+// 'directalignment' boundaries of the file and go to equally aligned
+// memory, so they are widened as needed, and buffers have room for
+// one alignment unit on either side.
+
+// for O_DIRECT
+#define _GNU_SOURCE
+
+#include "scalpel.h"
+
+#ifndef __WIN32
+#include <sys/mman.h>
+#endif
+
+#ifdef __LINUX
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#endif
+
+#if !defined(__WIN32) && defined(O_DIRECT)
+#define SCALPEL_DIRECT_IO
+#endif
+
+// mappings are aligned to this, so the kernel can use huge pages for
+// them if the file system supports it
+#define MAP_ALIGNMENT    (2 * MEGABYTE)
+
+
+// read 'length' bytes at image file position 'position' into 'dest'
+// with O_DIRECT.  The read is widened to alignment boundaries, so up
+// to one alignment unit before and after the requested bytes in
+// memory is overwritten.  Returns the number of requested bytes read,
+// or -1 on error.
+static long long readDirect(struct ImageReader *reader, char *dest,
+			    unsigned long long position,
+			    unsigned long long length) {
+
+#ifdef SCALPEL_DIRECT_IO
+  unsigned long long alignment = reader->directalignment;
+  unsigned long long delta = position % alignment;
+  long long bytesread;
+
+  do {
+    bytesread = pread(reader->directfd, dest - delta,
+		      (delta + length + alignment - 1) / alignment * alignment,
+		      position - delta);
+  } while (bytesread < 0 && errno == EINTR);
+
+  if (bytesread < 0) {
+    return -1;
+  }
+  if (bytesread <= delta) {
+    return 0;
+  }
+  return bytesread - delta < length ? bytesread - delta : length;
+#else
+  return -1;
+#endif
+}
+
+
+// read the next pass 1 buffer: the overlap saved from the previous
+// buffer, followed by new data from the image file
+static int readDigBuffer(struct ImageReader *reader, struct ReadBuffer *rb) {
+
+  struct scalpelState *state = reader->state;
+  unsigned long long bytesread, alignment;
+  long long directread;
+
+  if (reader->directfd >= 0) {
+    // place the buffer so the new data lands on an alignment boundary,
+    // then put the overlap in front of it
+    alignment = reader->directalignment;
+    rb->buffer = rb->allocation +
+      (reader->nextposition % alignment + alignment -
+       reader->carrylength % alignment) % alignment;
+    if ((directread = readDirect(reader, rb->buffer + reader->carrylength,
+				 reader->nextposition,
+				 SIZE_OF_BUFFER - reader->carrylength)) < 0) {
+      return READ_ERROR;
+    }
+    bytesread = directread;
+    memcpy(rb->buffer, reader->carry, reader->carrylength);
+  }
+  else {
+    memcpy(rb->buffer, reader->carry, reader->carrylength);
+    bytesread = fread_use_coverage_map(state, rb->buffer + reader->carrylength,
+				       1, SIZE_OF_BUFFER - reader->carrylength,
+				       reader->infile);
+  }
+
+  // the first buffer must be longer than the overlap, the others
+  // must contain something new
+  if (reader->carrylength + bytesread <= reader->overlap) {
+    return READ_EOF;
+  }
+
+  rb->length = reader->carrylength + bytesread;
+  if (reader->directfd >= 0) {
+    reader->nextposition += bytesread;
+    rb->fileposition = reader->nextposition;
+    rb->position = reader->nextposition - rb->length;
+  }
+  else {
+    if (ferror(reader->infile)) {
+      return READ_ERROR;
+    }
+    rb->fileposition = ftello(reader->infile);
+    rb->position = ftello_use_coverage_map(state, reader->infile) - rb->length;
+  }
+
+  memcpy(reader->carry, rb->buffer + rb->length - reader->overlap,
+	 reader->overlap);
+  reader->carrylength = reader->overlap;
+
+  return READ_OK;
+}
+
+
+// read the next pass 2 buffer with carving work, skipping buffers
+// without any
+static int readCarveBuffer(struct ImageReader *reader, struct ReadBuffer *rb) {
+
+  struct scalpelState *state = reader->state;
+  unsigned long long bytesread, fileposition, biglseek = 0;
+  long long directread;
+
+  if (reader->directfd >= 0) {
+    fileposition = reader->nextposition;
+  }
+  else {
+    fileposition = ftello_use_coverage_map(state, reader->infile);
+  }
+  while (! reader->wanted(reader->wantedarg, fileposition / SIZE_OF_BUFFER)) {
+    biglseek += SIZE_OF_BUFFER;
+    fileposition += SIZE_OF_BUFFER;
+    if (fileposition > reader->filesize) {
+      return READ_DONE;
+    }
+  }
+
+  if (reader->directfd >= 0) {
+    // seeking is free, and preview mode never gets here
+    rb->buffer = rb->allocation + fileposition % reader->directalignment;
+    if ((directread = readDirect(reader, rb->buffer, fileposition,
+				 SIZE_OF_BUFFER)) < 0) {
+      return READ_ERROR;
+    }
+    else if (directread == 0) {
+      return READ_EOF;
+    }
+    rb->length = directread;
+    rb->position = fileposition;
+    rb->fileposition = reader->nextposition = fileposition + directread;
+    return READ_OK;
+  }
+
+  if (biglseek) {
+    fseeko_use_coverage_map(state, reader->infile, biglseek);
+  }
+
+  if (! reader->seekonly) {
+    bytesread = fread_use_coverage_map(state, rb->buffer, 1, SIZE_OF_BUFFER,
+				       reader->infile);
+  }
+  else {
+    // in preview mode, seeks are used in the 2nd pass instead of
+    // reads.  This isn't optimal, but it's fast enough and avoids
+    // complicating the file carving code further.
+    fileposition = ftello_use_coverage_map(state, reader->infile);
+    fseeko_use_coverage_map(state, reader->infile, SIZE_OF_BUFFER);
+    bytesread = ftello_use_coverage_map(state, reader->infile) - fileposition;
+  }
+
+  if (ferror(reader->infile)) {
+    return READ_ERROR;
+  }
+  else if (bytesread == 0) {
+    // no error, but image file exhausted
+    return READ_EOF;
+  }
+
+  rb->length = bytesread;
+  rb->fileposition = ftello(reader->infile);
+  rb->position = ftello_use_coverage_map(state, reader->infile) - bytesread;
+
+  return READ_OK;
+}
+
+
+// reader thread: fill free buffers in ring order until the image file
+// is exhausted, an error occurs, or the reader is stopped.  The last
+// buffer produced always has a status other than READ_OK.
+static void *readerThread(void *arg) {
+
+  struct ImageReader *reader = (struct ImageReader *)arg;
+  struct ReadBuffer *rb;
+  int status = READ_OK;
+
+  while (status == READ_OK) {
+    pthread_mutex_lock(&(reader->lock));
+    while (! reader->shutdown &&
+	   reader->produced - reader->released >= reader->numbuffers) {
+      pthread_cond_wait(&(reader->emptied), &(reader->lock));
+    }
+    if (reader->shutdown) {
+      pthread_mutex_unlock(&(reader->lock));
+      break;
+    }
+    rb = &(reader->buffers[reader->produced % reader->numbuffers]);
+    pthread_mutex_unlock(&(reader->lock));
+
+    if (reader->mode == READER_DIG) {
+      status = readDigBuffer(reader, rb);
+    }
+    else {
+      status = readCarveBuffer(reader, rb);
+    }
+    rb->status = status;
+
+    pthread_mutex_lock(&(reader->lock));
+    reader->produced++;
+    pthread_cond_signal(&(reader->filled));
+    pthread_mutex_unlock(&(reader->lock));
+  }
+
+  return NULL;
+}
+
+
+#ifdef SCALPEL_DIRECT_IO
+
+// open the image file again with O_DIRECT, if -D was given.  Returns
+// FALSE if the image file must be read through the page cache.
+static int openDirect(struct ImageReader *reader) {
+
+  struct scalpelState *state = reader->state;
+  struct stat info;
+  unsigned long long alignment = SCALPEL_BLOCK_SIZE;
+#ifdef BLKSSZGET
+  int sectorsize;
+#endif
+
+  // preview mode doesn't read the image file in pass 2
+  if (! state->bypassPageCache || state->useCoverageBlockmap ||
+      reader->seekonly) {
+    return FALSE;
+  }
+
+  if ((reader->directfd = open(state->imagefile, O_RDONLY | O_DIRECT)) < 0 ||
+      fstat(reader->directfd, &info)) {
+    fprintf(stderr, "WARNING: Couldn't open %s for direct I/O -- %s\n"
+	    "Reading it through the page cache instead.\n",
+	    state->imagefile, strerror(errno));
+    if (reader->directfd >= 0) {
+      close(reader->directfd);
+    }
+    reader->directfd = -1;
+    return FALSE;
+  }
+
+  // block devices need their logical sector size; file systems
+  // generally accept their block size
+  if (info.st_blksize > alignment) {
+    alignment = info.st_blksize;
+  }
+#ifdef BLKSSZGET
+  if (S_ISBLK(info.st_mode) && ioctl(reader->directfd, BLKSSZGET, &sectorsize) == 0 &&
+      sectorsize > alignment) {
+    alignment = sectorsize;
+  }
+#endif
+
+  reader->directalignment = alignment;
+  reader->nextposition = ftello(reader->infile);
+
+  if (state->modeVerbose) {
+    fprintf(stdout, "Image file is read with O_DIRECT, aligned to %llu bytes.\n",
+	    alignment);
+  }
+
+  return TRUE;
+}
+
+#endif  /* ifdef SCALPEL_DIRECT_IO */
+
+
+#ifndef __WIN32
+
+// the current mapping, for the SIGBUS handler.  Only one image file is
+// mapped at a time.
+static char *volatile faultmap = NULL;
+static volatile size_t faultmapsize = 0;
+static volatile sig_atomic_t mapfaulted = FALSE;
+
+
+// SIGBUS handler: replace an unreadable page of the mapping with zeros
+// and let the access be retried.  A fault anywhere else restores the
+// default action, so the retried access kills the process as before.
+static void catchMapFault(int signum, siginfo_t *info, void *context) {
+
+  char *page;
+  size_t pagesize = sysconf(_SC_PAGESIZE);
+
+  page = (char *)((unsigned long)info->si_addr & ~((unsigned long)pagesize - 1));
+  if (faultmap && (char *)info->si_addr >= faultmap &&
+      (char *)info->si_addr < faultmap + faultmapsize &&
+      mmap(page, pagesize, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED,
+	   -1, 0) != MAP_FAILED) {
+    mapfaulted = TRUE;
+    return;
+  }
+  signal(SIGBUS, SIG_DFL);
+}
+
+
+// read one byte from every page of a window of the mapping, so that
+// any page that can't be read is replaced with zeros and recorded now
+static void touchWindow(char *window, unsigned long long length) {
+
+  unsigned long long pagesize = sysconf(_SC_PAGESIZE), i;
+  volatile char sink;
+
+  for (i = 0; i < length; i += pagesize) {
+    sink = window[i];
+  }
+  if (length > 0) {
+    sink = window[length - 1];
+  }
+  (void)sink;
+}
+
+
+// map the whole image file, if it's a regular file.  Returns FALSE if
+// the stdio reader must be used instead.
+static int mapImageFile(struct ImageReader *reader) {
+
+  static int faulthandler = FALSE;
+  struct sigaction action;
+  struct stat info;
+  size_t length, pagesize = sysconf(_SC_PAGESIZE);
+  char *reserved, *aligned, *map;
+
+  if (reader->state->useCoverageBlockmap ||
+      fstat(fileno(reader->infile), &info) ||
+      ! S_ISREG(info.st_mode) || info.st_size == 0 ||
+      (unsigned long long)info.st_size > (size_t)-1 - 2 * MAP_ALIGNMENT) {
+    return FALSE;
+  }
+  length = info.st_size;
+
+  // reserve enough address space to place the mapping on a
+  // MAP_ALIGNMENT boundary, then give back what isn't used
+  reserved = mmap(NULL, length + MAP_ALIGNMENT, PROT_NONE,
+		  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return FALSE;
+  }
+  aligned = (char *)(((unsigned long)reserved + MAP_ALIGNMENT - 1) &
+		     ~((unsigned long)MAP_ALIGNMENT - 1));
+  map = mmap(aligned, length, PROT_READ, MAP_SHARED | MAP_FIXED,
+	     fileno(reader->infile), 0);
+  if (map == MAP_FAILED) {
+    munmap(reserved, length + MAP_ALIGNMENT);
+    return FALSE;
+  }
+  if (aligned > reserved) {
+    munmap(reserved, aligned - reserved);
+  }
+  length = (length + pagesize - 1) & ~(pagesize - 1);
+  if (aligned + length < reserved + info.st_size + MAP_ALIGNMENT) {
+    munmap(aligned + length, reserved + info.st_size + MAP_ALIGNMENT -
+	   (aligned + length));
+  }
+
+  // installed once and left in place; see catchMapFault()
+  if (! faulthandler) {
+    memset(&action, 0, sizeof(action));
+    action.sa_sigaction = catchMapFault;
+    action.sa_flags = SA_SIGINFO;
+    sigemptyset(&(action.sa_mask));
+    sigaction(SIGBUS, &action, NULL);
+    faulthandler = TRUE;
+  }
+  mapfaulted = FALSE;
+  faultmapsize = info.st_size;
+  faultmap = map;
+
+  madvise(map, info.st_size, MADV_SEQUENTIAL);
+#ifdef MADV_HUGEPAGE
+  madvise(map, info.st_size, MADV_HUGEPAGE);
+#endif
+
+  reader->map = map;
+  reader->mapsize = info.st_size;
+  reader->nextposition = ftello(reader->infile);
+
+  if (reader->state->modeVerbose) {
+    fprintf(stdout, "Image file is memory mapped.\n");
+  }
+
+  return TRUE;
+}
+
+
+// ask the kernel to start reading a window of the mapping
+static void prefetchWindow(struct ImageReader *reader,
+			   unsigned long long start, unsigned long long length) {
+
+  unsigned long long pagesize = sysconf(_SC_PAGESIZE), first;
+
+  if (start >= reader->mapsize) {
+    return;
+  }
+  if (start + length > reader->mapsize) {
+    length = reader->mapsize - start;
+  }
+  first = start & ~(pagesize - 1);
+  madvise(reader->map + first, start + length - first, MADV_WILLNEED);
+}
+
+#endif  /* ifndef __WIN32 */
+
+
+// the mapped equivalent of readDigBuffer()
+static int mapDigBuffer(struct ImageReader *reader, struct ReadBuffer *rb) {
+
+  unsigned long long start, length;
+
+  // the first buffer must be longer than the overlap, the others
+  // must contain something new
+  start = reader->nextposition - reader->carrylength;
+  length = start < reader->mapsize ? reader->mapsize - start : 0;
+  if (length > SIZE_OF_BUFFER) {
+    length = SIZE_OF_BUFFER;
+  }
+  if (length <= reader->overlap) {
+    return READ_EOF;
+  }
+
+  rb->buffer = reader->map + start;
+  rb->length = length;
+  rb->position = start;
+  rb->fileposition = start + length;
+
+  reader->nextposition = start + length;
+  reader->carrylength = reader->overlap;
+
+#ifndef __WIN32
+  prefetchWindow(reader, reader->nextposition, SIZE_OF_BUFFER);
+#endif
+
+  return READ_OK;
+}
+
+
+// the mapped equivalent of readCarveBuffer()
+static int mapCarveBuffer(struct ImageReader *reader, struct ReadBuffer *rb) {
+
+  unsigned long long fileposition = reader->nextposition, length, next;
+
+  while (! reader->wanted(reader->wantedarg, fileposition / SIZE_OF_BUFFER)) {
+    fileposition += SIZE_OF_BUFFER;
+    if (fileposition > reader->filesize) {
+      return READ_DONE;
+    }
+  }
+
+  if (reader->seekonly) {
+    length = SIZE_OF_BUFFER;
+  }
+  else {
+    if (fileposition >= reader->mapsize) {
+      // no error, but image file exhausted
+      return READ_EOF;
+    }
+    length = reader->mapsize - fileposition;
+    if (length > SIZE_OF_BUFFER) {
+      length = SIZE_OF_BUFFER;
+    }
+  }
+
+  rb->buffer = reader->seekonly ? NULL : reader->map + fileposition;
+  rb->length = length;
+#ifndef __WIN32
+  // carved data is mostly copied by the kernel, which doesn't raise
+  // SIGBUS, so fault the buffer in here
+  if (rb->buffer) {
+    touchWindow(rb->buffer, length);
+  }
+#endif
+  rb->position = fileposition;
+  rb->fileposition = fileposition + length;
+
+  reader->nextposition = fileposition + length;
+
+#ifndef __WIN32
+  // prefetch the next buffer with carving work
+  if (! reader->seekonly) {
+    next = reader->nextposition;
+    while (next < reader->mapsize && next <= reader->filesize &&
+	   ! reader->wanted(reader->wantedarg, next / SIZE_OF_BUFFER)) {
+      next += SIZE_OF_BUFFER;
+    }
+    prefetchWindow(reader, next, SIZE_OF_BUFFER);
+  }
+#endif
+
+  return READ_OK;
+}
+
+
+static int startImageReader(struct scalpelState *state,
+			    struct ImageReader *reader, int numbuffers) {
+
+  int i, err, direct = FALSE;
+
+  reader->state = state;
+  reader->numbuffers = numbuffers;
+  reader->produced = 0;
+  reader->consumed = 0;
+  reader->released = 0;
+  reader->shutdown = FALSE;
+  reader->map = NULL;
+  reader->directfd = -1;
+
+  reader->buffers = (struct ReadBuffer *)calloc(numbuffers,
+						sizeof(struct ReadBuffer));
+  checkMemoryAllocation(state, reader->buffers, __LINE__, __FILE__,
+			"read buffers");
+
+#ifdef SCALPEL_DIRECT_IO
+  direct = openDirect(reader);
+#endif
+#ifndef __WIN32
+  if (! direct && mapImageFile(reader)) {
+    return SCALPEL_OK;
+  }
+#endif
+
+  for (i = 0; i < numbuffers; i++) {
+#ifdef SCALPEL_DIRECT_IO
+    if (direct) {
+      if (posix_memalign((void **)&(reader->buffers[i].allocation),
+			 reader->directalignment,
+			 SIZE_OF_BUFFER + 2 * reader->directalignment)) {
+	reader->buffers[i].allocation = NULL;
+      }
+    }
+    else
+#endif
+      reader->buffers[i].allocation = (char *)malloc(SIZE_OF_BUFFER);
+    checkMemoryAllocation(state, reader->buffers[i].allocation, __LINE__,
+			  __FILE__, "read buffers");
+    reader->buffers[i].buffer = reader->buffers[i].allocation;
+  }
+
+  pthread_mutex_init(&(reader->lock), NULL);
+  pthread_cond_init(&(reader->filled), NULL);
+  pthread_cond_init(&(reader->emptied), NULL);
+
+  // pthread_create() returns its error rather than setting errno
+  if ((err = pthread_create(&(reader->thread), NULL, readerThread, reader))) {
+    fprintf(stderr, "ERROR: Couldn't create reader thread -- %s\n",
+	    strerror(err));
+    return SCALPEL_GENERAL_ABORT;
+  }
+
+  return SCALPEL_OK;
+}
+
+
+// start reading 'infile' for pass 1, from its current position.
+// Consecutive buffers share 'overlap' bytes.  'numbuffers' (at least
+// 2) buffers rotate between the reader and the caller.
+int startDigReader(struct scalpelState *state, struct ImageReader *reader,
+		   FILE *infile, unsigned long long overlap, int numbuffers) {
+
+  reader->infile = infile;
+  reader->mode = READER_DIG;
+  reader->overlap = overlap;
+  reader->seekonly = FALSE;
+  reader->carrylength = 0;
+  reader->carry = (char *)malloc(overlap + 1);
+  checkMemoryAllocation(state, reader->carry, __LINE__, __FILE__, "read buffers");
+
+  return startImageReader(state, reader, numbuffers < 2 ? 2 : numbuffers);
+}
+
+
+// start reading 'infile' for pass 2, from its current position.  Only
+// buffers for which wanted(wantedarg, index of buffer in
+// SIZE_OF_BUFFER units) is true are read.  If 'seekonly' is set,
+// buffers are skipped instead of read.  'numbuffers' is as for
+// startDigReader().
+int startCarveReader(struct scalpelState *state, struct ImageReader *reader,
+		     FILE *infile, unsigned long long filesize,
+		     int (*wanted)(void *, unsigned long long), void *wantedarg,
+		     int seekonly, int numbuffers) {
+
+  reader->infile = infile;
+  reader->mode = READER_CARVE;
+  reader->filesize = filesize;
+  reader->wanted = wanted;
+  reader->wantedarg = wantedarg;
+  reader->seekonly = seekonly;
+  reader->carry = NULL;
+
+  return startImageReader(state, reader, numbuffers < 2 ? 2 : numbuffers);
+}
+
+
+// wait for the next buffer.  Buffers are handed out in image order
+// and must be released in the same order.  After a buffer with status
+// other than READ_OK, there are no more buffers.
+struct ReadBuffer *nextReadBuffer(struct ImageReader *reader) {
+
+  struct ReadBuffer *rb;
+
+  if (reader->map) {
+    rb = &(reader->buffers[reader->consumed % reader->numbuffers]);
+    if (reader->mode == READER_DIG) {
+      rb->status = mapDigBuffer(reader, rb);
+    }
+    else {
+      rb->status = mapCarveBuffer(reader, rb);
+    }
+    reader->consumed++;
+    return rb;
+  }
+
+  pthread_mutex_lock(&(reader->lock));
+  while (reader->consumed >= reader->produced) {
+    pthread_cond_wait(&(reader->filled), &(reader->lock));
+  }
+  rb = &(reader->buffers[reader->consumed % reader->numbuffers]);
+  reader->consumed++;
+  pthread_mutex_unlock(&(reader->lock));
+
+  return rb;
+}
+
+
+// return the oldest buffer obtained with nextReadBuffer() to the
+// reader
+void releaseReadBuffer(struct ImageReader *reader) {
+
+  if (reader->map) {
+    reader->released++;
+    return;
+  }
+
+  pthread_mutex_lock(&(reader->lock));
+  reader->released++;
+  pthread_cond_signal(&(reader->emptied));
+  pthread_mutex_unlock(&(reader->lock));
+}
+
+
+// returns TRUE if part of the mapped image file couldn't be read.
+// Buffers handed out since then may hold zeros instead of image data.
+int imageReadFailed(struct ImageReader *reader) {
+
+#ifndef __WIN32
+  return reader->map && mapfaulted;
+#else
+  return FALSE;
+#endif
+}
+
+
+// stop the reader thread, if it's still running, and free the buffers
+void stopImageReader(struct ImageReader *reader) {
+
+  int i;
+
+  if (reader->map) {
+#ifndef __WIN32
+    faultmap = NULL;
+    munmap(reader->map, reader->mapsize);
+#endif
+    free(reader->buffers);
+    free(reader->carry);
+    return;
+  }
+
+  pthread_mutex_lock(&(reader->lock));
+  reader->shutdown = TRUE;
+  pthread_cond_signal(&(reader->emptied));
+  pthread_mutex_unlock(&(reader->lock));
+
+  pthread_join(reader->thread, NULL);
+
+  for (i = 0; i < reader->numbuffers; i++) {
+    free(reader->buffers[i].allocation);
+  }
+  free(reader->buffers);
+  free(reader->carry);
+  if (reader->directfd >= 0) {
+    close(reader->directfd);
+  }
+  pthread_mutex_destroy(&(reader->lock));
+  pthread_cond_destroy(&(reader->filled));
+  pthread_cond_destroy(&(reader->emptied));
+}
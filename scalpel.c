@@ -41,9 +41,12 @@ char *__progname;
 void usage() {
 
   printf("Carves files from a disk image based on file headers and footers.\n");
-  printf("\nUsage: scalpel [-b] [-c <config file>] [-d] [-h|V] [-i <file>]\n");
-  printf("                 [-m blocksize] [-n] [-o <outputdir>] [-O num] [-q clustersize]\n");
-  printf("                 [-r] [-s num] [-t <blockmap file>] [-u] [-v]\n");
+  printf("\nUsage: scalpel [-b] [-c <config file>] [-d] [-D] [-h|V] [-H <dir>] [-i <file>]\n");
+  printf("                 [-j threads] [-k minutes] [-m blocksize] [-M megabytes]\n");
+  printf("                 [-n] [-o <outputdir>] [-O num]\n");
+  printf("                 [-q clustersize] [-r] [-R] [-s num] [-t <blockmap file>] [-T]\n");
+  printf("                 [-u] [-v]\n");
+  printf("                 [-U <blockmap file>] [-z]\n");
   printf("                 <imgfile> [<imgfile>] ...\n\n");
   printf("-b  Carve files even if defined footers aren't discovered within\n");
   printf("    maximum carve size for file type [foremost 0.69 compat mode].\n");
@@ -51,29 +54,61 @@ void usage() {
   printf("-d  Generate header/footer database; will bypass certain optimizations\n");
   printf("    and discover all footers, so performance suffers.  Doesn't affect\n");
   printf("    the set of files carved.  **EXPERIMENTAL**\n");
+  printf("    The database is binary unless -T is given.\n");
+  printf("-D  Bypass the page cache: read disk images with direct I/O and drop\n");
+  printf("    carved files from the cache as they are closed.  Avoids evicting\n");
+  printf("    other processes' data when carving large devices.\n");
   printf("-h  Print this help message and exit.\n");
+  printf("-H  Carve using the header/footer databases that an earlier run with\n");
+  printf("    -d wrote to this directory, instead of searching the disk images\n");
+  printf("    for headers and footers again.  Carving options and rules' sizes\n");
+  printf("    may change, but not -r or -s.  Only rules added or changed since\n");
+  printf("    the database was written are searched for.\n");
   printf("-i  Read names of disk images from specified file.\n");
-  printf("-m  Generate/update carve coverage blockmap file.  The first 32bit\n");
-  printf("    unsigned int in the file identifies the block size. Thereafter\n");
-  printf("    each 32bit unsigned int entry in the blockmap file corresponds\n");
-  printf("    to one block in the image file.  Each entry counts how many\n");
-  printf("    carved files contain this block. Requires more memory and\n");
-  printf("    disk.  **EXPERIMENTAL**\n");
+  printf("-j  Search for headers and footers with this many threads.  Each\n");
+  printf("    thread after the first needs an additional 10MB buffer.  Carve\n");
+  printf("    lists for different file types are built in parallel, too.\n");
+  printf("    Default is 1.\n");
+  printf("-k  Checkpoint the first pass every this many minutes, and when\n");
+  printf("    it's interrupted, saving the header/footer offsets found so far\n");
+  printf("    to the output directory.  See -R.\n");
+  printf("-m  Generate/update carve coverage blockmap file.  The blockmap\n");
+  printf("    counts how many carved files contain each block of the image\n");
+  printf("    file, stored as runs of blocks with the same count.  Legacy\n");
+  printf("    blockmaps, with a 32bit count for every block, are still\n");
+  printf("    read and updated.  **EXPERIMENTAL**\n");
+  printf("-M  Keep header/footer offsets found in the first pass within this\n");
+  printf("    many megabytes of memory, moving the rest to a temporary file in\n");
+  printf("    the output directory.  Bounds header/footer offset memory only;\n");
+  printf("    the carve list built in the second pass isn't limited.  Default\n");
+  printf("    is no limit.\n");
   printf("-n  Don't add extensions to extracted files.\n");
   printf("-o  Set output directory for carved files.\n");
   printf("-O  Don't organize carved files by type. Default is to organize carved files\n");
   printf("    into subdirectories.\n");
   printf("-p  Perform image file preview; audit log indicates which files\n");
   printf("    would have been carved, but no files are actually carved.\n");
-  printf("-q  Carve only when header is cluster-aligned.\n");
+  printf("-q  Carve only when header is cluster-aligned, i.e., at a multiple of\n");
+  printf("    this block size.  Headers are searched for only at those offsets.\n");
+  printf("    Rules with ALIGN= in the configuration file keep their own\n");
+  printf("    alignment; ALIGN=1 searches for a header everywhere.\n");
   printf("-r  Find only first of overlapping headers/footers [foremost 0.69 compat mode].\n");
+  printf("-R  Resume an interrupted run in the same output directory, continuing\n");
+  printf("    the first pass from each image's last checkpoint (see -k).  Use\n");
+  printf("    the same options and configuration file as the interrupted run.\n");
   printf("-s  Skip n bytes in each disk image before carving.\n");
   printf("-t  Set directory for coverage blockmap.  **EXPERIMENTAL**\n");
+  printf("-T  Write the header/footer database (-d) in the old text format,\n");
+  printf("    for external tools.\n");
   printf("-u  Use carve coverage blockmap when carving.  Carve only sections\n");
   printf("    of the image whose entries in the blockmap are 0.  These areas\n");
   printf("    are treated as contiguous regions.  **EXPERIMENTAL**\n");
+  printf("-U  Convert a legacy coverage blockmap file to the compact format\n");
+  printf("    and exit.\n");
   printf("-V  Print copyright information and exit.\n");
   printf("-v  Verbose mode.\n");
+  printf("-z  Compress header/footer offsets found in the first pass.  Saves\n");
+  printf("    memory when a header or footer matches millions of times.\n");
 }
 
 
@@ -147,9 +182,9 @@ int extractSearchSpecData(struct SearchSpecLine *s,char **tokenarray) {
   memcpy(s->end,tokenarray[4],s->endlength);
 
   init_bm_table(s->begin,s->begin_bm_table,s->beginlength,
-		s->casesensitive);
+		s->casesensitive,&(s->begin_anchor),&(s->begin_anchorlength));
   init_bm_table(s->end,s->end_bm_table,s->endlength,
-		s->casesensitive);
+		s->casesensitive,&(s->end_anchor),&(s->end_anchorlength));
   return SCALPEL_OK;
 }
 
@@ -160,6 +195,8 @@ int processSearchSpecLine(struct scalpelState *state, char *buffer,
   char *buf = buffer;
   char *token;
   char **tokenarray = (char **) malloc(6*sizeof(char[MAX_STRING_LENGTH+1]));
+  char *alignend;
+  unsigned long alignment = 0;
   int i = 0, err = 0, len = strlen(buffer);
 
   // murder CTRL-M (0x0d) characters that terminate a line
@@ -198,9 +235,21 @@ int processSearchSpecLine(struct scalpelState *state, char *buffer,
     return SCALPEL_OK;
   }
 
-  while (token && (i < NUM_SEARCH_SPEC_ELEMENTS)){
-    tokenarray[i] = token;
-    i++;
+  while (token) {
+    // ALIGN=<bytes> may appear anywhere after the header
+    if (i > 3 && !strncasecmp(token,"ALIGN=",strlen("ALIGN="))) {
+      alignment = strtoul(token+strlen("ALIGN="),&alignend,10);
+      if (alignment == 0 || *alignend != 0 || alignment > UINT_MAX) {
+	fprintf(stderr,
+		"\nERROR: In line %d of the configuration file, invalid alignment %s.\n",
+		lineNumber,token);
+	return SCALPEL_ERROR_NO_SEARCH_SPEC;
+      }
+    }
+    else if (i < NUM_SEARCH_SPEC_ELEMENTS) {
+      tokenarray[i] = token;
+      i++;
+    }
     token = strtok(NULL," \t\n");
   }
 
@@ -233,6 +282,7 @@ int processSearchSpecLine(struct scalpelState *state, char *buffer,
 	      ,lineNumber);
     }
   }
+  state->SearchSpec[state->specLines].alignment = (unsigned int)alignment;
   state->specLines++;
   return SCALPEL_OK;
 }
@@ -241,7 +291,7 @@ int processSearchSpecLine(struct scalpelState *state, char *buffer,
 // process configuration file
 int readSearchSpecFile(struct scalpelState *state) {
 
-  int lineNumber = 0, status;
+  int lineNumber = 0, status, i;
   FILE *f;
 
   char *buffer = malloc((NUM_SEARCH_SPEC_ELEMENTS * MAX_STRING_LENGTH + 1) * sizeof(char));
@@ -288,7 +338,20 @@ int readSearchSpecFile(struct scalpelState *state) {
 
   fclose(f);
   free(buffer);
-  return SCALPEL_OK;
+
+  // with -q, rules without their own ALIGN= are aligned to its block
+  // size
+  if (state->blockAlignedOnly) {
+    for (i = 0; i < state->specLines; i++) {
+      if (state->SearchSpec[i].alignment == 0) {
+	state->SearchSpec[i].alignment = state->alignedblocksize;
+      }
+    }
+  }
+
+  // compile all header and footer needles into a single automaton, so
+  // each buffer of an image is searched only once
+  return buildSearchAutomaton(state);
 }
 
 // Register the signal-handler that will write to the audit file and
@@ -338,16 +401,14 @@ void initializeState(char **argv, struct scalpelState *state) {
   // et al.  The header/footer database is re-initialized in "dig.c"
   // after each image file is processed (numfilestocarve and
   // organizeDirNum are not). Storage for the header/footer offsets
-  // will be reallocated as needed.
+  // will be allocated as needed.
 
   for (i=0; i < MAX_FILE_TYPES; i++) {
-    state->SearchSpec[i].offsets.headers = 0;
-    state->SearchSpec[i].offsets.footers = 0;
-    state->SearchSpec[i].offsets.numheaders = 0;
-    state->SearchSpec[i].offsets.numfooters = 0;
-    state->SearchSpec[i].offsets.headerstorage = 0;
-    state->SearchSpec[i].offsets.footerstorage = 0;
+    initOffsetList(&(state->SearchSpec[i].offsets.headers));
+    initOffsetList(&(state->SearchSpec[i].offsets.footers));
     state->SearchSpec[i].numfilestocarve = 0;
+    state->SearchSpec[i].fromdatabase = FALSE;
+    state->SearchSpec[i].alignment = 0;
     state->SearchSpec[i].organizeDirNum = 0;
   }
 
@@ -360,13 +421,29 @@ void initializeState(char **argv, struct scalpelState *state) {
   state->carveWithMissingFooters = FALSE;
   state->noSearchOverlap = FALSE;
   state->generateHeaderFooterDatabase = FALSE;
+  state->textHeaderFooterDatabase = FALSE;
+  state->headerFooterDatabaseDirectory = NULL;
+  state->checkpointInterval = 0;
+  state->resumeFromCheckpoints = FALSE;
   state->updateCoverageBlockmap = FALSE;
   state->useCoverageBlockmap = FALSE;
   state->blockAlignedOnly = FALSE;
   state->organizeSubdirectories = TRUE;
   state->previewMode = FALSE;
+  state->bypassPageCache = FALSE;
+  state->compressOffsets = FALSE;
+  state->memoryBudget = 0;
+  state->offsetSpillFile = NULL;
+  state->offsetSpillName = NULL;
+  state->offsetSpillUsers = 0;
+  pthread_mutex_init(&(state->offsetSpillLock), NULL);
+  state->convertBlockmapFile = NULL;
   state->ignoreEmbedded = FALSE;
   state->auditFile = NULL;
+  state->automaton = NULL;
+  state->numSearchThreads = 1;
+  state->searchTraffic = 0;
+  state->constantFillSkipped = 0;
 
   // default values for output directory, config file, wildcard character,
   // coverage blockmap directory
@@ -398,7 +475,7 @@ void processCommandLineArgs(int argc, char **argv,
 			    struct scalpelState *state) {
   int i;
 
-  while ((i = getopt(argc, argv, "bhvVundpq:rt:c:o:s:i:m:O")) != -1) {
+  while ((i = getopt(argc, argv, "bhvVundDpq:rRt:Tc:o:s:i:j:k:m:M:OzU:H:")) != -1) {
     switch (i) {
 
     case 'V':
@@ -423,6 +500,15 @@ void processCommandLineArgs(int argc, char **argv,
       state->generateHeaderFooterDatabase = TRUE;
       break;
 
+    case 'T':
+      state->textHeaderFooterDatabase = TRUE;
+      break;
+
+    case 'H':
+      state->headerFooterDatabaseDirectory = (char *) malloc(MAX_STRING_LENGTH * sizeof(char));
+      snprintf(state->headerFooterDatabaseDirectory,MAX_STRING_LENGTH,"%s",optarg);
+      break;
+
       // -e support is currently a work-in-progress and will be enabled in a future release
       //    case 'e':
       //      state->ignoreEmbedded=TRUE;
@@ -451,10 +537,18 @@ void processCommandLineArgs(int argc, char **argv,
       state->organizeSubdirectories = FALSE;
       break;
 
+    case 'D':
+      state->bypassPageCache = TRUE;
+      break;
+
     case 'p':
       state->previewMode = TRUE;
       break;
 
+    case 'z':
+      state->compressOffsets = TRUE;
+      break;
+
     case 'b':
       state->carveWithMissingFooters = TRUE;
       break;
@@ -464,6 +558,39 @@ void processCommandLineArgs(int argc, char **argv,
       state->inputFileList = optarg;
       break;
 
+    case 'j':
+      state->numSearchThreads = atoi(optarg);
+      if (state->numSearchThreads <= 0 ||
+	  state->numSearchThreads > MAX_SEARCH_THREADS) {
+	fprintf(stderr,
+		"\nERROR: Number of threads for -j must be between 1 and %d.\n",
+		MAX_SEARCH_THREADS);
+	exit(1);
+      }
+      break;
+
+    case 'k':
+      if (atoi(optarg) <= 0) {
+	fprintf(stderr,
+		"\nERROR: Checkpoint interval for -k must be at least 1 minute.\n");
+	exit(1);
+      }
+      state->checkpointInterval = atoi(optarg) * 60;
+      break;
+
+    case 'R':
+      state->resumeFromCheckpoints = TRUE;
+      break;
+
+    case 'M':
+      if (atoi(optarg) <= 0) {
+	fprintf(stderr,
+		"\nERROR: Memory budget for -M must be at least 1 megabyte.\n");
+	exit(1);
+      }
+      state->memoryBudget = (unsigned long long)atoi(optarg) * MEGABYTE;
+      break;
+
     case 'n':
       state->modeNoSuffix = TRUE;
       fprintf (stdout,"Extracting files without filename extensions.\n");
@@ -487,6 +614,10 @@ void processCommandLineArgs(int argc, char **argv,
       state->useCoverageBlockmap = TRUE;
       break;
 
+    case 'U':
+      state->convertBlockmapFile = optarg;
+      break;
+
     case 'v':
       state->modeVerbose = TRUE;
       break;
@@ -495,6 +626,14 @@ void processCommandLineArgs(int argc, char **argv,
       exit(1);
     }
   }
+
+  // checkpoints don't record which offsets came from a saved database
+  if (state->headerFooterDatabaseDirectory &&
+      (state->checkpointInterval || state->resumeFromCheckpoints)) {
+    fprintf(stderr,
+	    "\nERROR: -H can't be combined with -k or -R.\n");
+    exit(1);
+  }
 }
 
 // full pathnames for all files used
@@ -609,6 +748,11 @@ int main(int argc, char **argv) {
 
   processCommandLineArgs(argc,argv,&state);
 
+  // convert a legacy coverage blockmap instead of carving
+  if (state.convertBlockmapFile) {
+    exit(convertCoverageBlockmap(&state, state.convertBlockmapFile) == SCALPEL_OK ? 0 : 1);
+  }
+
   convertFileNames(&state);
 
   if (state.modeVerbose) {
@@ -90,6 +90,12 @@ char *basename(char *path);
 extern char *optarg;
 extern int optind;
 int getopt(int argc, char *const argv[], const char *optstring);
+// no preadv() on Win32, so coverage map-based reads are done one
+// struct iovec at a time
+struct iovec {
+  void *iov_base;
+  size_t iov_len;
+};
 
 #ifdef __MINGW32__
 #define realpath(A,B)    _fullpath(B,A,PATH_MAX)
@@ -109,6 +115,15 @@ void setProgramName(char *s);
 
 #ifndef __WIN32
 #include <sys/mount.h>
+#include <sys/uio.h>
+#endif
+
+// vectorized search kernels in helpers.c need GCC (or clang) on x86.
+// Whether the CPU supports them is checked at run time.  Build with
+// -DSCALPEL_NO_SIMD to disable them entirely.
+#if (defined(__GNUC__) || defined(__clang__)) && \
+  (defined(__x86_64__) || defined(__i386__)) && ! defined(SCALPEL_NO_SIMD)
+#define SCALPEL_SIMD_X86
 #endif
 
 
@@ -148,6 +163,9 @@ void setProgramName(char *s);
 
 #define MAX_FILES_PER_SUBDIRECTORY    1000
 
+// pass 1 search threads (-j); each needs a SIZE_OF_BUFFER buffer
+#define MAX_SEARCH_THREADS             64
+
 
 #define SCALPEL_OK                     0
 #define SCALPEL_ERROR_NO_SEARCH_SPEC   1
@@ -224,16 +242,59 @@ extern int  errno;
                                 // of current buffer
 
 typedef struct CarveInfo {
-  char *filename;            // output filename for file to carve
+  char *filename;            // output filename for file to carve, made
+                             // when the file is first opened
   FILE *fp;                  // file descriptor for file to carve
   unsigned long long start;  // offset of first byte in file
   unsigned long long stop;   // offset of last byte in file
   char chopped;              // is carved file's length constrained
                              // by max file size for type? (i.e., could
                              // the file actually be longer?
+  unsigned long long index;  // creation order
+  int needlenum;             // file type, and # of carved file and of
+  unsigned long dirnum;      // its subdirectory, for naming the file
+  unsigned long long filenum;
 } CarveInfo;
 
 
+// one step of work for a SIZE_OF_BUFFER-sized buffer in pass 2
+typedef struct CarveWork {
+  struct CarveInfo *carve;
+  int operation;             // STARTCARVE, STOPCARVE, ...
+} CarveWork;
+
+// consecutive buffers (in SIZE_OF_BUFFER units) with carving work
+typedef struct CarveRange {
+  unsigned long long first;
+  unsigned long long last;
+} CarveRange;
+
+// all carving work for an image file, swept in buffer order in pass
+// 2.  Only carves that start in, or are still being carved in, the
+// current buffer are looked at, so memory and time per buffer are
+// proportional to the number of carves involved.
+// enough slabs for 2^50 carves (see dig.c)
+#define MAX_CARVE_SLABS    40
+
+typedef struct CarveList {
+  struct CarveInfo *slabs[MAX_CARVE_SLABS];  // storage for the carves
+  int numslabs;
+  unsigned long long slabused;      // # of carves in last slab
+  struct CarveInfo **carves;        // in creation order
+  unsigned long long numcarves;
+  unsigned long long carvestorage;
+  struct CarveInfo **bystart;       // sorted by start
+  unsigned long long nextstart;     // first in bystart not started yet
+  struct CarveInfo **active;        // started in an earlier buffer and
+  unsigned long long numactive;     // not stopped yet
+  struct CarveRange *ranges;        // sorted, don't overlap or touch
+  unsigned long long numranges;
+  struct CarveWork *work;           // for the current buffer
+  unsigned long long numwork;
+  struct CarveWork *scratch;
+} CarveList;
+
+
 // Each struct SearchSpecLine defines a particular file type,
 // including header and footer information.  The following structure,
 // SearchSpecOffsets, defines the absolute locations of all matching
@@ -242,15 +303,89 @@ typedef struct CarveInfo {
 // or device file, the header and footer locations are sorted in
 // ascending order.
 
+// enough chunks for 2^54 offsets (see offsets.c)
+#define MAX_OFFSET_CHUNKS      44
+
+// offsets moved to disk when -M limits memory (see offsets.c).  All
+// lists share one spill file, in which each list's offsets are stored
+// as runs.
+typedef struct OffsetSpillRun {
+  unsigned long long first;                    // index of first offset
+  unsigned long long count;
+  unsigned long long position;                 // in the spill file
+} OffsetSpillRun;
+
+typedef struct OffsetSpill {
+  struct scalpelState *state;                  // holds the spill file
+  struct OffsetSpillRun *runs;                 // in index order
+  int numruns;
+  int runstorage;
+  unsigned long long *window;                  // offsets read back
+  unsigned long long windowstart;              // index of window[0]
+  unsigned long long windowcount;              // # valid in window
+} OffsetSpill;
+
+typedef struct OffsetList {
+  unsigned long long count;                    // # stored positions
+  unsigned long long spilled;                  // # of those on disk
+  struct OffsetSpill *spill;
+  unsigned long long last;                     // last position stored
+  int compressed;                              // -z: delta/varint coded
+  unsigned long long *chunks[MAX_OFFSET_CHUNKS];  // uncompressed positions
+  int numchunks;
+  unsigned char *bytes[MAX_OFFSET_CHUNKS];     // compressed positions
+  int numbytechunks;
+  unsigned long long bytesused;                // in last byte chunk
+  struct OffsetList *blocks;                   // where each compressed
+                                               // block starts
+  unsigned char *cursor;                       // sequential decoding of
+  unsigned long long cursorindex;              // compressed positions
+  unsigned long long cursorvalue;
+} OffsetList;
+
+// summaries of an OffsetList for finding offsets by value (see
+// offsets.c).  Level 0 holds the largest and smallest of each group
+// of OFFSET_INDEX_FANOUT offsets, and each level above summarizes
+// groups of the level below.
+#define OFFSET_INDEX_FANOUT    64
+#define MAX_OFFSET_INDEX_LEVELS 11
+
+typedef struct OffsetIndex {
+  unsigned long long *max[MAX_OFFSET_INDEX_LEVELS];
+  unsigned long long *min[MAX_OFFSET_INDEX_LEVELS];
+  unsigned long long count[MAX_OFFSET_INDEX_LEVELS];  // # of groups
+  int numlevels;
+} OffsetIndex;
+
 typedef struct SearchSpecOffsets {
-  unsigned long long *headers;                 // positions of discovered headers
-  unsigned long long headerstorage;            // space allocated for this many header offsets
-  unsigned long long numheaders;               // # stored header positions
-  unsigned long long *footers;                 // positions of discovered headers
-  unsigned long long footerstorage;            // space allocated for this many footer offsets
-  unsigned long long numfooters;               // # stored footer positions
+  struct OffsetList headers;                   // positions of discovered headers
+  struct OffsetList footers;                   // positions of discovered footers
 } SearchSpecOffsets;
 
+// carves found for one file type by pairing its headers and footers,
+// before they're added to the carve list (see dig.c).  File types
+// are paired in parallel.
+typedef struct PlannedCarve {
+  unsigned long long start;
+  unsigned long long stop;
+  char chopped;
+} PlannedCarve;
+
+typedef struct CarvePlan {
+  struct scalpelState *state;
+  struct SearchSpecLine *needle;
+  struct PlannedCarve *carves;
+  unsigned long long numcarves;
+  unsigned long long carvestorage;
+} CarvePlan;
+
+typedef struct CarvePlanner {
+  struct CarvePlan *plans;
+  int numplans;
+  int nextplan;               // next plan to hand to a thread
+  pthread_mutex_t lock;
+} CarvePlanner;
+
 // max files to open at once during carving--modify if you get
 // a "too many files open" error message during the second carving phase.
 #ifdef __WIN32
@@ -267,17 +402,249 @@ typedef struct SearchSpecLine {
   char *begin;
   int beginlength;
   size_t begin_bm_table[UCHAR_MAX+1];
+  size_t begin_anchor;           // literal run of header searched for
+  size_t begin_anchorlength;
   char *end;
   int endlength;
   size_t end_bm_table[UCHAR_MAX+1];
+  size_t end_anchor;             // literal run of footer searched for
+  size_t end_anchorlength;
   int searchtype; // FORWARD, NEXT, REVERSE search type for footer
+  unsigned int alignment;        // header only matches at multiples of
+                                 // this (ALIGN= or -q); 0 or 1 = anywhere
   struct SearchSpecOffsets offsets;
+  int fromdatabase;                        // offsets read from a saved
+                                           // database (-H), not searched for
   unsigned long long numfilestocarve;      // # files to carve of this type
   unsigned long organizeDirNum;            // subdirectory # for organization
                                            // of files of this type
 } SearchSpecLine;
 
 
+// Multi-pattern search.  Every header and footer needle is compiled
+// into one Aho-Corasick automaton (see acsearch.c), so that each
+// buffer of an image file is searched once, regardless of the number
+// of file types.  A SearchPattern describes one needle; its "anchor"
+// is the run of non-wildcard characters the automaton looks for
+// (see findNeedleAnchor() in helpers.c).
+
+typedef struct SearchPattern {
+  int rule;                  // index of owning SearchSpecLine
+  int isfooter;              // footer (TRUE) or header (FALSE) needle?
+  char *needle;
+  int length;
+  int casesensitive;
+  int anchoroffset;          // position of anchor within needle
+  int anchorlength;          // 0 if needle is entirely wildcards
+  unsigned int alignment;    // if > 1, only tested at image offsets that
+                             // are multiples of this, not by the automaton
+  unsigned long long prefixmask;   // first (up to) 8 bytes of the needle,
+  unsigned long long prefixfold;   // for the aligned search: wildcards are
+  unsigned long long prefixvalue;  // masked out, letters may be folded
+} SearchPattern;
+
+typedef struct SearchAutomaton {
+  struct SearchPattern *patterns;  // header needle for a file type is
+  int numpatterns;                 // followed by its footer needle
+  int *wildpatterns;               // needles without an anchor
+  int numwildpatterns;
+  int *alignedpatterns;            // headers tested only at aligned
+  int numalignedpatterns;          // offsets (see searchBufferAligned())
+  unsigned char foldable[UCHAR_MAX+1];  // letters matched case-insensitively
+  unsigned char classmap[UCHAR_MAX+1];  // byte -> input class
+  int numclasses;
+  int numstates;
+  int *delta;                // transitions, premultiplied by numclasses
+  int firstmatchrow;         // rows >= this one have output
+  int *outstart;             // per state: first entry in outputs
+  int *outcount;             // per state: # of entries in outputs
+  int *outputs;              // pattern indices
+  int perneedle;             // search needles one at a time instead
+  int longestneedle;         // longest needle not in alignedpatterns
+} SearchAutomaton;
+
+// positions (relative to the start of the buffer being searched) of
+// all matches of one needle
+typedef struct SearchHitList {
+  unsigned int *positions;
+  unsigned long long numhits;
+  unsigned long long storage;
+  unsigned long long mark;   // first hit of the segment being searched
+} SearchHitList;
+
+// one SIZE_OF_BUFFER-sized chunk of an image file in pass 1.  With
+// -j, several chunks are searched at once by worker threads, but
+// their hits are entered into the header/footer database in image
+// order.
+typedef struct SearchChunk {
+  char *buffer;
+  unsigned long long length;            // # of bytes in buffer
+  unsigned long long offset;            // image position of buffer[0]
+  struct SearchHitList *hits;           // one list per needle
+  long long traffic;                    // bytes read from memory while
+                                        // searching it, or -1 if unknown
+  unsigned long long skipped;           // bytes of constant fill not searched
+} SearchChunk;
+
+// worker threads for pass 1.  The main thread hands out a batch of
+// chunks and waits until all of them have been searched.
+typedef struct SearchPool {
+  struct scalpelState *state;
+  struct SearchChunk *chunks;
+  int numchunks;             // # of chunks in current batch
+  int nextchunk;             // next chunk to hand to a worker
+  int unfinished;            // # of chunks in batch not yet searched
+  int shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t work;       // new batch or shutdown
+  pthread_cond_t done;       // batch finished
+  pthread_t *threads;
+  int numthreads;
+  int counter;               // traffic counter of the main thread, when
+                             // it searches without workers
+} SearchPool;
+
+
+// asynchronous image reader (see reader.c).  A reader thread fills a
+// ring of SIZE_OF_BUFFER-sized buffers ahead of the code that
+// processes them.
+
+#define READER_DIG        0     // pass 1: every buffer, overlapping
+#define READER_CARVE      1     // pass 2: only buffers with carving work
+
+#define READ_OK           0     // buffer holds image data
+#define READ_EOF          1     // image file exhausted
+#define READ_DONE         2     // no more carving work in image file
+#define READ_ERROR        3     // error reading image file
+
+typedef struct ReadBuffer {
+  char *buffer;                     // within allocation
+  char *allocation;
+  unsigned long long length;        // # of bytes in buffer
+  unsigned long long position;      // image position of buffer[0],
+                                    // adjusted for coverage map
+  unsigned long long fileposition;  // real file position after read
+  int status;                       // READ_OK, READ_EOF, ...
+} ReadBuffer;
+
+typedef struct ImageReader {
+  struct scalpelState *state;
+  FILE *infile;
+  int mode;                         // READER_DIG or READER_CARVE
+  unsigned long long overlap;       // READER_DIG: bytes shared by
+  char *carry;                      // consecutive buffers, saved
+  unsigned long long carrylength;   // from the previous buffer
+  unsigned long long filesize;      // READER_CARVE: is there carving
+  int (*wanted)(void *, unsigned long long);  // work in a buffer?
+  void *wantedarg;
+  int seekonly;                     // READER_CARVE: preview mode
+  char *map;                        // memory mapped image file, or NULL
+  unsigned long long mapsize;
+  int directfd;                     // image file opened with O_DIRECT,
+  unsigned long long directalignment;  // or -1
+  unsigned long long nextposition;  // next unread position, for mapped
+                                    // and direct reads
+  struct ReadBuffer *buffers;       // ring of buffers
+  int numbuffers;
+  unsigned long long produced;      // # of buffers filled by reader,
+  unsigned long long consumed;      // handed to caller,
+  unsigned long long released;      // and given back by caller
+  int shutdown;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t emptied;
+  pthread_t thread;
+} ImageReader;
+
+
+// Binary header/footer databases (-d) start with an HfdHeader and a
+// table of 'numrules' HfdRules, one for each rule in the
+// configuration file, in order.  Each rule's section holds its
+// suffix and header and footer needles (padded to a multiple of 8
+// bytes), then its header and footer offsets as unsigned long longs,
+// in the order they were found.  'needles', 'headers' and 'footers'
+// are positions in the file, so sections can be used directly if the
+// file is mmap'd.  Fields are in host byte order.
+//
+// Pass 1 checkpoints (-k) use the same format, with the
+// HFD_CHECKPOINT flag set, for the offsets found before 'resume'.
+
+#define HFD_MAGIC    "SCLPLHFD"
+#define HFD_VERSION  3
+
+// HfdHeader flags: pass 1 options the database was built with
+#define HFD_NO_SEARCH_OVERLAP  1         // -r
+#define HFD_COVERAGE_MAP       2         // -u
+#define HFD_CHECKPOINT         4         // pass 1 isn't finished
+#define HFD_ALL_FOOTERS        8         // -d
+
+typedef struct HfdHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int numrules;
+  unsigned long long confighash;           // hash of all the rules
+  unsigned long long imagesize;            // bytes searched, after -s
+  unsigned long long skip;                 // -s
+  unsigned int wildcard;
+  unsigned int flags;
+  unsigned long long resume;               // checkpoints: image file
+                                           // position to resume from
+} HfdHeader;
+
+typedef struct HfdRule {
+  unsigned long long rulehash;
+  unsigned long long needles;
+  unsigned long long headers;
+  unsigned long long numheaders;
+  unsigned long long footers;
+  unsigned long long numfooters;
+  unsigned long long maxlength;
+  unsigned int suffixlength;
+  unsigned int beginlength;
+  unsigned int endlength;
+  int casesensitive;
+  int searchtype;
+  unsigned int reserved;
+} HfdRule;
+
+
+// Coverage blockmap files in the compact format start with a
+// CoverageMapHeader, followed by 'numruns' CoverageRuns in block
+// order, one for each run of blocks covered by the same # of carved
+// files.  Blocks not in a run aren't covered.  Like legacy blockmaps
+// (the block size, then an unsigned int counter for each block),
+// fields are in host byte order.
+
+#define COVERAGE_MAP_MAGIC    "SCLPLMAP"
+#define COVERAGE_MAP_VERSION  1
+
+typedef struct CoverageMapHeader {
+  char magic[8];
+  unsigned int version;
+  unsigned int blocksize;
+  unsigned long long numblocks;
+  unsigned long long numruns;
+} CoverageMapHeader;
+
+typedef struct CoverageRun {
+  unsigned long long start;                // first block
+  unsigned long long length;               // # of blocks
+  unsigned long long count;                // # of carved files covering
+                                           // each block
+} CoverageRun;
+
+
+// a run of uncovered blocks in the image file, for reads that use the
+// coverage blockmap.  'logical' is the run's position in the image
+// with covered blocks left out, 'physical' its real position.
+
+typedef struct CoverageExtent {
+  unsigned long long logical;
+  unsigned long long physical;
+  unsigned long long length;
+} CoverageExtent;
+
+
 typedef struct scalpelState {
   char *imagefile;
   char *conffile;
@@ -293,14 +660,35 @@ typedef struct scalpelState {
   char *coveragedirectory;
   unsigned int coverageblocksize;
   FILE *coverageblockmap;
-  unsigned char *coveragebitmap;
+  int coveragecompact;                     // blockmap in compact format?
+  unsigned int *coveragemap;               // legacy coverage blockmap file,
+  size_t coveragemapsize;                  // mmap'd for updates, or NULL
+  struct CoverageRun *coverageruns;        // compact blockmap's runs
+  unsigned long long coveragenumruns;
+  struct CoverageRun *coverageupdates;     // blocks of carved files, for
+  unsigned long long coveragenumupdates;   // a compact blockmap
+  unsigned long long coverageupdatestorage;
+  char *convertBlockmapFile;               // -U: legacy blockmap to convert
+  unsigned long long *coveragebitmap;      // 1 bit per block, set if
+                                           // the block is covered
+  unsigned long long *coveragerank;        // # of covered blocks before
+                                           // each 512 block superblock
   unsigned long long coveragenumblocks;
+  unsigned long long coverageuncovered;    // # of blocks not covered
+  struct CoverageExtent *coverageextents;  // uncovered runs, in order
+  unsigned long long coveragenumextents;
+  char *coveragediscard;                   // sink for covered bytes
   int useInputFileList;
   char *inputFileList;
   int carveWithMissingFooters;
   int noSearchOverlap;
   int ignoreEmbedded;
   int generateHeaderFooterDatabase;
+  int textHeaderFooterDatabase;            // -T: old text format for -d
+  char *headerFooterDatabaseDirectory;     // -H: carve from saved databases
+  int checkpointInterval;                  // -k: seconds between pass 1
+                                           // checkpoints, 0 for none
+  int resumeFromCheckpoints;               // -R
   int updateCoverageBlockmap;
   int useCoverageBlockmap;
   int organizeSubdirectories;
@@ -308,6 +696,20 @@ typedef struct scalpelState {
   int blockAlignedOnly;
   unsigned int alignedblocksize;
   int previewMode;
+  int bypassPageCache;
+  int compressOffsets;
+  unsigned long long memoryBudget;         // -M: bytes for offsets, or 0
+  FILE *offsetSpillFile;                   // offsets moved to disk by -M,
+  char *offsetSpillName;                   // shared by all offset lists
+  int offsetSpillUsers;                    // # of lists with offsets in it
+  pthread_mutex_t offsetSpillLock;         // lists are read in parallel
+  struct SearchAutomaton *automaton;
+  int numSearchThreads;
+  long long searchTraffic;                 // bytes read from memory by the
+                                           // pass 1 search, or -1 if the
+                                           // counters are unavailable
+  unsigned long long constantFillSkipped;  // bytes of constant fill pass 1
+                                           // didn't search
 } scalpelState;
 
 
@@ -324,6 +726,65 @@ typedef struct Fragment {
 // prototypes for visible dig.c functions
 int digImageFile(struct scalpelState *state);
 int carveImageFile(struct scalpelState *state);
+int fseeko_use_coverage_map(struct scalpelState *state, FILE *fp, off64_t offset);
+off64_t ftello_use_coverage_map(struct scalpelState *state, FILE *fp);
+size_t fread_use_coverage_map(struct scalpelState *state, void *ptr, 
+			      size_t size, size_t nmemb, FILE *stream);
+int convertCoverageBlockmap(struct scalpelState *state, char *fn);
+
+
+// prototypes for visible reader.c functions
+int startDigReader(struct scalpelState *state, struct ImageReader *reader,
+		   FILE *infile, unsigned long long overlap, int numbuffers);
+int startCarveReader(struct scalpelState *state, struct ImageReader *reader,
+		     FILE *infile, unsigned long long filesize,
+		     int (*wanted)(void *, unsigned long long), void *wantedarg,
+		     int seekonly, int numbuffers);
+struct ReadBuffer *nextReadBuffer(struct ImageReader *reader);
+void releaseReadBuffer(struct ImageReader *reader);
+int imageReadFailed(struct ImageReader *reader);
+void stopImageReader(struct ImageReader *reader);
+
+
+// prototypes for visible offsets.c functions
+void initOffsetList(struct OffsetList *list);
+int appendOffset(struct scalpelState *state, struct OffsetList *list,
+		 unsigned long long offset, char *structure);
+unsigned long long offsetAt(struct OffsetList *list, unsigned long long index);
+unsigned long long lastOffset(struct OffsetList *list);
+unsigned long long offsetListMemory(struct OffsetList *list);
+void destroyOffsetList(struct OffsetList *list);
+void buildOffsetIndex(struct scalpelState *state, struct OffsetList *list,
+		      struct OffsetIndex *index);
+unsigned long long firstOffsetAbove(struct OffsetList *list,
+				    struct OffsetIndex *index,
+				    unsigned long long from,
+				    unsigned long long value);
+unsigned long long lastOffsetAbove(struct OffsetList *list,
+				   struct OffsetIndex *index,
+				   unsigned long long from,
+				   unsigned long long before,
+				   unsigned long long value);
+unsigned long long lastOffsetAtMost(struct OffsetList *list,
+				    struct OffsetIndex *index,
+				    unsigned long long from,
+				    unsigned long long before,
+				    unsigned long long value);
+void destroyOffsetIndex(struct OffsetIndex *index);
+
+
+// prototypes for visible iouring.c functions
+struct IoRing;
+struct IoRing *startIoRing(struct scalpelState *state);
+FILE *openIoFile(char *filename, int truncate);
+int queueIoWrite(struct IoRing *ring, FILE *fp, char *buffer,
+		 unsigned long long length, unsigned long long offset,
+		 unsigned long long window, char *filename);
+int closeAfterIo(struct IoRing *ring, FILE *fp);
+void freeAfterIo(struct IoRing *ring, char *filename,
+		 unsigned long long window);
+int waitIoRing(struct IoRing *ring, unsigned long long window);
+int stopIoRing(struct IoRing *ring);
 
 
 // prototypes for visible helpers.c functions
@@ -334,22 +795,55 @@ void scalpelLog(struct scalpelState *state, char *format, ...);
 void handleError(struct scalpelState *s, int error);
 int memwildcardcmp(const void* s1, const void* s2,
 		   size_t n, int caseSensitive);
+int charactersMatch(char a, char b, int caseSensitive);
 
+void findNeedleAnchor(char *needle, size_t len, size_t *anchor,
+		      size_t *anchorlength);
 void init_bm_table(char *needle, size_t table[UCHAR_MAX + 1],
-		   size_t len, int casesensitive);
+		   size_t len, int casesensitive,
+		   size_t *anchor, size_t *anchorlength);
 int findLongestNeedle(struct SearchSpecLine* SearchSpec);
 
 char *bm_needleinhaystack(char *needle, size_t needle_len,
                           char *haystack, size_t haystack_len,
-                          size_t table[UCHAR_MAX + 1], int casesensitive);
+                          size_t table[UCHAR_MAX + 1],
+			  size_t anchor, size_t anchorlength,
+			  int casesensitive);
+int vectorSearchWidth(void);
+int openTrafficCounter(void);
+long long readTrafficCounter(int counter);
+void closeTrafficCounter(int counter);
+int constantFillByte(char *buf, size_t len);
 int translate(char *str);
 char *skipWhiteSpace(char *str);
 void setttywidth(int signum);
 
+// prototypes for visible acsearch.c functions
+int buildSearchAutomaton(struct scalpelState *state);
+void destroySearchAutomaton(struct SearchAutomaton *ac);
+struct SearchHitList *allocateSearchHits(struct scalpelState *state,
+					 struct SearchAutomaton *ac);
+void destroySearchHits(struct SearchAutomaton *ac, struct SearchHitList *hits);
+void searchBufferAutomaton(struct scalpelState *state, struct SearchAutomaton *ac,
+			   char *buf, unsigned long long len,
+			   struct SearchHitList *hits);
+void searchBufferPerNeedle(struct scalpelState *state,
+			   struct SearchAutomaton *ac,
+			   char *buf, unsigned long long len,
+			   struct SearchHitList *hits);
+void searchBufferAligned(struct scalpelState *state,
+			 struct SearchAutomaton *ac,
+			 char *buf, unsigned long long len,
+			 unsigned long long offset,
+			 struct SearchHitList *hits);
+void searchBuffer(struct scalpelState *state, struct SearchAutomaton *ac,
+		  struct SearchChunk *chunk);
+
 // prototypes for visible files.c functions
 unsigned long long measureOpenFile(FILE *f, struct scalpelState *state);
 int openAuditFile(struct scalpelState* state);
 int closeFile(FILE* f);
+void dropFromPageCache(int fd);
 
 
 // WIN32 string.h wierdness